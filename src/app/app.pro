@@ -33,6 +33,7 @@ SOURCES += \
     ../shared/jsonconv.cpp \
     ../shared/library.cpp \
     ../shared/library_serialize.cpp \
+    ../shared/library_compact.cpp \
     \
     ../../3rdparty/gumbo-parser/src/attribute.c \
     ../../3rdparty/gumbo-parser/src/char_ref.c \
@@ -70,6 +71,7 @@ HEADERS += \
     ../shared/library.hpp \
     ../shared/library_types.hpp \
     ../shared/library_messages.hpp \
+    ../shared/nameregistry.hpp \
     ../shared/result.hpp \
 
 RESOURCES += \
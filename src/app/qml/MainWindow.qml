@@ -116,7 +116,7 @@ Rectangle {
         SimpleButton {
             visible: _app.database.downloadsPending
             fontSize: _style.fontSizeIndicator
-            label: "Downloading..."
+            label: _app.database.downloadStatusText || "Downloading..."
         }
     }
 
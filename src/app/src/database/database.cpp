@@ -21,9 +21,8 @@ Database::Database(HttpClient *httpClient, QObject *parent)
     connect(m_http, &HttpRequester::receivedReply, this, &Database::onNetworkReplyFinished);
     connect(m_http, &HttpRequester::networkError, this, &Database::onNetworkError);
 
-    connect(&m_downloadQueryTimer, &QTimer::timeout, this, &Database::onDownloadQueryTimer);
-    m_downloadQueryTimer.setSingleShot(true);
-    m_downloadQueryTimer.start(5000);
+    connect(&m_subscriptionRetryTimer, &QTimer::timeout, this, &Database::ensureSubscribed);
+    m_subscriptionRetryTimer.setSingleShot(true);
 }
 
 Database::~Database()
@@ -35,6 +34,7 @@ void Database::setLibrary(const Moosick::Library &library)
     m_library = library;
     m_hasLibrary = true;
     emit libraryChanged();
+    ensureSubscribed();
 }
 
 bool Database::isSyncing() const
@@ -53,14 +53,19 @@ HttpRequestId Database::sync()
         reply = m_http->requestFromServer(Message(LibraryRequest()).toJson());
         m_requests[reply] = LibraryGet;
     }
-    // if we don't yet know the remote library ID, make sure to get that one first
+    // if we don't yet know whether the server has the same library, the server tells us
+    // that ours is still current, or else sends the one it has
     else if (!m_hasRemoteLibraryId) {
-        reply = m_http->requestFromServer(Message(IdRequest()).toJson());
+        ConditionalLibraryRequest request;
+        request.libraryId = QString::fromUtf8(m_library.id().toString());
+        request.revision = m_library.revision();
+        reply = m_http->requestFromServer(Message(request).toJson());
         m_requests[reply] = LibraryId;
     }
-    // do a partial update if we already have a library
+    // do a partial update if we already have a library,
+    // the server may decide to send a full snapshot if that's cheaper
     else {
-        ChangeListRequest request;
+        SyncRequest request;
         request.revision = m_library.revision();
         reply = m_http->requestFromServer(Message(request).toJson());
         m_requests[reply] = LibraryPartialSync;
@@ -251,10 +256,14 @@ HttpRequestId Database::setItemDetails(
 void Database::onNetworkReplyFinished(HttpRequestId reply, const QByteArray &data)
 {
     const RequestType requestType = m_requests.take(reply);
-    Result<Message, EnjsonError> parsedMsg = Message::fromJson(data);
+    Result<Message, EnjsonError> parsedMsg = Message::decode(data);
     if (parsedMsg.hasError()) {
         qWarning().noquote() << "Received invalid message:" << parsedMsg.takeError().toString();
         qWarning().noquote() << data;
+        if (requestType == Subscription)
+            onSubscriptionFailed();
+        else if (requestType == LibraryGet || requestType == LibraryId || requestType == LibraryPartialSync)
+            onSyncFinished(true);
         return;
     }
     Message message = parsedMsg.takeValue();
@@ -263,6 +272,9 @@ void Database::onNetworkReplyFinished(HttpRequestId reply, const QByteArray &dat
     if (error)
         qWarning().noquote() << "Failed processing server response:" << error.takeValue();
 
+    if (requestType == LibraryGet || requestType == LibraryId || requestType == LibraryPartialSync)
+        onSyncFinished(error.hasValue());
+
     m_changesPending = hasRunningRequestType(LibraryChanges);
     emit changesPendingChanged(m_changesPending);
     emit isSyncingChanged();
@@ -285,10 +297,16 @@ Option<QString> Database::processServerResponse(HttpRequestId reply, Database::R
         return onNewLibrary(library);
     }
     case LibraryId: {
-        EXPECT_MESSAGE_TYPE(IdResponse, id);
-        return onNewRemoteId(id);
+        if (const LibraryResponse *library = msg.as<LibraryResponse>())
+            return onNewLibrary(library);
+        EXPECT_MESSAGE_TYPE(LibraryNotModified, notModified);
+        return onLibraryNotModified(notModified);
     }
     case LibraryPartialSync: {
+        if (const LibraryResponse *library = msg.as<LibraryResponse>())
+            return onNewLibrary(library);
+        if (const CompactedChangeListResponse *compacted = msg.as<CompactedChangeListResponse>())
+            return applyCompactedLibraryChanges(compacted);
         EXPECT_MESSAGE_TYPE(ChangeListResponse, changes);
         return applyLibraryChanges(changes->changes);
     }
@@ -297,10 +315,12 @@ Option<QString> Database::processServerResponse(HttpRequestId reply, Database::R
         EXPECT_MESSAGE_TYPE(DownloadResponse, download);
         return onDownloadResponse(reply, download);
     }
-    case DownloadQuery: {
-        EXPECT_MESSAGE_TYPE(DownloadQueryResponse, download);
-        return onDownloadQueryResponse(download);
-        break;
+    case Subscription: {
+        // e.g. an Error when dbserver is down, try again later
+        if (!msg.as<SubscribeResponse>())
+            onSubscriptionFailed();
+        EXPECT_MESSAGE_TYPE(SubscribeResponse, subscription);
+        return onSubscribeResponse(subscription);
     }
     case LibraryChanges: {
         EXPECT_MESSAGE_TYPE(ChangesResponse, changes);
@@ -319,6 +339,11 @@ void Database::onNetworkError(HttpRequestId requestId, QNetworkReply::NetworkErr
 {
     const RequestType requestType = m_requests.take(requestId);
     qWarning() << "Network error for" << requestType << ": " << error;
+
+    if (requestType == Subscription)
+        onSubscriptionFailed();
+    else if (requestType == LibraryGet || requestType == LibraryId || requestType == LibraryPartialSync)
+        onSyncFinished(true);
 }
 
 Option<QString> Database::onNewLibrary(const LibraryResponse *message)
@@ -334,69 +359,135 @@ Option<QString> Database::onNewLibrary(const LibraryResponse *message)
     m_remoteId = m_library.id();
     emit libraryChanged();
     emit newLibrary();
+    ensureSubscribed();
     return {};
 }
 
-Option<QString> Database::onNewRemoteId(const IdResponse *message)
+Option<QString> Database::onLibraryNotModified(const LibraryNotModified *message)
 {
-    if (!m_remoteId.fromString(message->id->toUtf8()))
-        return "Failed to parse ID: " + *message->id;
+    // echoes the revision we asked about, which we can only have moved past since
+    if (message->revision > m_library.revision())
+        return QString("Server claims an unchanged library at a newer revision");
 
     m_hasRemoteLibraryId = true;
+    m_remoteId = m_library.id();
+    return {};
+}
 
-    // wrong library ID? -> request fresh one
-    if (m_hasLibrary && m_library.id() != m_remoteId) {
-        m_hasLibrary = false;
-        m_library = Moosick::Library();
-    }
+void Database::ensureSubscribed()
+{
+    // we can only follow changes once we know where to start from, which a running sync is about to change
+    if (m_subscription || !m_hasLibrary || isSyncing())
+        return;
 
-    sync(); // continue syncing, either full or partial download
-    return {};
+    m_subscriptionRetryTimer.stop();
+
+    SubscribeRequest request;
+    request.revision = m_library.revision();
+    request.downloadsVersion = m_downloadsVersion;
+    request.timeoutSecs = 30;
+    m_subscription = m_http->requestFromServer(Message(request).toJson());
+    m_requests[m_subscription] = Subscription;
+}
+
+void Database::onSubscriptionFailed()
+{
+    // don't hammer a server that is unreachable
+    m_subscription = 0;
+    m_subscriptionRetryTimer.start(5000);
 }
 
-void Database::onDownloadQueryTimer()
+void Database::onSyncFinished(bool failed)
 {
-    Q_ASSERT(!m_downloadQuery);
+    if (isSyncing() || m_subscription)
+        return;
 
-    // start a new query for the currently running downloads at the server
-    m_downloadQuery = m_http->requestFromServer(Message(MoosickMessage::DownloadQuery()).toJson());
-    m_requests[m_downloadQuery] = DownloadQuery;
+    if (failed)
+        m_subscriptionRetryTimer.start(5000);
+    else
+        ensureSubscribed();
 }
 
-Option<QString> Database::onDownloadQueryResponse(const DownloadQueryResponse *message)
+Option<QString> Database::onSubscribeResponse(const SubscribeResponse *message)
 {
-    if (!m_downloadQuery)
-        return QString("No download query in progress, something went wrong");
+    if (!m_subscription)
+        return QString("No subscription in progress, something went wrong");
 
-    m_downloadQuery = 0;
+    m_subscription = 0;
+    m_downloadsVersion = message->downloadsVersion;
+
+    // apply changes first, so that finished downloads show up together with their results
+    Option<QString> error;
+    if (m_hasLibrary) {
+        if (message->fullSyncRequired)
+            sync();
+        else
+            error = applyLibraryChanges(message->changes);
+    }
+
+    updateRunningDownloads(message->activeRequests);
+    updateDownloadStatusText(message->downloadStatus);
+
+    ensureSubscribed();
+    return error;
+}
 
+void Database::updateRunningDownloads(const QVector<DownloadQueryResponse::ActiveDownload> &activeDownloads)
+{
     // TODO: populate some QML-exportable list of current downloads, to be viewed after program start
 
-    // get download IDs from JSON data
     QVector<int> runningDownloadIds;
-    for (const DownloadQueryResponse::ActiveDownload &download : *message->activeRequests)
+    for (const DownloadQueryResponse::ActiveDownload &download : activeDownloads)
         runningDownloadIds << download.first;
 
-    // check if any of our running downloads has finished running on the server
+    // the library changes of finished downloads have already arrived along with this update
     for (auto it = m_runningDownloads.begin(); it != m_runningDownloads.end(); /* empty */) {
         if (!it->networkReply && !runningDownloadIds.contains(it->id)) {
-            // download has finished, get library changes for finished downloads
             // TODO: add downloadIt->artistTags to downloadIt->query.artistId
-            sync();
             it = m_runningDownloads.erase(it);
         } else {
             ++it;
         }
     }
 
-    m_downloadsPending = !runningDownloadIds.isEmpty();
-    emit downloadsPendingChanged(m_downloadsPending);
+    const bool downloadsPending = !runningDownloadIds.isEmpty() || !m_runningDownloads.isEmpty();
+    if (downloadsPending != m_downloadsPending) {
+        m_downloadsPending = downloadsPending;
+        emit downloadsPendingChanged(m_downloadsPending);
+    }
+}
+
+void Database::updateDownloadStatusText(const QVector<DownloadStatus> &status)
+{
+    int tracksTotal = 0;
+    int tracksDone = 0;
+    int queued = 0;
+    qint32 etaSecs = -1;
+    for (const DownloadStatus &download : status) {
+        if (!download.running) {
+            queued += 1;
+            continue;
+        }
+        tracksTotal += download.tracksTotal;
+        tracksDone += download.tracksDone;
+        etaSecs = qMax(etaSecs, *download.etaSecs);
+    }
 
-    // if there are downloads still running, we'll need to check back later for the results
-    if (m_downloadsPending)
-        m_downloadQueryTimer.start(5000);
+    QString text;
+    if (status.size() > queued) {
+        text = QString("Downloading %1/%2 tracks").arg(tracksDone).arg(tracksTotal);
+        if (queued > 0)
+            text += QString(", %1 queued").arg(queued);
+        if (etaSecs >= 0)
+            text += QString(", ~%1 min left").arg((etaSecs + 59) / 60);
+    } else if (queued > 0) {
+        text = QString("%1 downloads queued").arg(queued);
+    }
 
-    return {};
+    if (text != m_downloadStatusText) {
+        m_downloadStatusText = text;
+        emit downloadStatusTextChanged();
+    }
 }
 
 Option<QString> Database::applyLibraryChanges(const QVector<Moosick::CommittedLibraryChange> &changes)
@@ -413,7 +504,7 @@ Option<QString> Database::applyLibraryChanges(const QVector<Moosick::CommittedLi
             it = m_waitingChanges.erase(it);
         }
         else if (it->committedRevision == m_library.revision() + 1) {
-            m_library.commit(it->changeRequest);
+            m_library.commit(QVector<Moosick::CommittedLibraryChange>{ *it });
             hasChanged = true;
             ++it;
         } else {
@@ -431,6 +522,30 @@ Option<QString> Database::applyLibraryChanges(const QVector<Moosick::CommittedLi
     return {};
 }
 
+Option<QString> Database::applyCompactedLibraryChanges(const CompactedChangeListResponse *message)
+{
+    // we have moved on in the meantime, the regular change lists will take care of the rest
+    if (m_library.revision() >= message->toRevision)
+        return {};
+
+    const Option<QString> error = (m_library.revision() == message->fromRevision)
+            ? m_library.commitCompacted(message->changes, message->toRevision)
+            : Option<QString>(QString("Compacted changes don't start at our revision"));
+
+    if (error.hasValue()) {
+        qWarning() << "Database invalid, need to do a full sync:" << error.getValue();
+        m_hasLibrary = false;
+        m_library = Moosick::Library();
+        sync();
+        return {};
+    }
+
+    emit libraryChanged();
+
+    // apply whatever was waiting for these revisions
+    return applyLibraryChanges({});
+}
+
 Option<QString> Database::onDownloadResponse(HttpRequestId reply, const DownloadResponse *message)
 {
     const auto downloadIt = std::find_if(m_runningDownloads.begin(), m_runningDownloads.end(), [&](const Download &download) {
@@ -442,9 +557,6 @@ Option<QString> Database::onDownloadResponse(HttpRequestId reply, const Download
         downloadIt->networkReply = 0;
     }
 
-    if (!m_downloadQueryTimer.isActive() && !m_downloadQuery)
-        m_downloadQueryTimer.start(10000);
-
     return {};
 }
 
@@ -23,6 +23,7 @@ class Database : public QObject
     Q_PROPERTY(bool hasLibrary READ hasLibrary NOTIFY libraryChanged)
     Q_PROPERTY(bool isSyncing READ isSyncing NOTIFY isSyncingChanged)
     Q_PROPERTY(bool downloadsPending READ downloadsPending NOTIFY downloadsPendingChanged)
+    Q_PROPERTY(QString downloadStatusText READ downloadStatusText NOTIFY downloadStatusTextChanged)
     Q_PROPERTY(bool changesPending READ changesPending NOTIFY changesPendingChanged)
 
 public:
@@ -34,6 +35,7 @@ public:
     bool hasLibrary() const { return m_hasLibrary; }
     bool isSyncing() const;
     bool downloadsPending() const { return m_downloadsPending; }
+    QString downloadStatusText() const { return m_downloadStatusText; }
     bool changesPending() const { return hasRunningRequestType(LibraryChanges); }
     const Moosick::Library &library() const { return m_library; }
 
@@ -57,22 +59,30 @@ public:
 private slots:
     void onNetworkReplyFinished(HttpRequestId reply, const QByteArray &data);
     void onNetworkError(HttpRequestId requestId, QNetworkReply::NetworkError error);
-    void onDownloadQueryTimer();
+    void ensureSubscribed();
 
 signals:
     void libraryChanged();
     void newLibrary();
     void downloadsPendingChanged(bool downloadsPending);
+    void downloadStatusTextChanged();
     void changesPendingChanged(bool changesPending);
     void isSyncingChanged();
 
 private:
     // Methods to react on server response messages
     Option<QString> onNewLibrary(const MoosickMessage::LibraryResponse *message);
-    Option<QString> onNewRemoteId(const MoosickMessage::IdResponse *message);
+    Option<QString> onLibraryNotModified(const MoosickMessage::LibraryNotModified *message);
     Option<QString> applyLibraryChanges(const QVector<Moosick::CommittedLibraryChange> &changes);
+    Option<QString> applyCompactedLibraryChanges(const MoosickMessage::CompactedChangeListResponse *message);
     Option<QString> onDownloadResponse(HttpRequestId reply, const MoosickMessage::DownloadResponse *message);
-    Option<QString> onDownloadQueryResponse(const MoosickMessage::DownloadQueryResponse *message);
+    Option<QString> onSubscribeResponse(const MoosickMessage::SubscribeResponse *message);
+    void updateRunningDownloads(const QVector<MoosickMessage::DownloadQueryResponse::ActiveDownload> &activeDownloads);
+    void updateDownloadStatusText(const QVector<MoosickMessage::DownloadStatus> &status);
+    void onSubscriptionFailed();
+
+    /** Subscribes again once the current sync is done, right away or after a pause if it failed */
+    void onSyncFinished(bool failed);
 
     HttpRequestId sendChangeRequests(const QVector<Moosick::LibraryChangeRequest> &changes);
 
@@ -95,7 +105,7 @@ private:
         LibraryChanges,
         BandcampDownload,
         YoutubeDownload,
-        DownloadQuery,
+        Subscription,
     };
 
     Option<QString> processServerResponse(HttpRequestId reply, RequestType requestType, const MoosickMessage::Message &msg);
@@ -103,6 +113,7 @@ private:
     bool m_hasRemoteLibraryId = false;
     bool m_hasLibrary = false;
     bool m_downloadsPending = false;
+    QString m_downloadStatusText;
     bool m_changesPending = false;
     Moosick::Library m_library;
     Moosick::LibraryId m_remoteId;
@@ -134,9 +145,10 @@ private:
     };
     QVector<Download> m_runningDownloads;
 
-    /** regularly query the state of the downloads */
-    HttpRequestId m_downloadQuery = 0;
-    QTimer m_downloadQueryTimer;
+    /** the server tells us about library changes and downloads as they happen */
+    HttpRequestId m_subscription = 0;
+    quint32 m_downloadsVersion = 0;
+    QTimer m_subscriptionRetryTimer;
     bool m_isSyncing;
 };
 
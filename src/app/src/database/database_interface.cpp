@@ -29,6 +29,7 @@ DatabaseInterface::DatabaseInterface(HttpClient *httpClient, QObject *parent)
     connect(m_db, &Database::libraryChanged, this, &DatabaseInterface::hasLibraryChanged);
     connect(m_db, &Database::changesPendingChanged, this, &DatabaseInterface::changesPendingChanged);
     connect(m_db, &Database::downloadsPendingChanged, this, &DatabaseInterface::downloadsPendingChanged);
+    connect(m_db, &Database::downloadStatusTextChanged, this, &DatabaseInterface::downloadStatusTextChanged);
     connect(m_db, &Database::isSyncingChanged, this, &DatabaseInterface::isSyncingChanged);
 
     connect(m_filterTagsModel, &SelectTagsModel::selectionChanged, this, [=]() { updateSearchResults(); });
@@ -39,6 +39,7 @@ class DatabaseInterface : public QObject
     Q_PROPERTY(bool hasLibrary READ hasLibrary NOTIFY hasLibraryChanged)
     Q_PROPERTY(bool isSyncing READ isSyncing NOTIFY isSyncingChanged)
     Q_PROPERTY(bool downloadsPending READ downloadsPending NOTIFY downloadsPendingChanged)
+    Q_PROPERTY(QString downloadStatusText READ downloadStatusText NOTIFY downloadStatusTextChanged)
     Q_PROPERTY(bool changesPending READ changesPending NOTIFY changesPendingChanged)
 
     /** list of all available tags in the library */
@@ -95,6 +96,7 @@ public:
     bool hasLibrary() const { return m_db->hasLibrary(); }
     bool isSyncing() const { return m_db->isSyncing(); }
     bool downloadsPending() const { return m_db->downloadsPending(); }
+    QString downloadStatusText() const { return m_db->downloadStatusText(); }
     bool changesPending() const { return m_db->changesPending(); }
 
     SelectTagsModel *tagsModel() const { return m_tagsModel; }
@@ -135,6 +137,7 @@ signals:
     void hasLibraryChanged();
     void isSyncingChanged();
     void downloadsPendingChanged();
+    void downloadStatusTextChanged();
     void changesPendingChanged();
 
 private:
@@ -99,6 +99,11 @@ void HttpClient::setPass(const QString &pass)
     emit passChanged(pass);
 }
 
+void HttpClient::setWireFormat(MoosickMessage::WireFormat wireFormat)
+{
+    m_wireFormat = wireFormat;
+}
+
 void HttpClient::abortAll(HttpRequester *requester)
 {
     for (auto it = m_runningRequests.begin(); it != m_runningRequests.end(); /*empty*/) {
@@ -270,10 +275,11 @@ void HttpClient::launchRequest(HttpClient::RunningRequest &request)
         url.setUserName(m_user);
         url.setPassword(m_pass);
         url.setPath(m_hostPath);
+        QNetworkRequest req(url);
+        req.setRawHeader("Accept", wireFormatMimeType(m_wireFormat) + ", " + wireFormatMimeType(MoosickMessage::WireFormat::Json));
         if (request.postData.isEmpty()) {
-            request.currentReply = m_manager->get(QNetworkRequest(url));
+            request.currentReply = m_manager->get(req);
         } else {
-            QNetworkRequest req(url);
             req.setHeader(QNetworkRequest::ContentTypeHeader, "text/plain");
             request.currentReply = m_manager->post(req, request.postData);
         }
@@ -4,6 +4,8 @@
 #include <QNetworkReply>
 #include <QPointer>
 
+#include "library_messages.hpp"
+
 class HttpClient;
 
 using HttpRequestId = quint64;
@@ -61,6 +63,13 @@ public:
     void setPass(const QString &pass);
     void setUser(const QString &user);
 
+    /**
+     * Preferred encoding for server responses, announced via the Accept header.
+     * Servers that don't know about it will keep answering in JSON.
+     */
+    void setWireFormat(MoosickMessage::WireFormat wireFormat);
+    MoosickMessage::WireFormat wireFormat() const { return m_wireFormat; }
+
     QString apiUrl() const { return m_apiUrl; }
     quint16 port() const { return m_port; }
     QString user() const { return m_user; }
@@ -117,6 +126,7 @@ private:
     QString m_pass;
     QString m_user;
     QNetworkAccessManager *m_manager = nullptr;
+    MoosickMessage::WireFormat m_wireFormat = MoosickMessage::WireFormat::Cbor;
 
     // all SSL errors that we encounter will be presented to the user
     // so that he can choose to ignore them in the future
@@ -138,7 +138,7 @@ void Playlist::requestIcon(Entry *entry)
 void Playlist::onNetworkReplyFinished(HttpRequestId requestId, const QByteArray &data)
 {
     if (m_mediaBaseUrlRequest == requestId) {
-        auto response = MoosickMessage::Message::fromJsonAs<MoosickMessage::MediaUrlResponse>(data);
+        auto response = MoosickMessage::Message::decodeAs<MoosickMessage::MediaUrlResponse>(data);
         if (response.hasError())
             qWarning() << "Error while parsing MediaBaseUrl response:" << response.takeError().toString();
         else
@@ -17,6 +17,9 @@
 
 namespace Search {
 
+// how many of the top YouTube results the server resolves before they are clicked
+static constexpr int YOUTUBE_PREFETCH_COUNT = 5;
+
 Result::Result(Type tp, const QString &title, const QString &url, const QString &icon, QObject *parent)
     : QObject(parent)
     , m_title(title)
@@ -287,17 +290,26 @@ void Query::populateBandcampAlbum(BandcampAlbumResult *album, const QByteArray &
 
 void Query::populateYoutubeSearchResults(const QByteArray &html)
 {
+    // the top results are the likely ones to be played, have the server resolve them ahead of time
+    MoosickMessage::YoutubePrefetchRequest prefetch;
+
     const ScrapeYoutube::ResultList results = ScrapeYoutube::searchResult(html.toStdString());
     for (const ScrapeYoutube::Result &result : results) {
-        m_rootResults.add(
-            createYoutubeVideoResult(result.title.data(), result.url.data(), result.thumbnailUrl.data())
-        );
+        YoutubeVideoResult *video = createYoutubeVideoResult(result.title.data(), result.url.data(), result.thumbnailUrl.data());
+        m_rootResults.add(video);
+
+        const QString videoId = youtubeVideoId(video->url());
+        if (!videoId.isEmpty() && prefetch.videoIds.size() < YOUTUBE_PREFETCH_COUNT)
+            prefetch.videoIds << videoId;
     }
+
+    if (!prefetch.videoIds.isEmpty())
+        m_http->requestFromServer(MoosickMessage::Message(prefetch).toJson());
 }
 
 void Query::populateYoutubeVideo(YoutubeVideoResult *video, const QByteArray &json)
 {
-    auto result = MoosickMessage::Message::fromJson(json);
+    auto result = MoosickMessage::Message::decode(json);
     if (result.hasError()) {
         qWarning().noquote() << "Failed to parse youtube results:" << result.takeError().toString();
         video->setStatus(Result::Error);
@@ -390,18 +402,22 @@ void Query::requestBandcampBandInfo(BandcampArtistResult *artist)
     artist->setStatus(Result::Querying);
 }
 
-void Query::requestYoutubeVideoInfo(YoutubeVideoResult *video)
+QString Query::youtubeVideoId(const QString &url)
 {
     const QString beacon("watch?v=");
-    const QStringList parts = video->url().split(beacon);
-    if (parts.size() != 2) {
+    const QStringList parts = url.split(beacon);
+    return (parts.size() == 2) ? parts[1] : QString();
+}
+
+void Query::requestYoutubeVideoInfo(YoutubeVideoResult *video)
+{
+    MoosickMessage::YoutubeUrlQuery query;
+    query.videoId = youtubeVideoId(video->url());
+    if (query.videoId.isEmpty()) {
         qWarning() << "Couldn't find video ID in Youtube URL:" << video->url();
         return;
     }
 
-    MoosickMessage::YoutubeUrlQuery query;
-    query.videoId = parts[1];
-
     HttpRequestId reply = m_http->requestFromServer(MoosickMessage::Message(query).toJson());
     m_youtubeVideoQueries[reply] = video;
     video->setStatus(Result::Querying);
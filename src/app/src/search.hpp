@@ -210,6 +210,7 @@ private:
     void requestBandcampBandInfo(BandcampArtistResult *artist);
     void requestBandcampAlbumInfo(BandcampAlbumResult *album);
     void requestYoutubeVideoInfo(YoutubeVideoResult *video);
+    static QString youtubeVideoId(const QString &url);
 
     void populateBandcampSearchResults(const QByteArray &html);
     void populateBandcampArtist(BandcampArtistResult *artist, const QByteArray &html);
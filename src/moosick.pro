@@ -8,4 +8,8 @@ SUBDIRS = app
         server_library \
         uploader \
         #testclient \
+        testclient/downloadtest \
+        testclient/registrybench \
+        testclient/wireformatbench \
+        testclient/youtubecachetest \
 }
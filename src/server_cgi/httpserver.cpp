@@ -0,0 +1,377 @@
+#include "httpserver.hpp"
+
+#include <QTcpSocket>
+#include <QTemporaryFile>
+#include <QDateTime>
+#include <QDebug>
+
+static constexpr int MAX_HEADER_SIZE = 64 * 1024;
+
+// request bodies beyond this go to a file, like uploads
+static constexpr qint64 MAX_MEMORY_BODY_SIZE = 1024 * 1024;
+static constexpr qint64 BODY_CHUNK_SIZE = 256 * 1024;
+
+// unread data beyond this stays with the kernel, until we are ready for it
+static constexpr qint64 SOCKET_READ_BUFFER_SIZE = 256 * 1024;
+
+static constexpr qint64 IDLE_TIMEOUT_MSECS = 60 * 1000;
+
+// files are mapped and handed to the socket in pieces of this size, whenever it has drained below that
+static constexpr qint64 TRANSFER_CHUNK_SIZE = 1 << 20;
+
+static const char *statusText(int status)
+{
+    switch (status) {
+    case 200: return "OK";
+    case 206: return "Partial Content";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 413: return "Payload Too Large";
+    case 416: return "Range Not Satisfiable";
+    case 500: return "Internal Server Error";
+    case 503: return "Service Unavailable";
+    default: return "Unknown";
+    }
+}
+
+HttpServer::HttpServer(const Handler &handler, qint64 maxBodySize)
+    : HttpServer([=](const HttpRequest &request, const Responder &respond) { respond(handler(request)); }, maxBodySize)
+{
+}
+
+HttpServer::HttpServer(const AsyncHandler &handler, qint64 maxBodySize)
+    : QObject()
+    , m_handler(handler)
+    , m_maxBodySize(maxBodySize)
+{
+    connect(&m_tcpServer, &QTcpServer::newConnection, this, &HttpServer::onNewConnection);
+    connect(&m_idleTimer, &QTimer::timeout, this, &HttpServer::onIdleTimer);
+    m_idleTimer.start(IDLE_TIMEOUT_MSECS / 4);
+}
+
+HttpServer::~HttpServer()
+{
+    if (m_fileBytesSent > 0)
+        qDebug() << "HttpServer: Sent" << m_fileBytesSent << "bytes of files in total";
+}
+
+bool HttpServer::listen(const QHostAddress &address, quint16 port)
+{
+    if (!m_tcpServer.listen(address, port)) {
+        qWarning() << "HttpServer: Failed to listen on" << address << "port" << port;
+        return false;
+    }
+    qDebug() << "HttpServer: Listening on" << address << "port" << port;
+    return true;
+}
+
+void HttpServer::onNewConnection()
+{
+    while (QTcpSocket *socket = m_tcpServer.nextPendingConnection()) {
+        Connection &conn = m_connections[socket];
+        conn.opened = QDateTime::currentMSecsSinceEpoch();
+        conn.lastActivity = conn.opened;
+        socket->setReadBufferSize(SOCKET_READ_BUFFER_SIZE);
+
+        connect(socket, &QTcpSocket::readyRead, this, [=]() { onReadyRead(socket); });
+        connect(socket, &QTcpSocket::bytesWritten, this, [=]() { continueTransfer(socket); });
+        connect(socket, &QTcpSocket::disconnected, this, [=]() { closeConnection(socket); });
+
+        if (socket->bytesAvailable())
+            onReadyRead(socket);
+    }
+}
+
+void HttpServer::onIdleTimer()
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    const QList<QTcpSocket*> sockets = m_connections.keys();
+    for (QTcpSocket *socket : sockets) {
+        // long polls may take their time, but stalled transfers may not
+        const Connection &conn = m_connections[socket];
+        const bool waiting = conn.busy && !conn.transfer.file;
+        if (!waiting && now - conn.lastActivity > IDLE_TIMEOUT_MSECS)
+            closeConnection(socket);
+    }
+}
+
+void HttpServer::closeConnection(QTcpSocket *socket)
+{
+    const auto conn = m_connections.find(socket);
+    if (conn == m_connections.end())
+        return;
+
+    if (conn->fileBytesSent > 0) {
+        const qint64 msecs = qMax<qint64>(1, QDateTime::currentMSecsSinceEpoch() - conn->opened);
+        qDebug().noquote() << QString("HttpServer: Sent %1 bytes of files in %2 requests and %3 s, %4 KiB/s")
+                              .arg(conn->fileBytesSent).arg(conn->requests).arg(msecs / 1000.0, 0, 'f', 1)
+                              .arg(conn->fileBytesSent * 1000 / msecs / 1024);
+    }
+    m_connections.erase(conn);
+
+    socket->disconnect(this);
+    socket->close();
+    socket->deleteLater();
+}
+
+void HttpServer::onReadyRead(QTcpSocket *socket)
+{
+    auto conn = m_connections.find(socket);
+    if (conn == m_connections.end())
+        return;
+
+    conn->lastActivity = QDateTime::currentMSecsSinceEpoch();
+
+    // pipelined requests stay in the socket until it's their turn, which pushes back on the client
+    while (!conn->busy) {
+        if (!conn->receivingBody) {
+            conn->buffer += socket->read(MAX_HEADER_SIZE - conn->buffer.size());
+
+            HttpRequest request;
+            bool malformed = false;
+            if (!parseHeaders(conn->buffer, request, malformed)) {
+                if (malformed) {
+                    HttpResponse response;
+                    response.status = 400;
+                    sendResponse(socket, response, false);
+                    closeConnection(socket);
+                }
+                return;
+            }
+
+            request.peerAddress = socket->peerAddress().toString();
+            conn->incoming = request;
+            conn->bodyRemaining = request.bodySize;
+            conn->receivingBody = true;
+
+            if (request.bodySize > MAX_MEMORY_BODY_SIZE) {
+                QTemporaryFile *spool = new QTemporaryFile(m_spoolDir + "/request-XXXXXX");
+                conn->incoming.bodyFile.reset(spool);
+                if (!spool->open()) {
+                    qWarning() << "HttpServer: Can't spool request body to" << m_spoolDir;
+                    HttpResponse response;
+                    response.status = 500;
+                    sendResponse(socket, response, false);
+                    closeConnection(socket);
+                    return;
+                }
+            }
+        }
+
+        if (!receiveBody(socket, *conn)) {
+            HttpResponse response;
+            response.status = 500;
+            sendResponse(socket, response, false);
+            closeConnection(socket);
+            return;
+        }
+        if (conn->bodyRemaining > 0)
+            return;
+
+        HttpRequest request = conn->incoming;
+        conn->incoming = HttpRequest();
+        conn->receivingBody = false;
+        if (request.bodyFile)
+            request.bodyFile->seek(0);
+
+        const QByteArray connectionHeader = request.header("Connection").toLower();
+        const bool keepAlive = (request.version == "HTTP/1.1")
+                ? (connectionHeader != "close")
+                : (connectionHeader == "keep-alive");
+
+        conn->busy = true;
+        conn->requests += 1;
+        const QPointer<QTcpSocket> socketPointer(socket);
+        m_handler(request, [=](const HttpResponse &response) {
+            finishResponse(socketPointer, response, keepAlive);
+        });
+
+        // the handler may have run the event loop, re-validate our connection
+        conn = m_connections.find(socket);
+        if (conn == m_connections.end())
+            return;
+    }
+}
+
+void HttpServer::finishResponse(QPointer<QTcpSocket> socket, const HttpResponse &response, bool keepAlive)
+{
+    // the client may have hung up while we were busy
+    if (socket.isNull())
+        return;
+
+    const auto conn = m_connections.find(socket);
+    if (conn == m_connections.end())
+        return;
+
+    conn->lastActivity = QDateTime::currentMSecsSinceEpoch();
+
+    const bool hasFile = !response.filePath.isEmpty() && !response.headOnly && response.fileLength > 0;
+    if (!hasFile) {
+        sendResponse(socket, response, keepAlive);
+        completeResponse(socket, keepAlive);
+        return;
+    }
+
+    // open the file before promising anything in the headers
+    QSharedPointer<QFile> file(new QFile(response.filePath));
+    if (!file->open(QIODevice::ReadOnly) || file->size() < response.fileOffset + response.fileLength) {
+        qWarning() << "HttpServer: Can't read" << response.filePath;
+        HttpResponse error;
+        error.status = 500;
+        sendResponse(socket, error, keepAlive);
+        completeResponse(socket, keepAlive);
+        return;
+    }
+
+    sendResponse(socket, response, keepAlive);
+    conn->transfer = Connection::FileTransfer{ file, response.fileOffset, response.fileLength, keepAlive };
+    continueTransfer(socket);
+}
+
+void HttpServer::continueTransfer(QTcpSocket *socket)
+{
+    const auto conn = m_connections.find(socket);
+    if (conn == m_connections.end() || !conn->transfer.file)
+        return;
+
+    Connection::FileTransfer &transfer = conn->transfer;
+    conn->lastActivity = QDateTime::currentMSecsSinceEpoch();
+
+    // keep about one chunk queued, so that slow clients don't pull whole files into memory
+    while (transfer.remaining > 0 && socket->bytesToWrite() < TRANSFER_CHUNK_SIZE) {
+        const qint64 length = qMin(TRANSFER_CHUNK_SIZE, transfer.remaining);
+        uchar *mapped = transfer.file->map(transfer.offset, length);
+        qint64 written = -1;
+        if (mapped) {
+            written = socket->write(reinterpret_cast<const char*>(mapped), length);
+            transfer.file->unmap(mapped);
+        } else if (transfer.file->seek(transfer.offset)) {
+            written = socket->write(transfer.file->read(length));
+        }
+
+        if (written <= 0) {
+            qWarning() << "HttpServer: Transfer of" << transfer.file->fileName() << "failed";
+            closeConnection(socket);
+            return;
+        }
+
+        transfer.offset += written;
+        transfer.remaining -= written;
+        conn->fileBytesSent += written;
+        m_fileBytesSent += written;
+    }
+
+    if (transfer.remaining > 0)
+        return;
+
+    const bool keepAlive = transfer.keepAlive;
+    transfer = Connection::FileTransfer();
+    completeResponse(socket, keepAlive);
+}
+
+void HttpServer::completeResponse(QTcpSocket *socket, bool keepAlive)
+{
+    const auto conn = m_connections.find(socket);
+    if (conn == m_connections.end())
+        return;
+
+    conn->busy = false;
+
+    if (!keepAlive) {
+        closeConnection(socket);
+        return;
+    }
+
+    // continue with requests that were pipelined in the meantime, but not from within the responder
+    if (conn->buffer.isEmpty() && socket->bytesAvailable() == 0)
+        return;
+
+    const QPointer<QTcpSocket> socketPointer(socket);
+    QMetaObject::invokeMethod(this, [=]() {
+        if (!socketPointer.isNull())
+            onReadyRead(socketPointer);
+    }, Qt::QueuedConnection);
+}
+
+bool HttpServer::parseHeaders(QByteArray &buffer, HttpRequest &request, bool &malformed) const
+{
+    const int headerEnd = buffer.indexOf("\r\n\r\n");
+    if (headerEnd < 0) {
+        malformed = (buffer.size() >= MAX_HEADER_SIZE);
+        return false;
+    }
+
+    const QList<QByteArray> lines = buffer.left(headerEnd).split('\n');
+    const QList<QByteArray> requestLine = lines.first().trimmed().split(' ');
+    if (requestLine.size() != 3) {
+        malformed = true;
+        return false;
+    }
+
+    request.method = requestLine[0];
+    request.uri = requestLine[1];
+    request.version = requestLine[2];
+
+    for (int i = 1; i < lines.size(); ++i) {
+        const int colon = lines[i].indexOf(':');
+        if (colon <= 0)
+            continue;
+        request.headers.insert(lines[i].left(colon).trimmed().toLower(), lines[i].mid(colon + 1).trimmed());
+    }
+
+    bool ok = true;
+    const QByteArray contentLengthHeader = request.header("Content-Length");
+    request.bodySize = contentLengthHeader.isEmpty() ? 0 : contentLengthHeader.toLongLong(&ok);
+    if (!ok || request.bodySize < 0 || request.bodySize > m_maxBodySize) {
+        malformed = true;
+        return false;
+    }
+
+    buffer.remove(0, headerEnd + 4);
+    return true;
+}
+
+bool HttpServer::receiveBody(QTcpSocket *socket, Connection &conn) const
+{
+    HttpRequest &request = conn.incoming;
+    while (conn.bodyRemaining > 0) {
+        // the start of the body may have come along with the headers
+        QByteArray data = conn.buffer.left(conn.bodyRemaining);
+        conn.buffer.remove(0, data.size());
+        if (data.isEmpty())
+            data = socket->read(qMin(conn.bodyRemaining, BODY_CHUNK_SIZE));
+        if (data.isEmpty())
+            return true;
+
+        conn.bodyRemaining -= data.size();
+        if (!request.bodyFile) {
+            request.body += data;
+        } else if (request.bodyFile->write(data) != data.size()) {
+            qWarning() << "HttpServer: Can't spool request body";
+            return false;
+        }
+    }
+    return true;
+}
+
+void HttpServer::sendResponse(QTcpSocket *socket, const HttpResponse &response, bool keepAlive)
+{
+    QByteArray header;
+    header += "HTTP/1.1 " + QByteArray::number(response.status) + " " + statusText(response.status) + "\r\n";
+    if (!response.contentType.isEmpty())
+        header += "Content-Type: " + response.contentType + "\r\n";
+    if (!response.contentEncoding.isEmpty())
+        header += "Content-Encoding: " + response.contentEncoding + "\r\n";
+    for (const auto &extraHeader : response.headers)
+        header += extraHeader.first + ": " + extraHeader.second + "\r\n";
+    header += "Content-Length: " + QByteArray::number(response.body.size() + response.fileLength) + "\r\n";
+    header += keepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+    header += "\r\n";
+
+    socket->write(header);
+    if (!response.headOnly)
+        socket->write(response.body);
+    socket->flush();
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <QTcpServer>
+#include <QTimer>
+#include <QHash>
+#include <QPointer>
+#include <QVector>
+#include <QPair>
+#include <QFile>
+#include <QDir>
+#include <QSharedPointer>
+
+#include <functional>
+
+class QTcpSocket;
+
+struct HttpRequest
+{
+    QByteArray method;
+    QByteArray uri;
+    QByteArray version;
+    QHash<QByteArray, QByteArray> headers;
+
+    /** Small bodies are kept in body, larger ones are spooled to bodyFile as they arrive */
+    QByteArray body;
+    QSharedPointer<QIODevice> bodyFile;
+    qint64 bodySize = 0;
+
+    /** Address of whoever is on the other end, which may be a reverse proxy */
+    QString peerAddress;
+
+    /** Header names are matched case-insensitively */
+    QByteArray header(const QByteArray &name) const { return headers.value(name.toLower()); }
+};
+
+struct HttpResponse
+{
+    int status = 200;
+    QByteArray contentType;
+    QByteArray contentEncoding;
+    QByteArray body;
+
+    /** Anything beyond the headers above, e.g. for ranges and caching */
+    QVector<QPair<QByteArray, QByteArray>> headers;
+
+    /**
+     * Part of a file that is sent after body, without ever reading it into memory
+     * as a whole. For HEAD requests, set headOnly and only its length will be announced.
+     */
+    QString filePath;
+    qint64 fileOffset = 0;
+    qint64 fileLength = 0;
+    bool headOnly = false;
+};
+
+/**
+ * Minimal HTTP/1.1 server with keep-alive, so that the front end can stay
+ * resident instead of being spawned once per request as a CGI.
+ *
+ * Requests are handled one after another on the calling thread, unless the
+ * handler defers its response, e.g. for long polls. In that case further requests
+ * on the same connection wait until the response has been sent, while other
+ * connections are served as usual. Meanwhile, nothing more is read from the
+ * connection, so that clients can't pile up data in memory.
+ */
+class HttpServer : public QObject
+{
+    Q_OBJECT
+
+public:
+    using Handler = std::function<HttpResponse(const HttpRequest &request)>;
+
+    /** Must be called exactly once, on the thread of the HttpServer */
+    using Responder = std::function<void(const HttpResponse &response)>;
+    using AsyncHandler = std::function<void(const HttpRequest &request, const Responder &respond)>;
+
+    HttpServer(const Handler &handler, qint64 maxBodySize = 128 * 1024 * 1024);
+    HttpServer(const AsyncHandler &handler, qint64 maxBodySize = 128 * 1024 * 1024);
+    ~HttpServer() override;
+
+    bool listen(const QHostAddress &address, quint16 port);
+
+    /** Where large request bodies are spooled to, the system's temp dir by default */
+    void setSpoolDir(const QString &dir) { m_spoolDir = dir; }
+
+    /** Bytes of response bodies sent from files, over all connections so far */
+    qint64 fileBytesSent() const { return m_fileBytesSent; }
+
+private slots:
+    void onNewConnection();
+    void onIdleTimer();
+
+private:
+    struct Connection
+    {
+        /** Header data, along with whatever came after the headers in the same read */
+        QByteArray buffer;
+        qint64 lastActivity = 0;
+
+        /** The request whose body is still coming in */
+        HttpRequest incoming;
+        qint64 bodyRemaining = 0;
+        bool receivingBody = false;
+
+        /** A response is still outstanding, pipelined requests have to wait for it */
+        bool busy = false;
+
+        /** The file part of the current response, fed to the socket as it drains */
+        struct FileTransfer
+        {
+            QSharedPointer<QFile> file;
+            qint64 offset = 0;
+            qint64 remaining = 0;
+            bool keepAlive = true;
+        };
+        FileTransfer transfer;
+
+        // for bandwidth accounting
+        qint64 opened = 0;
+        int requests = 0;
+        qint64 fileBytesSent = 0;
+    };
+
+    void onReadyRead(QTcpSocket *socket);
+    void closeConnection(QTcpSocket *socket);
+
+    /** Returns false if the buffered data doesn't contain complete headers yet */
+    bool parseHeaders(QByteArray &buffer, HttpRequest &request, bool &malformed) const;
+    /** Returns false if the body can't be stored */
+    bool receiveBody(QTcpSocket *socket, Connection &conn) const;
+    void sendResponse(QTcpSocket *socket, const HttpResponse &response, bool keepAlive);
+    void finishResponse(QPointer<QTcpSocket> socket, const HttpResponse &response, bool keepAlive);
+    void continueTransfer(QTcpSocket *socket);
+    void completeResponse(QTcpSocket *socket, bool keepAlive);
+
+    AsyncHandler m_handler;
+    qint64 m_maxBodySize;
+    QString m_spoolDir = QDir::tempPath();
+    QTcpServer m_tcpServer;
+    QTimer m_idleTimer;
+    QHash<QTcpSocket*, Connection> m_connections;
+    qint64 m_fileBytesSent = 0;
+};
@@ -1,12 +1,21 @@
 #include <QCoreApplication>
-#include <QProcess>
-#include <QJsonDocument>
 #include <QDebug>
 #include <QTcpSocket>
 #include <QDir>
 #include <QFile>
 #include <QRandomGenerator>
+#include <QCommandLineParser>
+#include <QCryptographicHash>
+#include <QBuffer>
+#include <QThreadPool>
+#include <QAtomicInt>
+#include <QRunnable>
+#include <QSharedPointer>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QHash>
 #include <iostream>
+#include <algorithm>
 
 #include "library.hpp"
 #include "library_messages.hpp"
@@ -14,126 +23,143 @@
 #include "serversettings.hpp"
 #include "tcpclientserver.hpp"
 #include "logger.hpp"
+#include "httpserver.hpp"
+#include "compression.hpp"
+#include "uploadsession.hpp"
+#include "transcoder.hpp"
+#include "youtubecache.hpp"
 
 using namespace MoosickMessage;
 
-static bool execute(const QString &program, const QStringList &args, QByteArray &out)
+/**
+ * Connection to dbserver. A long-running front end keeps the socket open
+ * across requests instead of connecting anew every time.
+ */
+class DbServerConnection
 {
-    QProcess proc;
-    proc.setProgram(program);
-    proc.setArguments(args);
-    proc.start();
-    if (proc.waitForFinished(3600000) && proc.exitStatus() == QProcess::NormalExit && proc.exitCode() == 0) {
-        out = proc.readAllStandardOutput();
-        return true;
-    }
-    else {
-        qWarning() << program << args << "failed:" << proc.error() << proc.exitCode() << proc.exitStatus();
-        qWarning() << "stdout:";
-        qWarning().noquote() << proc.readAllStandardOutput();
-        qWarning() << "stderr:";
-        qWarning().noquote() << proc.readAllStandardError();
-        return false;
-    }
-}
+public:
+    DbServerConnection(const QString &host, quint16 port) : m_host(host), m_port(port) {}
 
-static Message getYoutubeUrl(const QString &toolDir, const QString &videoId)
-{
-    const QString url = QString("https://www.youtube.com/watch?v=") + videoId;
-    QByteArray youtubeDlOut;
-    if (!execute(toolDir + "/youtube-dl", {"-j", url}, youtubeDlOut))
-        return new Error("Internal Error");
-
-    const QJsonDocument jsonDoc = QJsonDocument::fromJson(youtubeDlOut);
-    if (!jsonDoc.isObject())
-        return new Error("Internal Error");
-    const QJsonObject json = jsonDoc.object();
-
-    const auto formatsIt = json.find("formats");
-    if (formatsIt == json.end() || !formatsIt->isArray())
-        return new Error("Internal Error");
-    const QJsonArray formats = formatsIt->toArray();
-
-    // find best audio URL among formats: no DASH, 'audio only', and largest file size
-    int bestAudioSize = 0;
-    QString bestUrl;
-    for (const QJsonValue &format : formats) {
-        const QString formatName = format["format"].toString();
-
-        // ain't nobody got love for DASH
-        if (formatName.toLower().contains("dash"))
-            continue;
-
-        const int size = format["filesize"].toInt();
-        bool isBest = bestUrl.isEmpty();
-        if (!isBest && formatName.contains("audio only") && size && size > bestAudioSize)
-            isBest = true;
-
-        if (isBest) {
-            bestUrl = format["url"].toString();
-            bestAudioSize = size;
-        }
-    }
+    Message send(const Message &message, int timeout = 10000);
 
-    if (bestUrl.isEmpty())
-        return new Error("Internal Error");
+private:
+    bool connect();
 
-    YoutubeUrlResponse *response = new YoutubeUrlResponse();
-    response->title = json["title"].toString();
-    response->duration = json["duration"].toInt();
-    response->chapters = json["chapters"].toArray();
-    response->url = bestUrl;
-    return response;
+    QString m_host;
+    quint16 m_port;
+    QScopedPointer<QTcpSocket> m_socket;
+};
+
+bool DbServerConnection::connect()
+{
+    m_socket.reset(new QTcpSocket());
+    m_socket->connectToHost(m_host, m_port);
+    if (!m_socket->waitForConnected(1000)) {
+        qWarning().noquote() << "Can't connect to" << m_host << m_port;
+        m_socket.reset();
+        return false;
+    }
+    return true;
 }
 
-static Message sendMessage(const QString &host, quint16 port, const Message &message)
+Message DbServerConnection::send(const Message &message, int timeout)
 {
-    QTcpSocket tcpSocket;
-    tcpSocket.connectToHost(host, port);
-    if (!tcpSocket.waitForConnected(1000)) {
-        qWarning().noquote() << "Can't connect to" << host << port;
+    // a pooled connection may have been closed by dbserver in the meantime,
+    // in which case we try once more with a fresh one
+    const bool reusingSocket = m_socket && (m_socket->state() == QAbstractSocket::ConnectedState);
+    if (!reusingSocket && !connect())
         return new Error("Internal error");
-    }
 
-    const QByteArray messageJson = message.toJson();
-    auto result = TcpClient::sendMessage(tcpSocket, messageJson, 10000);
+    // CBOR is understood by every dbserver that is deployed alongside this CGI
+    const QByteArray messageData = message.toCbor();
+    auto result = TcpClient::sendMessage(*m_socket, messageData, timeout);
+
+    // only if dbserver had closed the pooled socket, not after e.g. a timeout,
+    // when the request may well have been handled already
+    const bool socketWasStale = reusingSocket && m_socket->error() == QAbstractSocket::RemoteHostClosedError;
+    if (!result.hasValue() && socketWasStale) {
+        if (!connect())
+            return new Error("Internal error");
+        result = TcpClient::sendMessage(*m_socket, messageData, timeout);
+    }
     if (!result.hasValue()) {
         qWarning().noquote() << "Failed to send/recv TCP message:" << result.takeError();
+        m_socket.reset();
         return new Error("Internal error");
     }
 
     const QByteArray resultData = result.takeValue();
-    Result<Message, EnjsonError> resultMessage = Message::fromJson(resultData);
+    Result<Message, EnjsonError> resultMessage = Message::decode(resultData);
     if (!resultMessage.hasValue()) {
-        qWarning().noquote() << "Failed to parse JSON response from" << host;
+        qWarning().noquote() << "Failed to parse response from" << m_host;
         qWarning().noquote() << "Error:" << resultMessage.takeError().toString();
         qWarning().noquote() << "Sent message:";
-        qWarning().noquote() << messageJson;
+        qWarning().noquote() << message.toJson();
         qWarning().noquote() << "Received message:";
-        qWarning().noquote() << resultData;
+        qWarning().noquote() << resultData.toBase64();
+        m_socket.reset();
         return new Error("Internal error");
     }
 
     return resultMessage.takeValue();
 }
 
-static Message uploadFile(const ServerSettings &settings, const Message &message, const QByteArray &postData)
+/**
+ * POST data that accompanies a message64= request. It is only read when needed,
+ * so that file uploads can go straight to disk instead of through memory.
+ */
+struct RequestBody
 {
-    const QString tmpDir = settings.tempDir();
+    QIODevice *device = nullptr;
+    qint64 size = 0;
+};
 
-    const UploadSongRequest *uploadRequest = message.as<UploadSongRequest>();
-    if (uploadRequest->fileSize != postData.size())
-        return new Error("Specified file size doesn't match POST data");
-
-    // write data to temp file
+static QString newTempFileName(const QString &tmpDir)
+{
     QDir().mkpath(tmpDir);
     const quint64 rand64 = QRandomGenerator::global()->generate64();
-    const QString tempFileName = tmpDir + QDir::separator() + QString::number(rand64);
+    return tmpDir + QDir::separator() + QString::number(rand64);
+}
+
+/**
+ * Copies the request body into a new file in tmpDir, hashing it along the way.
+ * The file is removed again if anything goes wrong.
+ */
+static Option<QString> receiveFile(const QString &tmpDir, const RequestBody &body, QString &filePath, QByteArray &sha256)
+{
+    const QString tempFileName = newTempFileName(tmpDir);
     QFile tempFile(tempFileName);
-    if (!tempFile.open(QIODevice::WriteOnly))
-        return new Error("Internal error");
+    if (!tempFile.open(QIODevice::WriteOnly)) {
+        qWarning() << "Can't open" << tempFileName;
+        return QString("Can't store upload");
+    }
 
-    tempFile.write(postData);
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    Option<QString> error = copyStream(*body.device, tempFile, body.size, hash);
+    if (error) {
+        tempFile.remove();
+        return error;
+    }
+
+    tempFile.close();
+    filePath = tempFileName;
+    sha256 = hash.result();
+    return {};
+}
+
+static Message uploadFile(const ServerSettings &settings, DbServerConnection &dbserver, const Message &message, const RequestBody &body)
+{
+    const UploadSongRequest *uploadRequest = message.as<UploadSongRequest>();
+    if (uploadRequest->fileSize != body.size || !body.device)
+        return new Error("Specified file size doesn't match POST data");
+
+    QString tempFileName;
+    QByteArray sha256;
+    Option<QString> error = receiveFile(settings.tempDir(), body, tempFileName, sha256);
+    if (error) {
+        qWarning().noquote() << "Upload failed:" << error.getValue();
+        return new Error(error.takeValue());
+    }
 
     UploadSongRequestInternal *internalRequest = new UploadSongRequestInternal();
     internalRequest->artistName = uploadRequest->artistName;
@@ -143,39 +169,148 @@ static Message uploadFile(const ServerSettings &settings, const Message &message
     internalRequest->duration = uploadRequest->duration;
     internalRequest->fileEnding = uploadRequest->fileEnding;
     internalRequest->filePath = tempFileName;
+    internalRequest->sha256 = QString::fromLatin1(sha256.toHex());
+
+    return dbserver.send(internalRequest);
+}
+
+static Message handleUploadSession(const ServerSettings &settings, DbServerConnection &dbserver, const Message &message, const RequestBody &body)
+{
+    const QString tmpDir = settings.tempDir();
+
+    if (const UploadSessionBegin *begin = message.as<UploadSessionBegin>()) {
+        // there is no better point in time to clean up after uploads that were abandoned
+        UploadSession::removeStale(tmpDir, 7 * 24 * 3600);
 
-    return sendMessage(settings.dbserverHost(), settings.dbserverPort(), internalRequest);
+        Result<UploadSession, QString> session = UploadSession::create(tmpDir, *begin, settings.maxUploadSize());
+        if (session.hasError())
+            return new Error(session.takeError());
+        return new UploadSessionResponse(session->response());
+    }
+
+    QString sessionId;
+    if (const UploadChunk *chunk = message.as<UploadChunk>())
+        sessionId = chunk->sessionId;
+    else if (const UploadSessionQuery *query = message.as<UploadSessionQuery>())
+        sessionId = query->sessionId;
+    else if (const UploadSessionFinish *finish = message.as<UploadSessionFinish>())
+        sessionId = finish->sessionId;
+
+    Result<UploadSession, QString> sessionResult = UploadSession::open(tmpDir, sessionId);
+    if (sessionResult.hasError())
+        return new Error(sessionResult.takeError());
+    UploadSession session = sessionResult.takeValue();
+
+    switch (message.getType()) {
+    case Type::UploadChunk: {
+        if (!body.device)
+            return new Error("Chunk data is missing");
+
+        const Option<QString> error = session.writeChunk(message.as<UploadChunk>()->offset, *body.device, body.size);
+        if (error)
+            return new Error(error.getValue());
+        return new UploadSessionResponse(session.response());
+    }
+    case Type::UploadSessionQuery: {
+        return new UploadSessionResponse(session.response());
+    }
+    case Type::UploadSessionFinish: {
+        const QString tempFileName = newTempFileName(tmpDir);
+        const QByteArray sha256 = QByteArray::fromHex(message.as<UploadSessionFinish>()->sha256->toLatin1());
+        const Option<QString> error = session.finish(sha256, tempFileName);
+        if (error)
+            return new Error(error.getValue());
+
+        const UploadSessionBegin &request = session.request();
+        UploadSongRequestInternal *internalRequest = new UploadSongRequestInternal();
+        internalRequest->artistName = request.artistName;
+        internalRequest->albumName = request.albumName;
+        internalRequest->title = request.title;
+        internalRequest->position = request.position;
+        internalRequest->duration = request.duration;
+        internalRequest->fileEnding = request.fileEnding;
+        internalRequest->filePath = tempFileName;
+        internalRequest->sha256 = QString::fromLatin1(sha256.toHex());
+
+        return dbserver.send(internalRequest);
+    }
+    default: {
+        return new Error("Unhandled message type");
+    }
+    }
+}
+
+static QString youtubeCacheDir(const ServerSettings &settings)
+{
+    return settings.tempDir() + "/youtube";
 }
 
 /**
  * if the message was passed via &message64= query, the POST data
- * is available separately.
- * Otherwise, postData will just contain the message that has already been parsed.
+ * is available separately in body.
+ * Otherwise, body will just contain the message that has already been parsed.
  */
-static Message handleMessage(const ServerSettings &settings, const Message &message, const QByteArray &postData)
+static Message handleMessage(const ServerSettings &settings, DbServerConnection &dbserver, const Message &message, const RequestBody &body, const QString &client)
 {
-    const QString toolDir = settings.toolsDir();
-
     switch (message.getType()) {
     case Type::Ping: {
         return new Pong();
     }
     // in this case, we expect the file data to be POSTed
     case Type::UploadSongRequest: {
-        return uploadFile(settings, message, postData);
+        return uploadFile(settings, dbserver, message, body);
+    }
+    // chunks are POSTed the same way, sessions survive between requests in tempDir
+    case Type::UploadSessionBegin:
+    case Type::UploadChunk:
+    case Type::UploadSessionQuery:
+    case Type::UploadSessionFinish: {
+        return handleUploadSession(settings, dbserver, message, body);
     }
     // forward messages to DB server
     case Type::LibraryRequest:
+    case Type::ConditionalLibraryRequest:
     case Type::IdRequest:
     case Type::ChangesRequest:
     case Type::ChangeListRequest:
-    case Type::DownloadRequest:
+    case Type::SyncRequest:
     case Type::DownloadQuery: {
-        return sendMessage(settings.dbserverHost(), settings.dbserverPort(), message);
+        return dbserver.send(message);
+    }
+    // only whoever requested a download may change it
+    case Type::DownloadCancelRequest: {
+        DownloadCancelRequestInternal *internalRequest = new DownloadCancelRequestInternal();
+        internalRequest->request = *message.as<DownloadCancelRequest>();
+        internalRequest->client = client;
+        return dbserver.send(internalRequest);
+    }
+    case Type::DownloadPriorityRequest: {
+        DownloadPriorityRequestInternal *internalRequest = new DownloadPriorityRequestInternal();
+        internalRequest->request = *message.as<DownloadPriorityRequest>();
+        internalRequest->client = client;
+        return dbserver.send(internalRequest);
+    }
+    // dbserver takes turns between clients when scheduling downloads
+    case Type::DownloadRequest: {
+        DownloadRequestInternal *internalRequest = new DownloadRequestInternal();
+        internalRequest->request = *message.as<DownloadRequest>();
+        internalRequest->client = client;
+        internalRequest->priority = 0;
+        return dbserver.send(internalRequest);
+    }
+    case Type::SubscribeRequest: {
+        // dbserver holds on to subscriptions for up to a minute
+        const quint32 timeoutSecs = qMin<quint32>(message.as<SubscribeRequest>()->timeoutSecs, 60);
+        return dbserver.send(message, (timeoutSecs + 10) * 1000);
     }
     case Type::YoutubeUrlQuery: {
         const YoutubeUrlQuery *query = message.as<YoutubeUrlQuery>();
-        return getYoutubeUrl(toolDir, query->videoId);
+        return YoutubeUrlCache(settings.toolsDir(), youtubeCacheDir(settings)).lookup(query->videoId);
+    }
+    // resolved in the background, so that a later YoutubeUrlQuery finds them in the cache
+    case Type::YoutubePrefetchRequest: {
+        const YoutubePrefetchRequest *request = message.as<YoutubePrefetchRequest>();
+        return new YoutubePrefetchResponse(YoutubeUrlCache(settings.toolsDir(), youtubeCacheDir(settings)).prefetch(request->videoIds.toList()));
     }
     case Type::MediaUrlRequest: {
         return new MediaUrlResponse(settings.mediaBaseUrl());
@@ -186,71 +321,471 @@ static Message handleMessage(const ServerSettings &settings, const Message &mess
     }
 }
 
-int main(int argc, char **argv)
-{
-    QCoreApplication app(argc, argv);
+static const char* message64Query = "?message64=";
 
-#ifdef Q_OS_WIN32
-    _setmode(_fileno(stdin), _O_BINARY);
-#endif
+// in resident mode, MEDIA_BASE_URL may point here to do without a separate web server
+static const char* mediaPathPrefix = "/media/";
 
-    const ServerSettings settings;
-    if (!settings.isValid()) {
-        qWarning() << "Settings file not valid";
-        return 1;
-    }
-
-    if (!settings.cgiLogFile().isEmpty()) {
-        Logger::setLogFile(settings.cgiLogFile());
-        Logger::setLogFileFilter(settings.cgiLogLevel());
-        Logger::install();
-    }
+// same files, but at a lower bitrate for mobile clients
+static const char* transcodePathPrefix = "/transcode/";
 
+/**
+ * if the message was passed via &message64= query, it is taken from there,
+ * otherwise from the POST data.
+ */
+static Result<Message, EnjsonError> decodeRequest(const QByteArray &requestUri, const QByteArray &postData)
+{
     // For file uploads we don't want to go through JSON, as
     // this would incur a huge overhead for parsing and base64 decoding.
     // Instead, we pass the request message base64-encoded via query string,
     // and the actual file data raw via POST
     QByteArray queryMessage;
-    const QByteArray requestUri = qgetenv("REQUEST_URI");
-    static const char* message64Query = "?message64=";
     const int message64Index = requestUri.indexOf(message64Query);
     if (message64Index >= 0) {
         const QByteArray message64 = requestUri.mid(message64Index + strlen(message64Query));
         queryMessage = QByteArray::fromBase64(message64, QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals);
     }
 
-    // Read POST data from stdin
-    QByteArray postData;
-    const int contentLength = qgetenv("CONTENT_LENGTH").toInt();
-    if (contentLength > 0) {
-        while(postData.size() < contentLength && !std::cin.eof()) {
-            constexpr int bufferSize = 1024;
-            char buffer[bufferSize];
-            std::cin.read(buffer, qMin(bufferSize, contentLength - postData.size()));
-            const int read = std::cin.gcount();
-            postData.append(buffer, read);
-        }
+    const QByteArray messageData = queryMessage.isEmpty() ? postData : queryMessage;
+    Result<Message, EnjsonError> messageParsingResult = Message::decode(messageData);
+
+    if (messageParsingResult.hasError()) {
+        qWarning().noquote() << "Failed to parse message:" << messageParsingResult.getError().toString();
+        if (messageData.size() < 1024)
+            qWarning().noquote() << messageData;
+        else
+            qWarning() << "Omitting message, size =" << messageData.size();
     }
 
-    const QByteArray messageJson = queryMessage.isEmpty() ? postData : queryMessage;
-    Result<Message, EnjsonError> messageParsingResult = Message::fromJson(messageJson);
+    return messageParsingResult;
+}
 
-    if (messageParsingResult.hasError()) {
+/**
+ * Dispatches the decoded request message and encodes the response,
+ * regardless of whether we are running as a CGI or as a resident HTTP server.
+ */
+static HttpResponse processRequest(
+        const ServerSettings &settings,
+        DbServerConnection &dbserver,
+        const Result<Message, EnjsonError> &request,
+        const QByteArray &acceptHeader,
+        const QByteArray &acceptEncodingHeader,
+        const RequestBody &body,
+        const QString &client)
+{
+    // Clients that can decode CBOR say so in their Accept header, everyone else gets JSON
+    const WireFormat responseFormat = wireFormatFromMimeTypes(acceptHeader);
+
+    HttpResponse response;
+    response.contentType = wireFormatMimeType(responseFormat);
+
+    if (request.hasError()) {
         Error error;
         error.errorMessage = "Failed to parse message";
-        qWarning().noquote() << "Failed to parse message:" << messageParsingResult.getError().toString();
-        if (messageJson.size() < 1024)
-            qWarning().noquote() << messageJson;
+        response.body = Message(error).encode(responseFormat);
+        return response;
+    }
+
+    // compression metrics are labeled by what was compressed, like in the dbserver
+    const Message reply = handleMessage(settings, dbserver, request.getValue(), body, client);
+    response.body = reply.encode(responseFormat);
+
+    // large responses like the library are worth compressing for mobile clients
+    const Compression::Encoding encoding = Compression::encodingFromAcceptEncoding(acceptEncodingHeader);
+    if (encoding == Compression::Encoding::Deflate && response.body.size() >= Compression::MIN_COMPRESSED_SIZE) {
+        response.body = Compression::deflate(response.body, reply.getTypeString());
+        response.contentEncoding = Compression::encodingName(encoding);
+    }
+
+    return response;
+}
+
+static QByteArray mediaMimeType(const QString &suffix)
+{
+    static const QHash<QString, QByteArray> mimeTypes = {
+        { "mp3", "audio/mpeg" },
+        { "flac", "audio/flac" },
+        { "ogg", "audio/ogg" },
+        { "oga", "audio/ogg" },
+        { "opus", "audio/ogg" },
+        { "m4a", "audio/mp4" },
+        { "webm", "audio/webm" },
+        { "wav", "audio/wav" },
+    };
+    return mimeTypes.value(suffix.toLower(), "application/octet-stream");
+}
+
+/**
+ * Parses a single "bytes=" range into offset and length. Returns false if the range
+ * can't be satisfied, and leaves the whole file if there is no range we understand.
+ */
+static bool parseRange(const QByteArray &rangeHeader, qint64 fileSize, qint64 &offset, qint64 &length)
+{
+    offset = 0;
+    length = fileSize;
+
+    // multiple ranges are allowed to be answered with the whole thing
+    if (!rangeHeader.startsWith("bytes=") || rangeHeader.contains(','))
+        return true;
+
+    const QByteArray range = rangeHeader.mid(6).trimmed();
+    const int dash = range.indexOf('-');
+    if (dash < 0)
+        return true;
+
+    bool firstOk = false;
+    bool lastOk = false;
+    const qint64 first = range.left(dash).toLongLong(&firstOk);
+    const qint64 last = range.mid(dash + 1).toLongLong(&lastOk);
+
+    if (!firstOk && lastOk) {
+        // suffix range, the last N bytes
+        if (last <= 0)
+            return false;
+        length = qMin(last, fileSize);
+        offset = fileSize - length;
+        return true;
+    }
+
+    if (!firstOk || first >= fileSize || (lastOk && last < first))
+        return false;
+
+    offset = first;
+    length = (lastOk ? qMin(last, fileSize - 1) : fileSize - 1) - first + 1;
+    return true;
+}
+
+static HttpResponse statusResponse(int status)
+{
+    HttpResponse response;
+    response.status = status;
+    if (status == 405)
+        response.headers << qMakePair(QByteArray("Allow"), QByteArray("GET, HEAD"));
+    return response;
+}
+
+/** Returns the media file that a /media/ or /transcode/ path refers to, if there is one */
+static Option<QFileInfo> mediaFile(const ServerSettings &settings, const QByteArray &uriPath)
+{
+    // no way out of mediaBaseDir
+    const QString fileName = QString::fromUtf8(QByteArray::fromPercentEncoding(uriPath.split('?').first()));
+    const bool validName = !fileName.isEmpty() && !fileName.startsWith('.') && std::all_of(fileName.begin(), fileName.end(), [](QChar c) {
+        return c.isLetterOrNumber() || c == '.' || c == '-' || c == '_';
+    });
+    const QFileInfo file(settings.mediaBaseDir() + QDir::separator() + fileName);
+    if (!validName || !file.isFile())
+        return {};
+    return file;
+}
+
+/**
+ * Serves a file that never changes under the given ETag, with ranges for seeking.
+ */
+static HttpResponse serveFile(const HttpRequest &request, const QFileInfo &file, const QByteArray &mimeType, const QByteArray &etag)
+{
+    HttpResponse response;
+    response.headers << qMakePair(QByteArray("ETag"), etag);
+    response.headers << qMakePair(QByteArray("Cache-Control"), QByteArray("public, max-age=31536000, immutable"));
+    response.headers << qMakePair(QByteArray("Accept-Ranges"), QByteArray("bytes"));
+
+    if (request.header("If-None-Match") == etag) {
+        response.status = 304;
+        return response;
+    }
+
+    const qint64 fileSize = file.size();
+    qint64 offset = 0;
+    qint64 length = fileSize;
+
+    // a range only applies to the version of the file that the client already knows
+    const QByteArray ifRange = request.header("If-Range");
+    const QByteArray rangeHeader = request.header("Range");
+    if (!rangeHeader.isEmpty() && (ifRange.isEmpty() || ifRange == etag)) {
+        if (!parseRange(rangeHeader, fileSize, offset, length)) {
+            response.status = 416;
+            response.headers << qMakePair(QByteArray("Content-Range"), "bytes */" + QByteArray::number(fileSize));
+            return response;
+        }
+        if (length != fileSize) {
+            response.status = 206;
+            response.headers << qMakePair(QByteArray("Content-Range"),
+                                          "bytes " + QByteArray::number(offset) + "-" + QByteArray::number(offset + length - 1)
+                                          + "/" + QByteArray::number(fileSize));
+        }
+    }
+
+    response.contentType = mimeType;
+    response.filePath = file.filePath();
+    response.fileOffset = offset;
+    response.fileLength = length;
+    response.headOnly = (request.method == "HEAD");
+    return response;
+}
+
+/**
+ * Media files aren't supposed to change once they have a handle, but the handle alone
+ * wouldn't tell if one did, or tell apart files that differ only in their ending.
+ */
+static QByteArray mediaEtag(const QFileInfo &file, const QByteArray &variant = QByteArray())
+{
+    QByteArray etag = file.fileName().toUtf8() + "-" + QByteArray::number(file.size(), 16)
+            + "-" + QByteArray::number(file.lastModified().toMSecsSinceEpoch(), 16);
+    if (!variant.isEmpty())
+        etag += "." + variant;
+    return '"' + etag + '"';
+}
+
+/**
+ * Serves /media/<handle>.<ending> from mediaBaseDir.
+ */
+static HttpResponse serveMedia(const ServerSettings &settings, const HttpRequest &request)
+{
+    if (request.method != "GET" && request.method != "HEAD")
+        return statusResponse(405);
+
+    const Option<QFileInfo> file = mediaFile(settings, request.uri.mid(strlen(mediaPathPrefix)));
+    if (!file)
+        return statusResponse(404);
+
+    const QByteArray etag = mediaEtag(file.getValue());
+    return serveFile(request, file.getValue(), mediaMimeType(file->suffix()), etag);
+}
+
+/**
+ * Serves /transcode/<profile>/<handle>.<ending>, once the transcoder has it.
+ */
+static void serveTranscoded(const ServerSettings &settings, Transcoder &transcoder, const HttpRequest &request, const HttpServer::Responder &respond)
+{
+    if (request.method != "GET" && request.method != "HEAD") {
+        respond(statusResponse(405));
+        return;
+    }
+
+    const QByteArray path = request.uri.mid(strlen(transcodePathPrefix));
+    const int slash = path.indexOf('/');
+    const Transcoder::Profile *profile = Transcoder::profile(QString::fromUtf8(path.left(slash)));
+    const Option<QFileInfo> file = mediaFile(settings, path.mid(slash + 1));
+    if (slash <= 0 || !profile || !file) {
+        respond(statusResponse(404));
+        return;
+    }
+
+    const QByteArray etag = mediaEtag(file.getValue(), profile->name);
+    transcoder.transcode(file->filePath(), profile, [=](const QString &transcodedPath) {
+        if (transcodedPath.isEmpty())
+            respond(statusResponse(500));
         else
-            qWarning() << "Omitting message, size =" << messageJson.size();
-        std::cout << Message(error).toJson().constData() << std::endl;
-        return 0;
+            respond(serveFile(request, QFileInfo(transcodedPath), profile->mimeType, etag));
+    });
+}
+
+/**
+ * Who is asking, as far as we can tell. A reverse proxy on this machine that authenticated
+ * the user says so in X-Remote-User, like the web server does with REMOTE_USER for CGIs.
+ * Anybody else is only known by their address, since we can't verify what else they send.
+ */
+static QString httpClient(const HttpRequest &request)
+{
+    const QByteArray user = request.header("X-Remote-User");
+    if (!user.isEmpty() && QHostAddress(request.peerAddress).isLoopback())
+        return QString::fromUtf8(user);
+    return request.peerAddress;
+}
+
+static QString cgiClient()
+{
+    const QByteArray user = qgetenv("REMOTE_USER");
+    return QString::fromUtf8(user.isEmpty() ? qgetenv("REMOTE_ADDR") : user);
+}
+
+class BlockingTask : public QRunnable
+{
+public:
+    BlockingTask(const std::function<void()> &function) : m_function(function) {}
+
+    void run() override { m_function(); }
+
+private:
+    std::function<void()> m_function;
+};
+
+/** Runs requests that wait on something else, and turns them away once too many are waiting */
+class BlockingPool
+{
+public:
+    BlockingPool(int maxThreads, int maxPending)
+        : m_maxPending(maxPending)
+    {
+        m_pool.setMaxThreadCount(maxThreads);
     }
 
-    Message message = messageParsingResult.takeValue();
-    Message response = handleMessage(settings, message, postData);
+    bool tryStart(const std::function<void()> &function)
+    {
+        if (m_pending.fetchAndAddOrdered(1) >= m_maxPending) {
+            m_pending.fetchAndAddOrdered(-1);
+            return false;
+        }
+        m_pool.start(new BlockingTask([=]() {
+            function();
+            m_pending.fetchAndAddOrdered(-1);
+        }));
+        return true;
+    }
+
+    void waitForDone() { m_pool.waitForDone(); }
+
+private:
+    QThreadPool m_pool;
+    const int m_maxPending;
+    QAtomicInt m_pending { 0 };
+};
+
+static int runHttpServer(const ServerSettings &settings, quint16 port)
+{
+    DbServerConnection dbserver(settings.dbserverHost(), settings.dbserverPort());
+
+    // long polls and youtube-dl would stall everybody else on the event loop, they get a thread and connection each.
+    // Separately, so that idle subscribers can't keep youtube lookups from running, and neither can starve the rest.
+    // Subscriptions don't queue, since they would time out while waiting.
+    BlockingPool subscriptionPool(64, 64);
+    BlockingPool youtubePool(8, 32);
+
+    Transcoder transcoder(settings.toolsDir(), settings.transcodeCacheDir(), settings.transcodeCacheSize(), settings.transcodeJobs());
+
+    HttpServer server([&](const HttpRequest &request, const HttpServer::Responder &respond) {
+        if (request.uri.startsWith(mediaPathPrefix)) {
+            respond(serveMedia(settings, request));
+            return;
+        }
+        if (request.uri.startsWith(transcodePathPrefix)) {
+            serveTranscoded(settings, transcoder, request, respond);
+            return;
+        }
+
+        // uploads stay in the file the server spooled them to, a message in the body is read back in
+        const bool uploadsFile = (request.uri.indexOf(message64Query) >= 0);
+        const QByteArray postData = (request.bodyFile && !uploadsFile) ? request.bodyFile->readAll() : request.body;
+
+        QSharedPointer<Result<Message, EnjsonError>> message(new Result<Message, EnjsonError>(decodeRequest(request.uri, postData)));
+        const Type type = message->hasValue() ? message->getValue().getType() : Type::Error;
+        if (type != Type::SubscribeRequest && type != Type::YoutubeUrlQuery) {
+            QBuffer bodyBuffer;
+            bodyBuffer.setData(request.body);
+            bodyBuffer.open(QIODevice::ReadOnly);
+            QIODevice *bodyDevice = request.bodyFile ? request.bodyFile.data() : &bodyBuffer;
+            const RequestBody body{ bodyDevice, request.bodySize };
+            respond(processRequest(settings, dbserver, *message, request.header("Accept"), request.header("Accept-Encoding"), body, httpClient(request)));
+            return;
+        }
+
+        BlockingPool &pool = (type == Type::SubscribeRequest) ? subscriptionPool : youtubePool;
+        const bool started = pool.tryStart([&settings, &server, request, respond, message]() {
+            DbServerConnection blockingConnection(settings.dbserverHost(), settings.dbserverPort());
+            const HttpResponse response = processRequest(settings, blockingConnection, *message,
+                                                         request.header("Accept"), request.header("Accept-Encoding"), RequestBody(), httpClient(request));
+            QMetaObject::invokeMethod(&server, [=]() { respond(response); }, Qt::QueuedConnection);
+        });
+        if (!started) {
+            qWarning().noquote() << "Too many waiting requests, rejecting" << typeString(type);
+            respond(statusResponse(503));
+        }
+    }, settings.maxUploadSize());
+    QDir().mkpath(settings.tempDir());
+    server.setSpoolDir(settings.tempDir());
+
+    const QHostAddress address(settings.httpListenAddress());
+    if (address.isNull()) {
+        qWarning() << "Invalid HTTP_LISTEN_ADDRESS:" << settings.httpListenAddress();
+        return 1;
+    }
+    if (!server.listen(address, port))
+        return 1;
+
+    const int ret = QCoreApplication::exec();
+    subscriptionPool.waitForDone();
+    youtubePool.waitForDone();
+    Compression::Metrics::dump();
+    return ret;
+}
+
+static int runCgi(const ServerSettings &settings)
+{
+#ifdef Q_OS_WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+
+    QFile input;
+    input.open(stdin, QIODevice::ReadOnly | QIODevice::Unbuffered);
+
+    const QByteArray requestUri = qgetenv("REQUEST_URI");
+    const qint64 contentLength = qgetenv("CONTENT_LENGTH").toLongLong();
+    RequestBody body{ &input, qMax<qint64>(0, contentLength) };
 
-    std::cout << response.toJson().constData() << std::endl;
+    // Read POST data from stdin, unless it is file data that we'd rather stream to disk later on
+    QByteArray postData;
+    if (requestUri.indexOf(message64Query) < 0) {
+        while (postData.size() < body.size) {
+            const QByteArray read = input.read(body.size - postData.size());
+            if (read.isEmpty())
+                break;
+            postData += read;
+        }
+        body.size = 0;
+    }
+
+    DbServerConnection dbserver(settings.dbserverHost(), settings.dbserverPort());
+    const HttpResponse response = processRequest(settings, dbserver, decodeRequest(requestUri, postData),
+                                                 qgetenv("HTTP_ACCEPT"), qgetenv("HTTP_ACCEPT_ENCODING"), body, cgiClient());
 
+    std::cout << "Content-Type: " << response.contentType.constData() << "\r\n";
+    if (!response.contentEncoding.isEmpty())
+        std::cout << "Content-Encoding: " << response.contentEncoding.constData() << "\r\n";
+    std::cout << "Content-Length: " << response.body.size() << "\r\n\r\n";
+    std::cout.write(response.body.constData(), response.body.size());
+    std::cout.flush();
+
+    Compression::Metrics::dump();
     return 0;
 }
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    const QCommandLineOption listenOption("listen", "Stay resident and serve HTTP on <port>, instead of handling a single CGI request", "port");
+    parser.addOption(listenOption);
+    const QCommandLineOption prefetchOption(YoutubeUrlCache::prefetchOption(), "Resolve the queued YouTube prefetches into the cache, then exit");
+    parser.addOption(prefetchOption);
+    parser.process(app);
+
+    const ServerSettings settings;
+    if (!settings.isValid()) {
+        qWarning() << "Settings file not valid";
+        return 1;
+    }
+
+    if (!settings.cgiLogFile().isEmpty()) {
+        Logger::setLogFile(settings.cgiLogFile());
+        Logger::setLogFileFilter(settings.cgiLogLevel());
+        Logger::install();
+    }
+
+    if (parser.isSet(prefetchOption)) {
+        YoutubeUrlCache(settings.toolsDir(), youtubeCacheDir(settings)).runPrefetch();
+        return 0;
+    }
+
+    if (parser.isSet(listenOption)) {
+        bool ok = false;
+        const quint16 port = parser.value(listenOption).toUShort(&ok);
+        if (!ok) {
+            qWarning() << "Invalid port:" << parser.value(listenOption);
+            return 1;
+        }
+        return runHttpServer(settings, port);
+    }
+
+    return runCgi(settings);
+}
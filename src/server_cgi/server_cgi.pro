@@ -7,11 +7,18 @@ QT += core network
 
 SOURCES += \
     main.cpp \
+    httpserver.cpp \
+    uploadsession.cpp \
+    transcoder.cpp \
+    youtubecache.cpp \
     \
+    ../shared/compression.cpp \
     ../shared/jsonconv.cpp \
     ../shared/library.cpp \
     ../shared/library_serialize.cpp \
+    ../shared/library_compact.cpp \
     ../shared/logger.cpp \
+    ../shared/processrunner.cpp \
     ../shared/serversettings.cpp \
     ../shared/tcpclientserver.cpp \
     \
@@ -30,12 +37,20 @@ SOURCES += \
     ../../3rdparty/cpp-musicscrape/musicscrape/musicscrape.cpp \
 
 HEADERS += \
+    httpserver.hpp \
+    uploadsession.hpp \
+    transcoder.hpp \
+    youtubecache.hpp \
+    \
+    ../shared/compression.hpp \
     ../shared/flatmap.hpp \
     ../shared/jsonconv.hpp \
     ../shared/library.hpp \
     ../shared/library_types.hpp \
     ../shared/library_messages.hpp \
+    ../shared/nameregistry.hpp \
     ../shared/logger.hpp \
+    ../shared/processrunner.hpp \
     ../shared/serversettings.hpp \
     ../shared/tcpclientserver.hpp \
 
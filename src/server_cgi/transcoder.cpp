@@ -0,0 +1,151 @@
+#include "transcoder.hpp"
+#include "processrunner.hpp"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QDateTime>
+#include <QPointer>
+#include <QDebug>
+
+#include <algorithm>
+
+// nobody waits this long for a song, something must be wrong
+static constexpr int JOB_TIMEOUT_MSECS = 10 * 60 * 1000;
+
+// beyond this, requests fail right away rather than waiting for ages
+static constexpr int MAX_QUEUED_JOBS = 64;
+
+static const QVector<Transcoder::Profile> s_profiles = {
+    { "opus64", { "-c:a", "libopus", "-b:a", "64k", "-f", "ogg" }, "opus", "audio/ogg" },
+    { "opus96", { "-c:a", "libopus", "-b:a", "96k", "-f", "ogg" }, "opus", "audio/ogg" },
+    { "aac128", { "-c:a", "aac", "-b:a", "128k", "-f", "ipod" }, "m4a", "audio/mp4" },
+};
+
+const Transcoder::Profile *Transcoder::profile(const QString &name)
+{
+    const auto it = std::find_if(s_profiles.begin(), s_profiles.end(), [&](const Profile &profile) {
+        return name == profile.name;
+    });
+    return (it == s_profiles.end()) ? nullptr : &*it;
+}
+
+Transcoder::Transcoder(const QString &toolsDir, const QString &cacheDir, qint64 cacheSize, int maxJobs)
+    : QObject()
+    , m_ffmpeg(toolsDir + "/ffmpeg")
+    , m_cacheDir(cacheDir)
+    , m_cacheSize(cacheSize)
+    , m_maxJobs(maxJobs)
+{
+    QDir().mkpath(m_cacheDir);
+
+    // left behind by jobs that were running when we were stopped last time
+    for (const QFileInfo &file : QDir(m_cacheDir).entryInfoList({ "*.part" }, QDir::Files)) {
+        qDebug() << "Transcoder: Removing leftover" << file.fileName();
+        QFile::remove(file.filePath());
+    }
+}
+
+Transcoder::~Transcoder()
+{
+}
+
+void Transcoder::transcode(const QString &sourcePath, const Profile *profile, const Callback &callback)
+{
+    // the whole name, since handles may come with different endings
+    const QString cachePath = m_cacheDir + "/" + QFileInfo(sourcePath).fileName()
+            + "." + profile->name + "." + profile->suffix;
+
+    // cache hit, mark it as recently used
+    QFile cached(cachePath);
+    if (cached.exists()) {
+        if (cached.open(QIODevice::ReadWrite))
+            cached.setFileTime(QDateTime::currentDateTimeUtc(), QFileDevice::FileModificationTime);
+        callback(cachePath);
+        return;
+    }
+
+    auto it = m_jobs.find(cachePath);
+    if (it == m_jobs.end()) {
+        if (m_queue.size() >= MAX_QUEUED_JOBS) {
+            qWarning() << "Transcoder: Too many jobs waiting, rejecting" << cachePath;
+            callback(QString());
+            return;
+        }
+        it = m_jobs.insert(cachePath, Job{ sourcePath, cachePath, profile, {} });
+        m_queue.enqueue(cachePath);
+    }
+    it->callbacks << callback;
+
+    startJobs();
+}
+
+void Transcoder::startJobs()
+{
+    while (m_runningJobs < m_maxJobs && !m_queue.isEmpty()) {
+        const Job &job = m_jobs[m_queue.dequeue()];
+        const QString cachePath = job.cachePath;
+
+        // written next to the result and renamed when done, so that nobody ever sees half a file
+        QStringList arguments = { "-nostdin", "-v", "error", "-y", "-i", job.sourcePath, "-vn" };
+        arguments << job.profile->codecArguments << (cachePath + ".part");
+
+        // somebody is about to play the result
+        ProcessRunner::Options options;
+        options.timeoutMsecs = JOB_TIMEOUT_MSECS;
+        options.lane = ProcessRunner::Lane::Interactive;
+
+        const QPointer<Transcoder> self(this);
+        m_runningJobs += 1;
+        ProcessRunner::start(m_ffmpeg, arguments, options, [=](const Result<ProcessRunner::Output, QString> &result) {
+            if (self.isNull())
+                return;
+            if (result.hasError())
+                qWarning().noquote() << "Transcoder:" << result.getError();
+            onJobFinished(cachePath, !result.hasError());
+        });
+    }
+}
+
+void Transcoder::onJobFinished(const QString &cachePath, bool success)
+{
+    m_runningJobs -= 1;
+
+    const Job job = m_jobs.take(cachePath);
+    const QString partPath = cachePath + ".part";
+
+    if (success && QFile::rename(partPath, cachePath)) {
+        qDebug() << "Transcoder: Created" << cachePath << QFileInfo(cachePath).size() << "bytes";
+        evict();
+    } else {
+        qWarning() << "Transcoder: Failed to transcode" << job.sourcePath << "to" << job.profile->name;
+        QFile::remove(partPath);
+    }
+
+    const QString result = QFile::exists(cachePath) ? cachePath : QString();
+    for (const Callback &callback : job.callbacks)
+        callback(result);
+
+    startJobs();
+}
+
+void Transcoder::evict()
+{
+    QFileInfoList files = QDir(m_cacheDir).entryInfoList(QDir::Files, QDir::Time | QDir::Reversed);
+
+    qint64 totalSize = 0;
+    for (const QFileInfo &file : qAsConst(files))
+        totalSize += file.size();
+
+    // oldest first, leave files of running jobs alone, but not those of failed ones
+    for (const QFileInfo &file : qAsConst(files)) {
+        if (totalSize <= m_cacheSize)
+            break;
+        if (file.suffix() == "part" && m_jobs.contains(file.filePath().chopped(5)))
+            continue;
+
+        totalSize -= file.size();
+        QFile::remove(file.filePath());
+        qDebug() << "Transcoder: Evicted" << file.fileName();
+    }
+}
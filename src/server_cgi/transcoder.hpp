@@ -0,0 +1,63 @@
+#pragma once
+
+#include <QObject>
+#include <QHash>
+#include <QQueue>
+#include <QStringList>
+
+#include <functional>
+
+/**
+ * Produces lower bitrate variants of media files with ffmpeg, on first request.
+ *
+ * Results are cached on disk as <handle>.<ending>.<profile>.<suffix>, and the least
+ * recently used ones are evicted once the cache grows beyond its size limit. Only a
+ * limited number of ffmpeg jobs run at once, and concurrent requests for the same
+ * variant wait for the same job. Once too many jobs are waiting, requests are rejected.
+ */
+class Transcoder : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Profile
+    {
+        const char *name;
+        QStringList codecArguments;
+        const char *suffix;
+        const char *mimeType;
+    };
+
+    static const Profile *profile(const QString &name);
+
+    /** Called with the path of the transcoded file, or with an empty path on errors */
+    using Callback = std::function<void(const QString &path)>;
+
+    Transcoder(const QString &toolsDir, const QString &cacheDir, qint64 cacheSize, int maxJobs);
+    ~Transcoder() override;
+
+    /** sourcePath must exist, the callback may be invoked before this returns */
+    void transcode(const QString &sourcePath, const Profile *profile, const Callback &callback);
+
+private:
+    struct Job
+    {
+        QString sourcePath;
+        QString cachePath;
+        const Profile *profile;
+        QVector<Callback> callbacks;
+    };
+
+    void startJobs();
+    void onJobFinished(const QString &cachePath, bool success);
+    void evict();
+
+    QString m_ffmpeg;
+    QString m_cacheDir;
+    qint64 m_cacheSize;
+    int m_maxJobs;
+
+    QHash<QString, Job> m_jobs;
+    QQueue<QString> m_queue;
+    int m_runningJobs = 0;
+};
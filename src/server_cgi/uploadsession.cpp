@@ -0,0 +1,220 @@
+#include "uploadsession.hpp"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QCryptographicHash>
+#include <QRandomGenerator>
+#include <QDebug>
+
+#include <algorithm>
+
+using namespace MoosickMessage;
+
+Option<QString> copyStream(QIODevice &source, QFileDevice &destination, qint64 size, QCryptographicHash &hash)
+{
+    // large enough to keep syscalls out of the picture, small enough not to matter for RSS
+    constexpr qint64 bufferSize = 1 << 20;
+
+    QByteArray buffer(qMin(bufferSize, qMax<qint64>(size, 1)), Qt::Uninitialized);
+    qint64 copied = 0;
+    while (copied < size) {
+        const qint64 read = source.read(buffer.data(), qMin<qint64>(buffer.size(), size - copied));
+        if (read < 0 || (read == 0 && !source.waitForReadyRead(30000)))
+            return QString("Data ended after %1 of %2 bytes").arg(copied).arg(size);
+
+        hash.addData(buffer.constData(), read);
+        if (destination.write(buffer.constData(), read) != read) {
+            qWarning() << "Failed to write" << destination.fileName();
+            return QString("Failed to store upload");
+        }
+        copied += read;
+    }
+
+    return {};
+}
+
+static QString uploadsDir(const QString &tempDir)
+{
+    return tempDir + "/uploads";
+}
+
+static bool isValidId(const QString &id)
+{
+    // the ID ends up in a path, so be picky
+    if (id.isEmpty() || id.size() > 32)
+        return false;
+    return std::all_of(id.begin(), id.end(), [](QChar c) {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+    });
+}
+
+Result<UploadSession, QString> UploadSession::create(const QString &tempDir, const UploadSessionBegin &request, qint64 maxFileSize)
+{
+    if (request.fileSize < 0)
+        return QString("Invalid file size");
+    if (request.fileSize > maxFileSize)
+        return QString("File is too large");
+
+    UploadSession session;
+    session.m_id = QString::number(QRandomGenerator::global()->generate64(), 16);
+    session.m_dir = uploadsDir(tempDir) + "/" + session.m_id;
+    session.m_request = request;
+
+    if (!QDir().mkpath(session.chunksPath())) {
+        qWarning() << "Can't create" << session.m_dir;
+        return QString("Can't create upload session");
+    }
+
+    // the data file gets its final size right away, so that chunks can be written in any order
+    QFile data(session.dataPath());
+    if (!data.open(QIODevice::WriteOnly) || !data.resize(request.fileSize)) {
+        qWarning() << "Can't create" << session.dataPath();
+        QDir(session.m_dir).removeRecursively();
+        return QString("Can't create upload session");
+    }
+
+    QFile requestFile(session.m_dir + "/request");
+    if (!requestFile.open(QIODevice::WriteOnly) || requestFile.write(Message(request).toJson()) < 0) {
+        qWarning() << "Can't create" << requestFile.fileName();
+        QDir(session.m_dir).removeRecursively();
+        return QString("Can't create upload session");
+    }
+
+    return session;
+}
+
+Result<UploadSession, QString> UploadSession::open(const QString &tempDir, const QString &id)
+{
+    if (!isValidId(id))
+        return QString("Invalid upload session ID");
+
+    UploadSession session;
+    session.m_id = id;
+    session.m_dir = uploadsDir(tempDir) + "/" + id;
+
+    QFile requestFile(session.m_dir + "/request");
+    if (!requestFile.open(QIODevice::ReadOnly))
+        return QString("No such upload session");
+
+    Result<Message, EnjsonError> message = Message::decode(requestFile.readAll());
+    if (!message.hasValue() || !message->as<UploadSessionBegin>())
+        return QString("Upload session is corrupt");
+
+    session.m_request = *message->as<UploadSessionBegin>();
+    return session;
+}
+
+void UploadSession::removeStale(const QString &tempDir, qint64 maxAgeSecs)
+{
+    const QDateTime now = QDateTime::currentDateTimeUtc();
+    const QFileInfoList sessions = QDir(uploadsDir(tempDir)).entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot);
+    for (const QFileInfo &session : sessions) {
+        // new chunks touch the chunks directory
+        const QFileInfo chunks(session.filePath() + "/chunks");
+        const QDateTime lastModified = chunks.exists() ? chunks.lastModified() : session.lastModified();
+        if (lastModified.secsTo(now) > maxAgeSecs) {
+            qDebug() << "Removing stale upload session" << session.fileName();
+            QDir(session.filePath()).removeRecursively();
+        }
+    }
+}
+
+Option<QString> UploadSession::writeChunk(qint64 offset, QIODevice &source, qint64 size)
+{
+    if (offset < 0 || size <= 0 || offset + size > *m_request.fileSize)
+        return QString("Chunk exceeds the file size");
+
+    QFile data(dataPath());
+    if (!data.open(QIODevice::ReadWrite) || !data.seek(offset)) {
+        qWarning() << "Can't open" << dataPath();
+        return QString("Can't store chunk");
+    }
+
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    const Option<QString> error = copyStream(source, data, size, hash);
+    if (error)
+        return error;
+
+    // only mark the chunk as received once it is on disk
+    if (!data.flush()) {
+        qWarning() << "Failed to write" << dataPath();
+        return QString("Can't store chunk");
+    }
+    data.close();
+
+    QFile marker(chunksPath() + QString("/%1-%2").arg(offset).arg(size));
+    if (!marker.open(QIODevice::WriteOnly)) {
+        qWarning() << "Can't create" << marker.fileName();
+        return QString("Can't store chunk");
+    }
+
+    return {};
+}
+
+QVector<UploadSession::Range> UploadSession::receivedRanges() const
+{
+    QVector<Range> ranges;
+    const QStringList chunks = QDir(chunksPath()).entryList(QDir::Files);
+    for (const QString &chunk : chunks) {
+        const QStringList parts = chunk.split('-');
+        bool offsetOk = false;
+        bool sizeOk = false;
+        const Range range(parts.value(0).toLongLong(&offsetOk), parts.value(1).toLongLong(&sizeOk));
+        if (parts.size() == 2 && offsetOk && sizeOk)
+            ranges << range;
+    }
+
+    std::sort(ranges.begin(), ranges.end());
+
+    // merge overlapping and adjacent ranges
+    QVector<Range> merged;
+    for (const Range &range : qAsConst(ranges)) {
+        if (!merged.isEmpty() && range.first <= merged.last().first + merged.last().second) {
+            Range &last = merged.last();
+            last.second = qMax(last.first + last.second, range.first + range.second) - last.first;
+        } else {
+            merged << range;
+        }
+    }
+
+    return merged;
+}
+
+Option<QString> UploadSession::finish(const QByteArray &sha256, const QString &filePath)
+{
+    const QVector<Range> ranges = receivedRanges();
+    const bool complete = (*m_request.fileSize == 0)
+            || (ranges.size() == 1 && ranges.first().first == 0 && ranges.first().second == *m_request.fileSize);
+    if (!complete)
+        return QString("Upload is incomplete");
+
+    QFile data(dataPath());
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    if (!data.open(QIODevice::ReadOnly) || !hash.addData(&data)) {
+        qWarning() << "Can't read" << dataPath();
+        return QString("Can't read upload");
+    }
+    data.close();
+
+    if (hash.result() != sha256)
+        return QString("Checksum mismatch");
+
+    if (!QFile::rename(dataPath(), filePath)) {
+        qWarning() << "Can't move" << dataPath() << "to" << filePath;
+        return QString("Can't store upload");
+    }
+
+    QDir(m_dir).removeRecursively();
+    return {};
+}
+
+UploadSessionResponse UploadSession::response() const
+{
+    UploadSessionResponse response;
+    response.sessionId = m_id;
+    response.fileSize = m_request.fileSize;
+    response.receivedRanges = receivedRanges();
+    return response;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <QString>
+#include <QVector>
+#include <QPair>
+
+#include "option.hpp"
+#include "result.hpp"
+#include "library_messages.hpp"
+
+class QIODevice;
+class QFileDevice;
+class QCryptographicHash;
+
+/**
+ * Copies size bytes from source to the current position of destination in large
+ * blocks, feeding them to hash along the way.
+ */
+Option<QString> copyStream(QIODevice &source, QFileDevice &destination, qint64 size, QCryptographicHash &hash);
+
+/**
+ * A resumable upload, kept in tempDir/uploads/<id>/ so that it outlives the CGI process.
+ *
+ * Chunks may arrive in any order, and in parallel: each one is written into place,
+ * and only then marked as received by an empty file named after its range.
+ * That way, no locking is needed between processes, and chunks that were cut off
+ * are simply missing from receivedRanges().
+ */
+class UploadSession
+{
+public:
+    using Range = MoosickMessage::UploadSessionResponse::Range;
+
+    static Result<UploadSession, QString> create(const QString &tempDir, const MoosickMessage::UploadSessionBegin &request, qint64 maxFileSize);
+    static Result<UploadSession, QString> open(const QString &tempDir, const QString &id);
+
+    /** Sessions that haven't seen a chunk in a while are given up on */
+    static void removeStale(const QString &tempDir, qint64 maxAgeSecs);
+
+    QString id() const { return m_id; }
+    const MoosickMessage::UploadSessionBegin &request() const { return m_request; }
+
+    Option<QString> writeChunk(qint64 offset, QIODevice &source, qint64 size);
+
+    /** Sorted and merged */
+    QVector<Range> receivedRanges() const;
+
+    /**
+     * Checks that all data has arrived and matches sha256, then moves the file out
+     * of the session into filePath, and removes the session.
+     */
+    Option<QString> finish(const QByteArray &sha256, const QString &filePath);
+
+    MoosickMessage::UploadSessionResponse response() const;
+
+private:
+    UploadSession() = default;
+
+    QString dataPath() const { return m_dir + "/data"; }
+    QString chunksPath() const { return m_dir + "/chunks"; }
+
+    QString m_id;
+    QString m_dir;
+    MoosickMessage::UploadSessionBegin m_request;
+};
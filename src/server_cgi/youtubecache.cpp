@@ -0,0 +1,295 @@
+#include "youtubecache.hpp"
+#include "processrunner.hpp"
+
+#include <QCoreApplication>
+#include <QProcess>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QUrlQuery>
+#include <QUrl>
+#include <QDir>
+#include <QFile>
+#include <QSaveFile>
+#include <QLockFile>
+#include <QDateTime>
+#include <QMutex>
+#include <QHash>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QDebug>
+
+#include <algorithm>
+
+using namespace MoosickMessage;
+
+// URLs are given up on this long before YouTube says they expire, so that there's time to play them
+static constexpr qint64 EXPIRY_MARGIN_SECS = 30 * 60;
+
+// for URLs that don't tell when they expire, or take unusually long to do so
+static constexpr qint64 MAX_TTL_SECS = 6 * 3600;
+static constexpr qint64 DEFAULT_TTL_SECS = 3600;
+
+static constexpr int YOUTUBE_DL_TIMEOUT_MSECS = 60 * 1000;
+static constexpr int MAX_PREFETCH = 10;
+
+// prefetches beyond this are dropped, they'd hardly be done before anybody asks for them
+static constexpr int MAX_QUEUED_PREFETCHES = 50;
+
+// youtube-dl processes started by the prefetch process at once
+static constexpr int PARALLEL_PREFETCHES = 2;
+
+static bool isValidVideoId(const QString &videoId)
+{
+    // the ID ends up in paths and command lines
+    return !videoId.isEmpty() && videoId.size() <= 32 && std::all_of(videoId.begin(), videoId.end(), [](QChar c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_';
+    });
+}
+
+YoutubeUrlCache::YoutubeUrlCache(const QString &toolsDir, const QString &cacheDir)
+    : m_toolsDir(toolsDir)
+    , m_cacheDir(cacheDir)
+{
+    QDir().mkpath(m_cacheDir);
+}
+
+Message YoutubeUrlCache::lookup(const QString &videoId)
+{
+    if (!isValidVideoId(videoId))
+        return new Error("Invalid video ID");
+
+    Message message;
+    if (readCache(videoId, message))
+        return message;
+
+    // one lookup per video at a time, whoever comes second finds the result in the cache
+    struct VideoMutex
+    {
+        QMutex mutex;
+
+        /** Lookups holding or waiting for the mutex, guarded by s_videoMutexesLock */
+        int users = 0;
+    };
+    static QMutex s_videoMutexesLock;
+    static QHash<QString, VideoMutex*> s_videoMutexes;
+    VideoMutex *videoMutex = nullptr;
+    {
+        QMutexLocker locker(&s_videoMutexesLock);
+        VideoMutex *&mutex = s_videoMutexes[videoId];
+        if (!mutex)
+            mutex = new VideoMutex();
+        mutex->users += 1;
+        videoMutex = mutex;
+    }
+    QMutexLocker videoLocker(&videoMutex->mutex);
+
+    QLockFile lockFile(lockPath(videoId));
+    lockFile.setStaleLockTime(2 * YOUTUBE_DL_TIMEOUT_MSECS);
+    const bool locked = lockFile.tryLock(YOUTUBE_DL_TIMEOUT_MSECS);
+
+    if (!readCache(videoId, message)) {
+        qint64 expires = 0;
+        message = resolve(videoId, expires);
+        if (message.getType() == Type::YoutubeUrlResponse)
+            writeCache(videoId, message, expires);
+    }
+
+    if (locked)
+        lockFile.unlock();
+
+    videoLocker.unlock();
+    QMutexLocker locker(&s_videoMutexesLock);
+    videoMutex->users -= 1;
+    if (videoMutex->users == 0) {
+        s_videoMutexes.remove(videoId);
+        delete videoMutex;
+    }
+
+    return message;
+}
+
+int YoutubeUrlCache::prefetch(const QStringList &videoIds)
+{
+    const QDir queueDir(prefetchQueueDir());
+    QDir().mkpath(queueDir.path());
+    int queueSize = queueDir.entryList(QDir::Files).size();
+
+    int queued = 0;
+    for (const QString &videoId : videoIds) {
+        if (queued >= MAX_PREFETCH || queueSize >= MAX_QUEUED_PREFETCHES)
+            break;
+        if (!isValidVideoId(videoId) || queueDir.exists(videoId))
+            continue;
+
+        Message cached;
+        if (readCache(videoId, cached))
+            continue;
+
+        // somebody holds the lock while youtube-dl runs for this video
+        QLockFile lockFile(lockPath(videoId));
+        lockFile.setStaleLockTime(2 * YOUTUBE_DL_TIMEOUT_MSECS);
+        if (!lockFile.tryLock(0))
+            continue;
+        lockFile.unlock();
+
+        QFile entry(queueDir.filePath(videoId));
+        if (!entry.open(QIODevice::WriteOnly))
+            continue;
+        queued += 1;
+        queueSize += 1;
+    }
+
+    if (queued == 0)
+        return 0;
+
+    // the queue is written first, so that a prefetch process that is about to exit still sees it
+    QLockFile prefetchLock(prefetchLockPath());
+    prefetchLock.setStaleLockTime(0);
+    if (!prefetchLock.tryLock(0))
+        return queued;
+    prefetchLock.unlock();
+
+    if (!QProcess::startDetached(QCoreApplication::applicationFilePath(), { QString("--") + prefetchOption() })) {
+        qWarning() << "Failed to start YouTube prefetch";
+        return 0;
+    }
+
+    return queued;
+}
+
+class PrefetchTask : public QRunnable
+{
+public:
+    PrefetchTask(YoutubeUrlCache &cache, const QString &videoId) : m_cache(cache), m_videoId(videoId) {}
+
+    void run() override { m_cache.lookup(m_videoId); }
+
+private:
+    YoutubeUrlCache &m_cache;
+    QString m_videoId;
+};
+
+void YoutubeUrlCache::runPrefetch()
+{
+    // held for as long as it takes, only a dead holder makes it stale
+    QLockFile prefetchLock(prefetchLockPath());
+    prefetchLock.setStaleLockTime(0);
+
+    QThreadPool pool;
+    pool.setMaxThreadCount(PARALLEL_PREFETCHES);
+
+    const QDir queueDir(prefetchQueueDir());
+    for (;;) {
+        // only one of us works off the queue, anybody else leaves right away
+        if (!prefetchLock.tryLock(0))
+            return;
+
+        QStringList videoIds;
+        while (!(videoIds = queueDir.entryList(QDir::Files, QDir::Time | QDir::Reversed)).isEmpty()) {
+            for (const QString &videoId : qAsConst(videoIds)) {
+                queueDir.remove(videoId);
+                if (isValidVideoId(videoId))
+                    pool.start(new PrefetchTask(*this, videoId));
+            }
+            pool.waitForDone();
+        }
+
+        // whatever was queued while we were unlocking would be left behind otherwise
+        prefetchLock.unlock();
+        if (queueDir.entryList(QDir::Files).isEmpty())
+            return;
+    }
+}
+
+bool YoutubeUrlCache::readCache(const QString &videoId, Message &message) const
+{
+    QFile file(cachePath(videoId));
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    // first line is the expiry, the rest is the message
+    const qint64 expires = file.readLine().trimmed().toLongLong();
+    if (expires <= QDateTime::currentSecsSinceEpoch()) {
+        file.remove();
+        return false;
+    }
+
+    Result<Message, EnjsonError> cached = Message::decode(file.readAll());
+    if (!cached.hasValue() || cached->getType() != Type::YoutubeUrlResponse)
+        return false;
+
+    message = cached.takeValue();
+    return true;
+}
+
+void YoutubeUrlCache::writeCache(const QString &videoId, const Message &message, qint64 expires) const
+{
+    QSaveFile file(cachePath(videoId));
+    if (!file.open(QIODevice::WriteOnly))
+        return;
+
+    file.write(QByteArray::number(expires) + "\n");
+    file.write(message.toJson());
+    if (!file.commit())
+        qWarning() << "Failed to write" << cachePath(videoId);
+}
+
+Message YoutubeUrlCache::resolve(const QString &videoId, qint64 &expires)
+{
+    const QString url = QString("https://www.youtube.com/watch?v=") + videoId;
+    ProcessRunner::Options options;
+    options.timeoutMsecs = YOUTUBE_DL_TIMEOUT_MSECS;
+    const Result<ProcessRunner::Output, QString> youtubeDl = ProcessRunner::run(m_toolsDir + "/youtube-dl", {"-j", url}, options);
+    if (youtubeDl.hasError()) {
+        qWarning().noquote() << "Failed to resolve" << videoId << "-" << youtubeDl.getError();
+        return new Error("Internal Error");
+    }
+
+    const QJsonDocument jsonDoc = QJsonDocument::fromJson(youtubeDl->out);
+    if (!jsonDoc.isObject())
+        return new Error("Internal Error");
+    const QJsonObject json = jsonDoc.object();
+
+    const auto formatsIt = json.find("formats");
+    if (formatsIt == json.end() || !formatsIt->isArray())
+        return new Error("Internal Error");
+    const QJsonArray formats = formatsIt->toArray();
+
+    // find best audio URL among formats: no DASH, 'audio only', and largest file size
+    int bestAudioSize = 0;
+    QString bestUrl;
+    for (const QJsonValue &format : formats) {
+        const QString formatName = format["format"].toString();
+
+        // ain't nobody got love for DASH
+        if (formatName.toLower().contains("dash"))
+            continue;
+
+        const int size = format["filesize"].toInt();
+        bool isBest = bestUrl.isEmpty();
+        if (!isBest && formatName.contains("audio only") && size && size > bestAudioSize)
+            isBest = true;
+
+        if (isBest) {
+            bestUrl = format["url"].toString();
+            bestAudioSize = size;
+        }
+    }
+
+    if (bestUrl.isEmpty())
+        return new Error("Internal Error");
+
+    // YouTube URLs carry their expiry as a unix timestamp
+    const qint64 now = QDateTime::currentSecsSinceEpoch();
+    bool hasExpiry = false;
+    const qint64 urlExpires = QUrlQuery(QUrl(bestUrl)).queryItemValue("expire").toLongLong(&hasExpiry);
+    expires = hasExpiry ? qMin(urlExpires - EXPIRY_MARGIN_SECS, now + MAX_TTL_SECS) : now + DEFAULT_TTL_SECS;
+
+    YoutubeUrlResponse *response = new YoutubeUrlResponse();
+    response->title = json["title"].toString();
+    response->duration = json["duration"].toInt();
+    response->chapters = json["chapters"].toArray();
+    response->url = bestUrl;
+    return response;
+}
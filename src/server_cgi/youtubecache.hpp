@@ -0,0 +1,49 @@
+#pragma once
+
+#include <QString>
+#include <QStringList>
+
+#include "library_messages.hpp"
+
+/**
+ * Resolves audio URLs of YouTube videos with youtube-dl, and keeps the results in
+ * cacheDir until shortly before YouTube lets them expire.
+ *
+ * Lookups of the same video wait for each other, between threads via a mutex and
+ * between CGI processes via a lock file, so that youtube-dl runs only once.
+ *
+ * Prefetches go into a queue directory that is shared by all processes, and are
+ * worked off by a single detached process, a few at a time.
+ */
+class YoutubeUrlCache
+{
+public:
+    YoutubeUrlCache(const QString &toolsDir, const QString &cacheDir);
+
+    /** Returns a YoutubeUrlResponse, or an Error */
+    MoosickMessage::Message lookup(const QString &videoId);
+
+    /**
+     * Queues the given videos, except those that are cached or being looked up already,
+     * and starts the prefetch process unless it runs already. Returns how many were queued.
+     */
+    int prefetch(const QStringList &videoIds);
+
+    /** Entry point of that process, works off the queue until it is empty */
+    void runPrefetch();
+
+    static const char *prefetchOption() { return "prefetch-youtube"; }
+
+private:
+    MoosickMessage::Message resolve(const QString &videoId, qint64 &expires);
+
+    bool readCache(const QString &videoId, MoosickMessage::Message &message) const;
+    void writeCache(const QString &videoId, const MoosickMessage::Message &message, qint64 expires) const;
+    QString cachePath(const QString &videoId) const { return m_cacheDir + "/" + videoId + ".json"; }
+    QString lockPath(const QString &videoId) const { return m_cacheDir + "/" + videoId + ".lock"; }
+    QString prefetchQueueDir() const { return m_cacheDir + "/prefetch"; }
+    QString prefetchLockPath() const { return m_cacheDir + "/prefetch.lock"; }
+
+    QString m_toolsDir;
+    QString m_cacheDir;
+};
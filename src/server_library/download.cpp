@@ -1,85 +1,36 @@
 #include "download.hpp"
+#include "filetransfer.hpp"
 #include "jsonconv.hpp"
 #include "tcpclientserver.hpp"
 #include "option.hpp"
+#include "processrunner.hpp"
 
 #include <QFile>
 #include <QDir>
+#include <QFileInfo>
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QJsonArray>
-#include <QProcess>
+#include <QRegularExpression>
 #include <QNetworkAccessManager>
 #include <QNetworkRequest>
 #include <QNetworkReply>
 #include <QEventLoop>
+#include <QSet>
+
+#include <functional>
+#include <algorithm>
 
 #include "musicscrape/musicscrape.hpp"
 
 using namespace Moosick;
 using namespace MoosickMessage;
 
-static int runProcess(
-        const QString &program,
-        const QStringList &args,
-        QByteArray *out,
-        QByteArray *err,
-        int timeout,
-        const QByteArray &inputData = QByteArray())
-{
-    QProcess process;
-    process.setProgram(program);
-    process.setArguments(args);
-    process.start();
-
-    process.write(inputData);
-
-    int retCode = 0;
-
-    if (!process.waitForFinished(timeout)) {
-        qWarning() << "Process" << program << "didn't finish:" << process.error() << process.state() << process.exitStatus();
-        retCode = -1;
-    } else {
-        retCode = process.exitCode();
-    }
-
-    if (out) {
-        out->clear();
-        *out = process.readAllStandardOutput();
-    }
-    if (err) {
-        err->clear();
-        *err= process.readAllStandardError();
-    }
-
-    return retCode;
-}
-
-static QString createTempDir(const QString &dir)
-{
-    const bool result = QDir().mkpath(dir);
-    Q_ASSERT(result);
-
-    QByteArray out;
-    runProcess("mktemp", {"-d", "-p", dir}, &out, nullptr, 1000);
-    return QString(out).trimmed();
-}
-
-static QString createTempFile(const QString &dir, const QString &suffix = QString())
-{
-    const bool result = QDir().mkpath(dir);
-    Q_ASSERT(result);
-
-    QByteArray out;
-    runProcess("tempfile", {"-d", dir, "-s", suffix}, &out, nullptr, 1000);
-    return QString(out).trimmed();
-}
-
 struct YoutubeChapter
 {
     QString title;
-    int startTime;
-    int endTime;
+    double startTime;
+    double endTime;
 };
 
 struct YoutubeInfo
@@ -89,53 +40,73 @@ struct YoutubeInfo
     QVector<YoutubeChapter> chapters;
 };
 
-YoutubeInfo parseInfo(const QString &url, const QString &toolDir)
+YoutubeInfo parseInfo(const QString &url, const QString &toolDir, const QAtomicInt &cancelled)
 {
-    const QString youtubeId = url.split("=").last();
-    QByteArray out, err;
-    runProcess(toolDir + "/youtube-dl", {"-j", url}, &out, &err, 60000);
-
-    const QJsonDocument doc = QJsonDocument::fromJson(out);
-    const QJsonObject root = doc.object();
+    ProcessRunner::Options options;
+    options.timeoutMsecs = 60000;
+    options.lane = ProcessRunner::Lane::Background;
+    options.cancelled = &cancelled;
+    const Result<ProcessRunner::Output, QString> info = ProcessRunner::run(toolDir + "/youtube-dl", {"-j", url}, options);
 
     YoutubeInfo ret;
+    if (info.hasError()) {
+        qWarning().noquote() << "Couldn't get video info:" << info.getError();
+        return ret;
+    }
+
+    const QJsonObject root = QJsonDocument::fromJson(info->out).object();
+
     ret.title = root.value("title").toString();
     ret.duration = root.value("duration").toInt();
     for (const QJsonValue &chapterVal : root.value("chapters").toArray()) {
         const QJsonObject obj = chapterVal.toObject();
         const YoutubeChapter chapter {
             obj.value("title").toString(),
-            obj.value("start_time").toInt(),
-            obj.value("end_time").toInt(),
+            obj.value("start_time").toDouble(),
+            obj.value("end_time").toDouble(),
         };
-        if (!chapter.title.isEmpty() && chapter.startTime >= 0 && chapter.endTime > 0) {
+        if (!chapter.title.isEmpty() && chapter.startTime >= 0 && chapter.endTime > chapter.startTime) {
             ret.chapters << chapter;
         }
     }
     return ret;
 }
 
-Result<DownloadResult, QString> bandcampDownload(
+Option<QString> bandcampDownload(
         const MoosickMessage::DownloadRequest &downloadRequest,
-        const QString &tempDir);
+        const QString &workDir,
+        const QAtomicInt &cancelled,
+        DownloadProgress &progress,
+        const QSet<int> &handedOver,
+        const TrackCallback &onTrack);
 
-Result<DownloadResult, QString> youtubeDownload(
+Option<QString> youtubeDownload(
         const MoosickMessage::DownloadRequest &downloadRequest,
         const QString &toolDir,
-        const QString &tempDir);
+        const QString &workDir,
+        const QAtomicInt &cancelled,
+        DownloadProgress &progress,
+        const QSet<int> &handedOver,
+        const TrackCallback &onTrack);
 
-Result<DownloadResult, QString> download(
+Option<QString> download(
         const MoosickMessage::DownloadRequest &downloadRequest,
         const QString &toolDir,
-        const QString &tempDir)
+        const QString &workDir,
+        const QAtomicInt &cancelled,
+        DownloadProgress &progress,
+        const QSet<int> &handedOver,
+        const TrackCallback &onTrack)
 {
+    progress.start();
+
     switch (*downloadRequest.requestType) {
     case DownloadRequestType::BandcampAlbum:
-        return bandcampDownload(downloadRequest, tempDir);
+        return bandcampDownload(downloadRequest, workDir, cancelled, progress, handedOver, onTrack);
     case DownloadRequestType::YoutubeVideo:
-        return youtubeDownload(downloadRequest, toolDir, tempDir);
+        return youtubeDownload(downloadRequest, toolDir, workDir, cancelled, progress, handedOver, onTrack);
     default:
-        return {};
+        return QString("Unknown download type");
     }
 }
 
@@ -150,110 +121,238 @@ static QByteArray download(QNetworkAccessManager &network, const QByteArray &url
     return data;
 }
 
-Result<DownloadResult, QString> bandcampDownload(
+Option<QString> bandcampDownload(
         const DownloadRequest &downloadRequest,
-        const QString &tempDir)
+        const QString &workDir,
+        const QAtomicInt &cancelled,
+        DownloadProgress &progress,
+        const QSet<int> &handedOver,
+        const TrackCallback &onTrack)
 {
 #define REQUIRE(condition) do { if (!(condition)) { return QString(#condition); } } while (0)
 
     REQUIRE(downloadRequest.requestType == DownloadRequestType::BandcampAlbum);
 
-    QByteArray out, err;
-
     // get album info
     QNetworkAccessManager network;
     const QByteArray albumHtml = download(network, downloadRequest.url->toUtf8());
     ScrapeBandcamp::ResultList albumInfo = ScrapeBandcamp::albumInfo(std::string(albumHtml.data()));
 
-    QVector<DownloadResult::File> files;
-
-    // download tracks into mp3 files
-    const QString dstDir = createTempDir(tempDir) + "/";
+    // download tracks into mp3 files, except those that were handed over before
+    const QString dstDir = workDir + "/";
+    REQUIRE(QDir().mkpath(dstDir));
+    progress.setTracksTotal(albumInfo.size());
+    QVector<FileTransfer> transfers;
+    QVector<int> transferTracks;
     for (size_t i = 0; i < albumInfo.size(); ++i) {
-        const QByteArray mp3 = download(network, QByteArray(albumInfo[i].mp3url.data()));
-        QFile file(dstDir + QString::number(i) + ".mp3");
-        REQUIRE(file.open(QIODevice::WriteOnly));
-        REQUIRE(file.write(mp3) == mp3.size());
-        DownloadResult::File outFile;
-        outFile.title = QString::fromStdString(albumInfo[i].trackName);
-        outFile.duration = albumInfo[i].mp3duration;
-        outFile.fullPath = QFileInfo(file).absoluteFilePath();
-        outFile.fileEnding = "mp3";
-        outFile.albumPosition = albumInfo[i].trackNum;
-        files << outFile;
+        if (handedOver.contains((int) i)) {
+            progress.addTrackDone();
+            continue;
+        }
+        const QString filePath = dstDir + QString::number(i) + ".mp3";
+        transfers << FileTransfer{ QUrl(QString::fromUtf8(albumInfo[i].mp3url.data())), filePath, 0 };
+        transferTracks << (int) i;
     }
 
-    DownloadResult ret;
-    ret.artistId = downloadRequest.artistId;
-    ret.artistName = downloadRequest.artistName;
-    ret.albumName = downloadRequest.albumName;
-    ret.files = files;
-    ret.tempDir = QFileInfo(dstDir).absoluteFilePath();
+    const auto onFileDone = [&](int index) {
+        const int track = transferTracks[index];
+        DownloadedTrack outFile;
+        outFile.title = QString::fromStdString(albumInfo[track].trackName);
+        outFile.duration = albumInfo[track].mp3duration;
+        outFile.fullPath = QFileInfo(transfers[index].filePath).absoluteFilePath();
+        outFile.fileEnding = "mp3";
+        outFile.albumPosition = albumInfo[track].trackNum;
+        onTrack(track, outFile);
+    };
 
-    return ret;
+    // whatever made it to disk is kept for the next attempt
+    progress.setPhase(DownloadPhase::Downloading);
+    return downloadFiles(network, transfers, cancelled, progress, onFileDone);
 
 #undef REQUIRE
 }
 
-Result<DownloadResult, QString> youtubeDownload(
+// marks the line that tells where youtube-dl put the audio, among the rest of its output
+static const char *DOWNLOADED_FILE_PREFIX = "downloaded-file:";
+
+// how far a chapter file may be off its chapter's length, cuts happen at packet boundaries
+static constexpr double CHAPTER_DURATION_TOLERANCE_SECS = 1.0;
+
+/**
+ * Cuts sourcePath into one file per chapter with a single ffmpeg run of the segment
+ * muxer, which reads the source once and copies the audio without re-encoding.
+ *
+ * The source is cut at every chapter start and end, so gaps between chapters end up
+ * in segments of their own, which are dropped. The segment list written by ffmpeg is
+ * checked against the chapters, so that a source ending early or overlapping chapters
+ * make the split fail instead of producing tracks of the wrong length.
+ */
+static Result<QVector<DownloadedTrack>, QString> splitChapters(
+        const QString &toolDir,
+        const QString &sourcePath,
+        const QString &ending,
+        const QVector<YoutubeChapter> &chapters,
+        const QString &workDir,
+        const QAtomicInt &cancelled)
+{
+    auto sameTime = [](double a, double b) { return qAbs(a - b) < 0.001; };
+
+    QVector<double> boundaries = { 0.0 };
+    for (const YoutubeChapter &chapter : chapters)
+        boundaries << chapter.startTime << chapter.endTime;
+    std::sort(boundaries.begin(), boundaries.end());
+    boundaries.erase(std::unique(boundaries.begin(), boundaries.end(), sameTime), boundaries.end());
+
+    QStringList segmentTimes;
+    for (int i = 1; i < boundaries.size(); ++i)
+        segmentTimes << QString::number(boundaries[i], 'f', 3);
+
+    const QString segmentPattern = workDir + "/chapter%03d." + ending;
+    const QString segmentList = workDir + "/chapters.csv";
+    ProcessRunner::Options options;
+    options.timeoutMsecs = 600000;
+    options.lane = ProcessRunner::Lane::Background;
+    options.cancelled = &cancelled;
+    const Result<ProcessRunner::Output, QString> split = ProcessRunner::run(toolDir + "/ffmpeg", QStringList{
+        "-nostdin", "-v", "error", "-y", "-i", sourcePath, "-vn", "-c", "copy",
+        "-f", "segment", "-segment_times", segmentTimes.join(','), "-reset_timestamps", "1",
+        "-segment_list", segmentList, "-segment_list_type", "csv", segmentPattern}, options);
+    if (split.hasError())
+        return split.getError();
+
+    // one line per segment in order, "file,start,end"
+    QFile listFile(segmentList);
+    if (!listFile.open(QIODevice::ReadOnly))
+        return QString("No segment list");
+    QVector<double> segmentDurations;
+    for (const QByteArray &line : listFile.readAll().split('\n')) {
+        const QList<QByteArray> fields = line.trimmed().split(',');
+        if (fields.size() >= 3)
+            segmentDurations << fields[fields.size() - 1].toDouble() - fields[fields.size() - 2].toDouble();
+    }
+    listFile.close();
+    listFile.remove();
+
+    auto segmentPath = [&](int segment) {
+        return workDir + "/chapter" + QString("%1").arg(segment, 3, 10, QChar('0')) + "." + ending;
+    };
+
+    QVector<DownloadedTrack> files;
+    QSet<int> usedSegments;
+    for (int i = 0; i < chapters.size(); ++i) {
+        const YoutubeChapter &chapter = chapters[i];
+        const double expected = chapter.endTime - chapter.startTime;
+
+        const int segment = std::find_if(boundaries.begin(), boundaries.end(), [&](double time) {
+            return sameTime(time, chapter.startTime);
+        }) - boundaries.begin();
+        if (segment >= segmentDurations.size())
+            return QString("Chapter %1 is missing").arg(i);
+        if (qAbs(segmentDurations[segment] - expected) > CHAPTER_DURATION_TOLERANCE_SECS) {
+            return QString("Chapter %1 is %2s long instead of %3s")
+                    .arg(i).arg(segmentDurations[segment]).arg(expected);
+        }
+
+        DownloadedTrack outFile;
+        outFile.title = chapter.title;
+        outFile.duration = qRound(expected);
+        outFile.fullPath = QFileInfo(segmentPath(segment)).absoluteFilePath();
+        outFile.fileEnding = ending;
+        outFile.albumPosition = i;
+        files << outFile;
+        usedSegments << segment;
+    }
+
+    for (int segment = 0; segment < segmentDurations.size(); ++segment) {
+        if (!usedSegments.contains(segment))
+            QFile::remove(segmentPath(segment));
+    }
+
+    return files;
+}
+
+Option<QString> youtubeDownload(
         const DownloadRequest &downloadRequest,
         const QString &toolDir,
-        const QString &tempDir)
+        const QString &workDir,
+        const QAtomicInt &cancelled,
+        DownloadProgress &progress,
+        const QSet<int> &handedOver,
+        const TrackCallback &onTrack)
 {
 #define REQUIRE(condition) do { if (!(condition)) { return QString(#condition); } } while (0)
 
     REQUIRE(downloadRequest.requestType == DownloadRequestType::YoutubeVideo);
 
-    QByteArray out, err;
-
-    // download video into temp. file
-    const QStringList args{"--quiet", "--ignore-errors", "--extract-audio", "--exec", "echo {}", downloadRequest.url};
-    QByteArray dstFileName;
-    int status = runProcess(toolDir + "/youtube-dl", args, &dstFileName, &err, 120000);
-    if (status != 0) {
-        qWarning() << "youtube-dl failed, status =" << status << "args =" << args.join(" ");
-        qWarning() << "stdout:";
-        qWarning().noquote() << out;
-        qWarning() << "stderr:";
-        qWarning().noquote() << err;
-        return {};
+    // download video into workDir, where youtube-dl continues partial downloads of earlier attempts
+    REQUIRE(QDir().mkpath(workDir));
+    const QStringList args{"--newline", "--ignore-errors", "--extract-audio", "--continue", "-o", workDir + "/%(id)s.%(ext)s",
+                           "--exec", QString("echo ") + DOWNLOADED_FILE_PREFIX + "{}", downloadRequest.url};
+    progress.setTracksTotal(1);
+    progress.setPhase(DownloadPhase::Downloading);
+
+    // youtube-dl only tells percentages, which are turned back into bytes for the progress
+    static const QRegularExpression progressRegex(R"(^\[download\]\s+([\d.]+)% of ~?([\d.]+)([KMG]?)iB)");
+    qint64 bytesReported = 0;
+    QString dstFileName;
+
+    ProcessRunner::Options options;
+    options.lane = ProcessRunner::Lane::Background;
+    options.cancelled = &cancelled;
+    options.onLine = [&](const QByteArray &line) {
+        if (line.startsWith(DOWNLOADED_FILE_PREFIX)) {
+            dstFileName = QString::fromUtf8(line.mid(qstrlen(DOWNLOADED_FILE_PREFIX))).trimmed();
+            return;
+        }
+
+        const QRegularExpressionMatch match = progressRegex.match(QString::fromUtf8(line));
+        if (!match.hasMatch())
+            return;
+        const QString unit = match.captured(3);
+        const double unitSize = (unit == "K") ? 1024.0 : (unit == "M") ? 1024.0 * 1024.0 : (unit == "G") ? 1024.0 * 1024.0 * 1024.0 : 1.0;
+        const qint64 bytes = (qint64) (match.captured(1).toDouble() / 100.0 * match.captured(2).toDouble() * unitSize);
+        if (bytes > bytesReported) {
+            progress.addBytesReceived(bytes - bytesReported);
+            bytesReported = bytes;
+        }
+    };
+
+    const Result<ProcessRunner::Output, QString> youtubeDl = ProcessRunner::run(toolDir + "/youtube-dl", args, options);
+    if (cancelled.loadAcquire())
+        return QString("Cancelled");
+    if (youtubeDl.hasError()) {
+        qWarning() << "youtube-dl failed, args =" << args.join(" ");
+        return youtubeDl.getError();
     }
-    dstFileName = dstFileName.split('\n').first().trimmed();
     REQUIRE(QFile::exists(dstFileName));
+    progress.addBytesReceived(qMax<qint64>(0, QFileInfo(dstFileName).size() - bytesReported));
     const QString ending = dstFileName.split('.').last();
 
-    QVector<DownloadResult::File> files;
+    QVector<DownloadedTrack> files;
 
     // get meta-info, and maybe split file into multiple chapters
-    const YoutubeInfo videoInfo = parseInfo(downloadRequest.url, toolDir);
+    const YoutubeInfo videoInfo = parseInfo(downloadRequest.url, toolDir, cancelled);
     bool hasChapters = !videoInfo.chapters.isEmpty();
-    for (int i = 0; i < videoInfo.chapters.size(); ++i) {
-        const YoutubeChapter &chapter = videoInfo.chapters[i];
-        const QString chapterFile = createTempFile(tempDir, QString(".") + ending);
-        REQUIRE(QFile::exists(chapterFile));
-        const int ffmpegStatus = runProcess(toolDir + "/ffmpeg", QStringList{
-            "-ss", QString::number(chapter.startTime), "-t", QString::number(chapter.endTime),
-            "-i", dstFileName, "-y", "-c", "copy", chapterFile}, &out, &err, 120000);
-
-        // TODO: force overwrite for ffmpeg
-        if (ffmpegStatus != 0) {
-            qWarning() << "Couldn't split file into chapters";
+    if (hasChapters) {
+        progress.setTracksTotal(videoInfo.chapters.size());
+        progress.setPhase(DownloadPhase::Splitting);
+    }
+    if (hasChapters) {
+        Result<QVector<DownloadedTrack>, QString> chapterFiles = splitChapters(toolDir, dstFileName, ending, videoInfo.chapters, workDir, cancelled);
+        if (cancelled.loadAcquire())
+            return QString("Cancelled");
+        if (chapterFiles.hasValue()) {
+            files = chapterFiles.takeValue();
+        } else {
+            qWarning().noquote() << "Couldn't split file into chapters:" << chapterFiles.getError();
             hasChapters = false;
-            break;
         }
-
-        DownloadResult::File outFile;
-        outFile.title = chapter.title;
-        outFile.duration = chapter.endTime - chapter.startTime;
-        outFile.fullPath = QFileInfo(chapterFile).absoluteFilePath();
-        outFile.fileEnding = ending;
-        outFile.albumPosition = i;
-        files << outFile;
     }
 
     // no chapters? -> just return 1 single file
     if (!hasChapters) {
-        DownloadResult::File outFile;
+        progress.setTracksTotal(1);
+        DownloadedTrack outFile;
         outFile.title = videoInfo.title;
         outFile.duration = videoInfo.duration;
         outFile.fullPath = QFileInfo(dstFileName).absoluteFilePath();
@@ -262,17 +361,17 @@ Result<DownloadResult, QString> youtubeDownload(
         files.clear();
         files << outFile;
     }
-    else {
-        QFile::remove(dstFileName);
+
+    for (int i = 0; i < files.size(); ++i) {
+        if (!handedOver.contains(i))
+            onTrack(i, files[i]);
+        progress.addTrackDone();
     }
 
-    DownloadResult ret;
-    ret.artistId = downloadRequest.artistId;
-    ret.artistName = downloadRequest.artistName;
-    ret.albumName = downloadRequest.albumName;
-    ret.files = files;
+    if (hasChapters)
+        QFile::remove(dstFileName);
 
-    return ret;
+    return {};
 
 #undef REQUIRE
 }
@@ -2,28 +2,93 @@
 
 #include "library.hpp"
 #include "library_messages.hpp"
-#include "library_messages.hpp"
+#include "option.hpp"
 
 #include <QTcpSocket>
+#include <QAtomicInt>
+#include <QAtomicInteger>
+#include <QDateTime>
+#include <QSet>
+
+#include <functional>
+
+/** One finished file of a download */
+struct DownloadedTrack
+{
+    QString fullPath;
+    QString fileEnding;
+    QString title;
+    int albumPosition;
+    int duration;
+
+    /** Filled in by whoever takes the track, for deduplication */
+    QByteArray sha256;
+};
+
+/**
+ * Called from the download's thread with each track as soon as it is complete, along
+ * with the track's index in the download. The file then belongs to the callee.
+ */
+using TrackCallback = std::function<void(int track, const DownloadedTrack &file)>;
 
-struct DownloadResult
+/**
+ * Written by the download as it goes, read by whoever asks for the status.
+ * Every member is atomic, so nobody ever has to wait for anybody.
+ */
+struct DownloadProgress
 {
-    struct File
+    void setPhase(MoosickMessage::DownloadPhase phase) { m_phase.storeRelease((int) phase); touch(); }
+    /** Starts counting anew, e.g. when a video turns out to have chapters */
+    void setTracksTotal(int tracks) { m_tracksTotal.storeRelease(tracks); m_tracksDone.storeRelease(0); touch(); }
+    void addTrackDone() { m_tracksDone.fetchAndAddOrdered(1); touch(); }
+    void addBytesReceived(qint64 bytes) { m_bytesReceived.fetchAndAddOrdered(bytes); touch(); }
+
+    MoosickMessage::DownloadPhase phase() const { return (MoosickMessage::DownloadPhase) m_phase.loadAcquire(); }
+    int tracksTotal() const { return m_tracksTotal.loadAcquire(); }
+    int tracksDone() const { return m_tracksDone.loadAcquire(); }
+    qint64 bytesReceived() const { return m_bytesReceived.loadAcquire(); }
+    qint64 startTime() const { return m_startTime.loadAcquire(); }
+    qint64 lastUpdate() const { return m_lastUpdate.loadAcquire(); }
+
+    /** Changes with every update, for noticing that there is something new to tell */
+    int updates() const { return m_updates.loadAcquire(); }
+
+    /** Called when the download actually starts, rather than when it is queued */
+    void start()
     {
-        QString fullPath;
-        QString fileEnding;
-        QString title;
-        int albumPosition;
-        int duration;
-    };
-    QVector<File> files;
-    QString artistName;
-    quint32 artistId;
-    QString albumName;
-    QString tempDir;
+        m_startTime.storeRelease(QDateTime::currentMSecsSinceEpoch());
+        setPhase(MoosickMessage::DownloadPhase::Resolving);
+    }
+
+private:
+    void touch()
+    {
+        m_lastUpdate.storeRelease(QDateTime::currentMSecsSinceEpoch());
+        m_updates.fetchAndAddOrdered(1);
+    }
+
+    QAtomicInt m_phase { (int) MoosickMessage::DownloadPhase::Queued };
+    QAtomicInt m_tracksTotal { 0 };
+    QAtomicInt m_tracksDone { 0 };
+    QAtomicInteger<qint64> m_bytesReceived { 0 };
+    QAtomicInteger<qint64> m_startTime { 0 };
+    QAtomicInteger<qint64> m_lastUpdate { 0 };
+    QAtomicInt m_updates { 0 };
 };
 
-Result<DownloadResult, QString> download(
+/**
+ * workDir belongs to this download alone. Partial files stay there when the download
+ * fails or is cancelled, so that the next attempt can continue where this one stopped.
+ * Gives up between steps once cancelled is set.
+ *
+ * Tracks are handed to onTrack while the download goes on, except those listed in
+ * handedOver, which earlier attempts took care of already. Returns an error, if any.
+ */
+Option<QString> download(
         const MoosickMessage::DownloadRequest &downloadRequest,
         const QString &toolDir,
-        const QString &tempDir);
+        const QString &workDir,
+        const QAtomicInt &cancelled,
+        DownloadProgress &progress,
+        const QSet<int> &handedOver,
+        const TrackCallback &onTrack);
@@ -0,0 +1,316 @@
+#include "downloadscheduler.hpp"
+#include "jsonconv.hpp"
+
+#include <QFile>
+#include <QSaveFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QDateTime>
+#include <QDebug>
+
+#include <algorithm>
+
+using namespace MoosickMessage;
+
+Option<QString> DownloadScheduler::load(const QString &queuePath)
+{
+    m_queuePath = queuePath;
+    m_jobs.clear();
+
+    QFile queueFile(queuePath);
+    if (!queueFile.exists())
+        return {};
+    if (!queueFile.open(QIODevice::ReadOnly))
+        return QString("Can't open ") + queuePath;
+
+    const QJsonObject json = QJsonDocument::fromJson(queueFile.readAll()).object();
+    m_nextId = qMax<quint32>(1, json.value("nextId").toVariant().toUInt());
+
+    for (const QJsonValue &jobJson : json.value("jobs").toArray()) {
+        const QJsonObject jobObject = jobJson.toObject();
+        Result<DownloadRequest, EnjsonError> request = dejson<DownloadRequest>(jobObject.value("request"));
+        if (request.hasError()) {
+            qWarning().noquote() << "Dropping download from queue:" << request.takeError().toString();
+            continue;
+        }
+
+        const quint32 id = jobObject.value("id").toVariant().toUInt();
+        const QString client = jobObject.value("client").toString();
+        const qint32 priority = jobObject.value("priority").toInt();
+        Job job = createJob(id, request.takeValue(), client, priority);
+        for (const QJsonValue &track : jobObject.value("handedOver").toArray())
+            job.handedOver.insert(track.toInt());
+        job.artistId = jobObject.value("artistId").toVariant().toUInt();
+        job.albumId = jobObject.value("albumId").toVariant().toUInt();
+        m_jobs.insert(id, job);
+        m_nextId = qMax(m_nextId, id + 1);
+    }
+
+    qDebug() << "Download queue contains" << m_jobs.size() << "downloads";
+    return {};
+}
+
+void DownloadScheduler::save() const
+{
+    if (m_queuePath.isEmpty())
+        return;
+
+    QJsonArray jobs;
+    for (const Job &job : m_jobs) {
+        QJsonArray handedOver;
+        for (int track : job.handedOver)
+            handedOver << track;
+
+        jobs << QJsonObject {
+            { "id", (qint64) job.id },
+            { "request", enjson(job.request) },
+            { "client", job.client },
+            { "priority", job.priority },
+            { "handedOver", handedOver },
+            { "artistId", (qint64) job.artistId },
+            { "albumId", (qint64) job.albumId },
+        };
+    }
+    const QJsonObject json { { "nextId", (qint64) m_nextId }, { "jobs", jobs } };
+
+    QSaveFile queueFile(m_queuePath);
+    if (!queueFile.open(QIODevice::WriteOnly)
+            || queueFile.write(QJsonDocument(json).toJson(QJsonDocument::Compact)) < 0
+            || !queueFile.commit()) {
+        qWarning() << "Failed to save download queue to" << m_queuePath;
+    }
+}
+
+DownloadScheduler::Source DownloadScheduler::sourceOf(DownloadRequestType type)
+{
+    switch (type) {
+    case DownloadRequestType::BandcampAlbum:
+        return Source::Bandcamp;
+    case DownloadRequestType::YoutubeVideo:
+    case DownloadRequestType::YoutubePlaylist:
+        return Source::Youtube;
+    }
+    return Source::Youtube;
+}
+
+void DownloadScheduler::setLimits(int maxRunning, const QMap<Source, int> &sourceLimits)
+{
+    m_maxRunning = qMax(1, maxRunning);
+    m_sourceLimits = sourceLimits;
+}
+
+quint32 DownloadScheduler::enqueue(const DownloadRequest &request, const QString &client, qint32 priority)
+{
+    const quint32 id = m_nextId++;
+    m_jobs.insert(id, createJob(id, request, client, priority));
+    save();
+    return id;
+}
+
+DownloadScheduler::Job DownloadScheduler::createJob(quint32 id, const DownloadRequest &request, const QString &client, qint32 priority) const
+{
+    return Job{ id, request, client, priority, false, QSharedPointer<QAtomicInt>(new QAtomicInt(0)), QSharedPointer<DownloadProgress>(new DownloadProgress()), {}, 0, 0 };
+}
+
+QVector<DownloadScheduler::Job> DownloadScheduler::takeStartable()
+{
+    QVector<Job> started;
+
+    int running = 0;
+    for (const Job &job : qAsConst(m_jobs))
+        running += job.running ? 1 : 0;
+
+    // the order changes with every start, since the client whose turn it was moves back
+    while (running < m_maxRunning) {
+        const Job *next = nullptr;
+        for (const Job *job : queueOrder()) {
+            const Source source = sourceOf(*job->request.requestType);
+            if (runningCount(source) < m_sourceLimits.value(source, m_maxRunning)) {
+                next = job;
+                break;
+            }
+        }
+        if (!next)
+            break;
+
+        Job &job = m_jobs[next->id];
+        job.running = true;
+        m_clientTurns[job.client] = ++m_turn;
+        started << job;
+        running += 1;
+    }
+
+    return started;
+}
+
+bool DownloadScheduler::cancel(quint32 id)
+{
+    auto it = m_jobs.find(id);
+    if (it == m_jobs.end())
+        return false;
+
+    if (it->running) {
+        it->cancelled->storeRelease(1);
+    } else {
+        m_jobs.erase(it);
+        save();
+    }
+    return true;
+}
+
+bool DownloadScheduler::setPriority(quint32 id, qint32 priority)
+{
+    auto it = m_jobs.find(id);
+    if (it == m_jobs.end())
+        return false;
+
+    it->priority = priority;
+    save();
+    return true;
+}
+
+const DownloadScheduler::Job *DownloadScheduler::find(quint32 id) const
+{
+    const auto it = m_jobs.find(id);
+    return (it == m_jobs.end()) ? nullptr : &*it;
+}
+
+void DownloadScheduler::markHandedOver(quint32 id, const QVector<int> &tracks, quint32 artistId, quint32 albumId)
+{
+    auto it = m_jobs.find(id);
+    if (it == m_jobs.end())
+        return;
+
+    for (int track : tracks)
+        it->handedOver.insert(track);
+    it->artistId = artistId;
+    it->albumId = albumId;
+    save();
+}
+
+bool DownloadScheduler::isCancelled(quint32 id) const
+{
+    const auto it = m_jobs.find(id);
+    return it != m_jobs.end() && it->cancelled->loadAcquire();
+}
+
+void DownloadScheduler::finish(quint32 id)
+{
+    m_jobs.remove(id);
+    save();
+}
+
+void DownloadScheduler::interruptAll()
+{
+    for (const Job &job : qAsConst(m_jobs)) {
+        if (job.running)
+            job.cancelled->storeRelease(1);
+    }
+}
+
+QVector<DownloadQueryResponse::ActiveDownload> DownloadScheduler::activeDownloads() const
+{
+    QVector<DownloadQueryResponse::ActiveDownload> ret;
+    for (const Job &job : m_jobs)
+        ret << DownloadQueryResponse::ActiveDownload{ job.id, job.request };
+    return ret;
+}
+
+static DownloadStatus jobStatus(const DownloadScheduler::Job &job, quint32 queuePosition)
+{
+    const DownloadProgress &progress = *job.progress;
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    DownloadStatus status;
+    status.downloadId = job.id;
+    status.running = job.running;
+    status.queuePosition = queuePosition;
+    status.priority = job.priority;
+    status.phase = progress.phase();
+    status.tracksTotal = progress.tracksTotal();
+    status.tracksDone = progress.tracksDone();
+    status.bytesReceived = progress.bytesReceived();
+    status.etaSecs = -1;
+    status.idleSecs = 0;
+
+    if (job.running && progress.startTime() > 0) {
+        // assumes the remaining tracks take as long as the ones done so far
+        const qint64 elapsed = now - progress.startTime();
+        const int done = progress.tracksDone();
+        const int total = progress.tracksTotal();
+        if (done > 0 && total >= done)
+            status.etaSecs = (qint32) (elapsed * (total - done) / done / 1000);
+        status.idleSecs = (quint32) qMax<qint64>(0, (now - progress.lastUpdate()) / 1000);
+    }
+
+    return status;
+}
+
+QVector<DownloadStatus> DownloadScheduler::status() const
+{
+    QVector<DownloadStatus> ret;
+
+    for (const Job &job : m_jobs) {
+        if (job.running)
+            ret << jobStatus(job, 0);
+    }
+
+    quint32 position = 1;
+    for (const Job *job : queueOrder())
+        ret << jobStatus(*job, position++);
+
+    return ret;
+}
+
+quint32 DownloadScheduler::progressUpdates() const
+{
+    quint32 updates = 0;
+    for (const Job &job : m_jobs) {
+        if (job.running)
+            updates += job.progress->updates();
+    }
+    return updates;
+}
+
+QVector<const DownloadScheduler::Job*> DownloadScheduler::queueOrder() const
+{
+    QVector<const Job*> waiting;
+    for (const Job &job : m_jobs) {
+        if (!job.running)
+            waiting << &job;
+    }
+
+    // play out the turns of the clients, quadratic but queues are short
+    QHash<QString, quint64> clientTurns = m_clientTurns;
+    quint64 turn = m_turn;
+
+    QVector<const Job*> ret;
+    while (!waiting.isEmpty()) {
+        auto next = std::min_element(waiting.begin(), waiting.end(), [&](const Job *a, const Job *b) {
+            if (a->priority != b->priority)
+                return a->priority > b->priority;
+            const quint64 aTurn = clientTurns.value(a->client, 0);
+            const quint64 bTurn = clientTurns.value(b->client, 0);
+            if (aTurn != bTurn)
+                return aTurn < bTurn;
+            return a->id < b->id;
+        });
+
+        clientTurns[(*next)->client] = ++turn;
+        ret << *next;
+        waiting.erase(next);
+    }
+
+    return ret;
+}
+
+int DownloadScheduler::runningCount(Source source) const
+{
+    int count = 0;
+    for (const Job &job : m_jobs) {
+        if (job.running && sourceOf(*job.request.requestType) == source)
+            count += 1;
+    }
+    return count;
+}
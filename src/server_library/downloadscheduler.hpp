@@ -0,0 +1,114 @@
+#pragma once
+
+#include <QMap>
+#include <QHash>
+#include <QSet>
+#include <QVector>
+#include <QSharedPointer>
+#include <QAtomicInt>
+
+#include "library_messages.hpp"
+#include "option.hpp"
+#include "download.hpp"
+
+/**
+ * Decides which downloads run, and in which order the waiting ones follow.
+ *
+ * Only a limited number of downloads run at once, and only a few of them per source,
+ * so that neither the server nor Bandcamp or YouTube get overwhelmed. Downloads with a
+ * higher priority start first. Among equal priorities, clients take turns, and each
+ * client's downloads start in the order they were requested.
+ *
+ * The queue is saved to a file whenever it changes, so that downloads and their IDs
+ * survive restarts. Downloads that were running at the time are queued again, and
+ * skip the tracks they had handed over to the library before.
+ *
+ * Not thread-safe, Server guards it with its state lock.
+ */
+class DownloadScheduler
+{
+public:
+    /** Where downloads come from, each of which gets its own limit */
+    enum class Source
+    {
+        Bandcamp,
+        Youtube,
+    };
+
+    static Source sourceOf(MoosickMessage::DownloadRequestType type);
+
+    struct Job
+    {
+        quint32 id;
+        MoosickMessage::DownloadRequest request;
+        QString client;
+        qint32 priority;
+        bool running;
+
+        /** Set when cancelled while running, the download checks it between steps */
+        QSharedPointer<QAtomicInt> cancelled;
+
+        /** Updated by the download while it runs */
+        QSharedPointer<DownloadProgress> progress;
+
+        /** Tracks that are in the library already, which later attempts must skip */
+        QSet<int> handedOver;
+
+        /** Where the tracks handed over so far went, 0 until there are any */
+        quint32 artistId;
+        quint32 albumId;
+    };
+
+    Option<QString> load(const QString &queuePath);
+
+    /** sources without a limit of their own are only limited by maxRunning */
+    void setLimits(int maxRunning, const QMap<Source, int> &sourceLimits);
+
+    quint32 enqueue(const MoosickMessage::DownloadRequest &request, const QString &client, qint32 priority);
+
+    /** Marks as many waiting jobs as running as the limits allow, and returns them */
+    QVector<Job> takeStartable();
+
+    /** Waiting jobs are dropped right away, running ones are flagged and dropped by finish() */
+    bool cancel(quint32 id);
+    bool setPriority(quint32 id, qint32 priority);
+
+    /** Whether a running job has been cancelled in the meantime */
+    bool isCancelled(quint32 id) const;
+    void finish(quint32 id);
+
+    /** Flags all running jobs as cancelled, but keeps them queued for the next start */
+    void interruptAll();
+
+    bool contains(quint32 id) const { return m_jobs.contains(id); }
+    const Job *find(quint32 id) const;
+
+    void markHandedOver(quint32 id, const QVector<int> &tracks, quint32 artistId, quint32 albumId);
+
+    QVector<MoosickMessage::DownloadQueryResponse::ActiveDownload> activeDownloads() const;
+    QVector<MoosickMessage::DownloadStatus> status() const;
+
+    /** Changes whenever a running download made progress */
+    quint32 progressUpdates() const;
+
+private:
+    void save() const;
+    Job createJob(quint32 id, const MoosickMessage::DownloadRequest &request, const QString &client, qint32 priority) const;
+
+    /** Waiting jobs in the order they would start if there were no per-source limits */
+    QVector<const Job*> queueOrder() const;
+    int runningCount(Source source) const;
+
+    QString m_queuePath;
+
+    /** ordered by ID, which is the order of requests */
+    QMap<quint32, Job> m_jobs;
+    quint32 m_nextId = 1;
+
+    /** when each client last had a download started, so that others go first next time */
+    QHash<QString, quint64> m_clientTurns;
+    quint64 m_turn = 0;
+
+    int m_maxRunning = 1;
+    QMap<Source, int> m_sourceLimits;
+};
@@ -0,0 +1,146 @@
+#include "filetransfer.hpp"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QNetworkAccessManager>
+#include <QNetworkRequest>
+#include <QNetworkReply>
+#include <QEventLoop>
+#include <QTimer>
+#include <QQueue>
+#include <QSet>
+#include <QDebug>
+
+Option<QString> downloadFiles(
+        QNetworkAccessManager &network,
+        QVector<FileTransfer> &transfers,
+        const QAtomicInt &cancelled,
+        DownloadProgress &progress,
+        const std::function<void(int index)> &onFileDone)
+{
+    QEventLoop loop;
+    QQueue<int> pending;
+    for (int i = 0; i < transfers.size(); ++i)
+        pending.enqueue(i);
+
+    QSet<QNetworkReply*> replies;
+    int busySlots = 0;
+    Option<QString> error;
+
+    const auto fail = [&](const QString &message) {
+        if (!error)
+            error = message;
+        pending.clear();
+
+        // aborting finishes replies right away, which takes them out of the set
+        const QSet<QNetworkReply*> running = replies;
+        for (QNetworkReply *reply : running)
+            reply->abort();
+    };
+
+    std::function<void()> startNext;
+    std::function<void(int)> start = [&](int index) {
+        FileTransfer &transfer = transfers[index];
+        transfer.attempts += 1;
+
+        if (QFile::exists(transfer.filePath)) {
+            progress.addTrackDone();
+            onFileDone(index);
+            busySlots -= 1;
+            startNext();
+            return;
+        }
+
+        const QString partPath = transfer.filePath + ".part";
+        const qint64 offset = QFileInfo(partPath).size();
+
+        QNetworkRequest request(transfer.url);
+        request.setAttribute(QNetworkRequest::FollowRedirectsAttribute, true);
+        if (offset > 0)
+            request.setRawHeader("Range", "bytes=" + QByteArray::number(offset) + "-");
+        QNetworkReply *reply = network.get(request);
+        replies.insert(reply);
+
+        // opened with the first data, when we know whether the server honors the range
+        QFile *file = new QFile(partPath);
+        const auto write = [=, &progress]() {
+            if (!file->isOpen()) {
+                const int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+                const QIODevice::OpenMode mode = (status == 206) ? QIODevice::Append : (QIODevice::WriteOnly | QIODevice::Truncate);
+                if (!file->open(mode))
+                    return false;
+            }
+            const QByteArray data = reply->readAll();
+            progress.addBytesReceived(data.size());
+            return file->write(data) >= 0;
+        };
+
+        QObject::connect(reply, &QNetworkReply::readyRead, reply, [=]() {
+            if (!write())
+                reply->abort();
+        });
+        QObject::connect(reply, &QNetworkReply::finished, &loop, [&, index, reply, file, write, partPath]() {
+            replies.remove(reply);
+            reply->deleteLater();
+
+            const bool received = (reply->error() == QNetworkReply::NoError);
+            const bool written = received && write() && file->flush();
+            file->close();
+            delete file;
+
+            // a range the server can't satisfy means our part is useless, start over next time
+            if (reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() == 416)
+                QFile::remove(partPath);
+
+            const bool success = written && QFile::rename(partPath, transfers[index].filePath);
+
+            if (success) {
+                progress.addTrackDone();
+                onFileDone(index);
+            }
+
+            const FileTransfer &transfer = transfers[index];
+            if (success || error) {
+                busySlots -= 1;
+            } else if (transfer.attempts < MAX_TRACK_ATTEMPTS) {
+                // keep the slot while waiting, so that retries don't pile up behind new transfers
+                qWarning() << "Retrying" << transfer.url << "after" << reply->errorString();
+                QTimer::singleShot(1000 * transfer.attempts, &loop, [&, index]() {
+                    if (error) {
+                        busySlots -= 1;
+                        startNext();
+                    } else {
+                        start(index);
+                    }
+                });
+                return;
+            } else {
+                busySlots -= 1;
+                fail(QString("Failed to download ") + transfer.url.toString() + ": " + reply->errorString());
+            }
+            startNext();
+        });
+    };
+
+    startNext = [&]() {
+        while (busySlots < PARALLEL_TRACK_DOWNLOADS && !pending.isEmpty()) {
+            busySlots += 1;
+            start(pending.dequeue());
+        }
+        if (busySlots == 0)
+            loop.quit();
+    };
+
+    QTimer cancelTimer;
+    QObject::connect(&cancelTimer, &QTimer::timeout, &loop, [&]() {
+        if (cancelled.loadAcquire())
+            fail("Cancelled");
+    });
+    cancelTimer.start(250);
+
+    startNext();
+    if (busySlots > 0)
+        loop.exec();
+
+    return error;
+}
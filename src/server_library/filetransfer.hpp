@@ -0,0 +1,39 @@
+#pragma once
+
+#include "download.hpp"
+#include "option.hpp"
+
+#include <QUrl>
+#include <QVector>
+
+#include <functional>
+
+class QNetworkAccessManager;
+
+// tracks of one album that are fetched at once, and how often each is tried
+static constexpr int PARALLEL_TRACK_DOWNLOADS = 4;
+static constexpr int MAX_TRACK_ATTEMPTS = 3;
+
+struct FileTransfer
+{
+    QUrl url;
+    QString filePath;
+    int attempts;
+};
+
+/**
+ * Fetches each url into its file, a few at a time, writing data as it arrives
+ * instead of holding whole files in memory. Failed transfers are retried after
+ * a pause. Returns an error once a transfer failed too often, or on cancellation.
+ *
+ * Data goes to <filePath>.part first, which is renamed once complete. Files that
+ * exist already are skipped, and .part files left over from earlier attempts are
+ * continued with a Range request. Either way, onFileDone gets the transfer's index
+ * as soon as its file is complete.
+ */
+Option<QString> downloadFiles(
+        QNetworkAccessManager &network,
+        QVector<FileTransfer> &transfers,
+        const QAtomicInt &cancelled,
+        DownloadProgress &progress,
+        const std::function<void(int index)> &onFileDone);
@@ -0,0 +1,60 @@
+#include "mediaindex.hpp"
+
+#include <QFile>
+#include <QCryptographicHash>
+#include <QDebug>
+
+Option<QString> MediaIndex::load(const QString &indexPath)
+{
+    m_indexPath = indexPath;
+    m_files.clear();
+
+    QFile indexFile(indexPath);
+    if (!indexFile.exists())
+        return {};
+    if (!indexFile.open(QIODevice::ReadOnly))
+        return QString("Can't open ") + indexPath;
+
+    while (!indexFile.atEnd()) {
+        const QByteArray line = indexFile.readLine().trimmed();
+        const int space = line.indexOf(' ');
+        if (space <= 0)
+            continue;
+
+        // later entries win, the file is only ever appended to
+        m_files[QByteArray::fromHex(line.left(space))] = QString::fromUtf8(line.mid(space + 1));
+    }
+
+    qDebug() << "Media index contains" << m_files.size() << "files";
+    return {};
+}
+
+QByteArray MediaIndex::hashFile(const QString &path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+        return QByteArray();
+
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    if (!hash.addData(&file))
+        return QByteArray();
+    return hash.result();
+}
+
+void MediaIndex::insert(const QByteArray &sha256, const QString &fileName)
+{
+    if (sha256.isEmpty())
+        return;
+
+    m_files[sha256] = fileName;
+
+    QFile indexFile(m_indexPath);
+    if (!indexFile.open(QIODevice::Append) || indexFile.write(sha256.toHex() + " " + fileName.toUtf8() + "\n") < 0)
+        qWarning() << "Failed to append to media index" << m_indexPath;
+}
+
+void MediaIndex::recordDuplicate(qint64 size)
+{
+    m_duplicates += 1;
+    m_bytesSaved += size;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <QHash>
+#include <QString>
+
+#include "option.hpp"
+
+/**
+ * Maps the SHA-256 of media files to their file name in mediaBaseDir, so that
+ * the same content is stored only once, no matter how often it gets ingested.
+ *
+ * The index is an append-only text file of "<hex hash> <file name>" lines.
+ */
+class MediaIndex
+{
+public:
+    Option<QString> load(const QString &indexPath);
+
+    /** Reads the whole file, so better not call this while holding locks. Empty on error */
+    static QByteArray hashFile(const QString &path);
+
+    /** File name of media with the given content, or an empty string if there is none */
+    QString find(const QByteArray &sha256) const { return m_files.value(sha256); }
+    void insert(const QByteArray &sha256, const QString &fileName);
+
+    void recordDuplicate(qint64 size);
+    int duplicates() const { return m_duplicates; }
+    qint64 bytesSaved() const { return m_bytesSaved; }
+
+private:
+    QString m_indexPath;
+    QHash<QByteArray, QString> m_files;
+
+    int m_duplicates = 0;
+    qint64 m_bytesSaved = 0;
+};
@@ -1,6 +1,8 @@
 #include "server.hpp"
 #include "jsonconv.hpp"
 #include "download.hpp"
+#include "compression.hpp"
+#include "processrunner.hpp"
 
 #include <QFile>
 #include <QFileInfo>
@@ -8,37 +10,25 @@
 #include <QTcpSocket>
 #include <QJsonDocument>
 #include <QDate>
-#include <QProcess>
-#include <QThread>
+#include <QRunnable>
+#include <QSharedPointer>
+#include <QDateTime>
+#include <QStringList>
+
+#include <functional>
 
 using namespace Moosick;
 using namespace MoosickMessage;
 
-class DownloaderThread : public QThread
+class WorkerTask : public QRunnable
 {
-    Q_OBJECT
-
 public:
-    DownloaderThread(const MoosickMessage::DownloadRequest &request, Server *server)
-        : m_request(request)
-        , m_server(server)
-    {}
-    ~DownloaderThread() {}
-
-    void run() override
-    {
-        const QString tmpDir = m_server->m_settings.tempDir();
-        const QString toolDir = m_server->m_settings.toolsDir();
+    WorkerTask(const std::function<void()> &function) : m_function(function) {}
 
-        m_result = download(m_request, toolDir, tmpDir);
-    }
+    void run() override { m_function(); }
 
 private:
-    MoosickMessage::DownloadRequest m_request;
-    Server *m_server;
-    Result<DownloadResult, QString> m_result;
-
-    friend class Server;
+    std::function<void()> m_function;
 };
 
 static Result<SerializedLibrary, EnjsonError> loadLibraryJson(const QString &libraryPath)
@@ -71,14 +61,135 @@ QString Server::createSongHandleFile(SongId songId)
     return dstFileName;
 }
 
+QString Server::assignMediaFile(SongId songId, const QString &filePath, const QByteArray &sha256)
+{
+    // reuse the handle of identical media, as long as the file name comes out the same
+    const QString existingFileName = m_mediaIndex.find(sha256);
+    if (!existingFileName.isEmpty()) {
+        const QString existingPath = m_settings.mediaBaseDir() + QDir::separator() + existingFileName;
+        const QFileInfo existing(existingPath);
+        const QString ending = QFileInfo(songId.fileName(m_library)).suffix();
+        if (existing.exists() && existing.size() == QFileInfo(filePath).size() && existing.suffix() == ending) {
+            m_library.commit(LibraryChangeRequest::CreateSongSetHandle(songId, 0, existing.completeBaseName()));
+            m_mediaIndex.recordDuplicate(existing.size());
+
+            qDebug().noquote() << "Reusing" << existingFileName << "for song" << (quint32) songId << "-"
+                               << m_mediaIndex.duplicates() << "duplicates avoided," << m_mediaIndex.bytesSaved() << "bytes saved so far";
+            return QString();
+        }
+    }
+
+    const QString dstFileName = createSongHandleFile(songId);
+    m_mediaIndex.insert(sha256, QFileInfo(dstFileName).fileName());
+    return dstFileName;
+}
+
+QVector<SongId> Server::ingest(IngestBatch &batch)
+{
+    QVector<SongId> songIds;
+    QVector<QPair<QString, QString>> moves;
+    QVector<CommittedLibraryChange> changes;
+
+    {
+        QWriteLocker locker(&m_stateLock);
+        const quint32 firstRevision = m_library.revision() + 1;
+
+        AlbumId albumId = batch.albumId;
+        ArtistId artistId = batch.artistId;
+        if (albumId.isValid() && albumId.exists(m_library)) {
+            artistId = albumId.artist(m_library);
+        } else {
+            if (!artistId.isValid() || !artistId.exists(m_library))
+                artistId = getOrCreateArtist(batch.artistName);
+            albumId = getOrCreateAlbum(artistId, batch.albumName);
+        }
+        batch.artistId = artistId;
+        batch.albumId = albumId;
+
+        for (const IngestBatch::Song &song : batch.songs) {
+            const SongId songId = m_library.commit(LibraryChangeRequest::CreateSongAdd(albumId, 0, song.title))
+                    .mapMember<SongId>(&CommittedLibraryChange::createdId)
+                    .takeValue();
+
+            m_library.commit(LibraryChangeRequest::CreateSongSetPosition(songId, song.position));
+            m_library.commit(LibraryChangeRequest::CreateSongSetLength(songId, song.duration));
+            m_library.commit(LibraryChangeRequest::CreateSongSetFileEnding(songId, 0, song.fileEnding));
+
+            const QString dstFileName = assignMediaFile(songId, song.filePath, song.sha256);
+            if (dstFileName.isEmpty())
+                QFile::remove(song.filePath);
+            else
+                moves << qMakePair(song.filePath, dstFileName);
+
+            songIds << songId;
+        }
+
+        changes = m_library.committedChangesSince(firstRevision);
+    }
+
+    // moving may mean copying to another file system, which readers needn't wait for
+    for (const auto &move : qAsConst(moves)) {
+        if (!QFile::rename(move.first, move.second))
+            qWarning() << "Failed to move" << move.first << "to" << move.second;
+    }
+
+    appendToLog(changes);
+    scheduleLibraryCacheUpdate();
+
+    return songIds;
+}
+
+void Server::appendToLog(const QVector<CommittedLibraryChange> &changes)
+{
+    if (changes.isEmpty())
+        return;
+
+    QFile logFile(m_settings.libraryLogFile());
+    const qint64 sz = logFile.exists() ? logFile.size() : 0;
+
+    // written at once, so that a crash doesn't leave half of it behind as easily
+    QByteArray data;
+    bool first = (sz <= 0);
+    for (const CommittedLibraryChange &change : changes) {
+        if (!first)
+            data += ",\n";
+        first = false;
+
+        data += jsonSerializeObject(enjson(change).toObject()).trimmed();
+    }
+
+    if (!logFile.open(QIODevice::Append) || logFile.write(data) != data.size() || !logFile.flush())
+        qWarning() << "Failed to append" << changes.size() << "changes to" << m_settings.libraryLogFile();
+}
+
+// clients are answered at least this often, so that proxies don't give up on them
+static constexpr quint32 MAX_SUBSCRIPTION_SECS = 60;
+
+// beyond this, a SubscribeResponse rather tells clients to sync on their own
+static constexpr int MAX_SUBSCRIPTION_CHANGES = 1000;
+
+static constexpr int QUEUE_REPORT_INTERVAL_MSECS = 60 * 1000;
+
 Server::Server()
     : TcpServer()
 {
+    QObject::connect(&m_subscriptionTimer, &QTimer::timeout, this, [=]() { onSubscriptionTimer(); });
+    m_subscriptionTimer.start(1000);
+
+    QObject::connect(&m_queueReportTimer, &QTimer::timeout, this, [=]() { reportQueueDepth(); });
+    m_queueReportTimer.start(QUEUE_REPORT_INTERVAL_MSECS);
 }
 
 EnjsonError Server::init(const ServerSettings &settings)
 {
     m_settings = settings;
+    m_workerPool.setMaxThreadCount(qMax(1, settings.dbserverWorkerThreads()));
+
+    m_downloads.setLimits(settings.downloadWorkers(), {
+        { DownloadScheduler::Source::Bandcamp, settings.bandcampDownloadJobs() },
+        { DownloadScheduler::Source::Youtube, settings.youtubeDownloadJobs() },
+    });
+    m_downloadPool.setMaxThreadCount(settings.downloadWorkers());
 
     const QString libraryPath = settings.libraryFile();
     const QString logPath = settings.libraryLogFile();
@@ -86,6 +197,15 @@ EnjsonError Server::init(const ServerSettings &settings)
     const bool libraryExists = QFile::exists(libraryPath);
     const bool logExists = QFile::exists(logPath);
 
+    const Option<QString> mediaIndexError = m_mediaIndex.load(libraryPath + ".media-index");
+    if (mediaIndexError)
+        return EnjsonError::buildCustomError(mediaIndexError.getValue());
+
+    // downloads that were interrupted by the last shutdown pick up where they left off
+    const Option<QString> downloadQueueError = m_downloads.load(libraryPath + ".downloads");
+    if (downloadQueueError)
+        return EnjsonError::buildCustomError(downloadQueueError.getValue());
+
     if (logExists && !libraryExists)
         return EnjsonError::buildCustomError("Log file exists, but library file doesn't");
     if (!logExists && libraryExists)
@@ -98,36 +218,54 @@ EnjsonError Server::init(const ServerSettings &settings)
             return EnjsonError::buildCustomError("Failed to create log file");
         saveLibrary();
         qWarning() << "Library doesn't yet exist, creating new one";
-        return {};
+    } else {
+        Result<SerializedLibrary, EnjsonError> libraryJson = loadLibraryJson(libraryPath);
+        if (!libraryJson.hasValue())
+            return EnjsonError::buildCustomError(QString("Failed to load ") + libraryPath, libraryJson.takeError());
+
+        Result<QJsonArray, EnjsonError> logJson = loadLibraryLogJson(logPath);
+        if (!logJson.hasValue())
+            return EnjsonError::buildCustomError(QString("Failed to load ") + logPath, logJson.takeError());
+
+        // check if we can open log file
+        if (!QFile(logPath).open(QIODevice::Append))
+            return EnjsonError::buildCustomError(QString("Failed to open ") + logPath + " for writing");
+
+        EnjsonError result = m_library.deserializeFromJson(libraryJson.takeValue(), logJson.takeValue());
+        if (result.isError())
+            return EnjsonError::buildCustomError("Error while parsing library", result);
     }
 
-    Result<SerializedLibrary, EnjsonError> libraryJson = loadLibraryJson(libraryPath);
-    if (!libraryJson.hasValue())
-        return EnjsonError::buildCustomError(QString("Failed to load ") + libraryPath, libraryJson.takeError());
-
-    Result<QJsonArray, EnjsonError> logJson = loadLibraryLogJson(logPath);
-    if (!logJson.hasValue())
-        return EnjsonError::buildCustomError(QString("Failed to load ") + logPath, logJson.takeError());
-
-    // check if we can open log file
-    if (!QFile(logPath).open(QIODevice::Append))
-        return EnjsonError::buildCustomError(QString("Failed to open ") + logPath + " for writing");
-
-    EnjsonError result = m_library.deserializeFromJson(libraryJson.takeValue(), logJson.takeValue());
-    if (result.isError())
-        return EnjsonError::buildCustomError("Error while parsing library", result);
+    // finished downloads go straight into the library, so they have to wait for it
+    m_initialized = true;
+    removeOrphanedDownloads();
+    startDownloads();
 
     return EnjsonError();
 }
 
 Server::~Server()
 {
-    saveLibrary();
+    // running downloads stop early and stay queued, their partial files are continued next time
+    {
+        QWriteLocker locker(&m_stateLock);
+        m_downloads.interruptAll();
+    }
+    m_downloadPool.waitForDone();
+    m_workerPool.waitForDone();
+
+    // an empty library must not overwrite the one that failed to load
+    if (m_initialized) {
+        ingestReadyTracks();
+        saveLibrary();
+    }
+    Compression::Metrics::dump();
+    qDebug() << "Media deduplication:" << m_mediaIndex.duplicates() << "duplicates avoided," << m_mediaIndex.bytesSaved() << "bytes saved";
 }
 
 QByteArray Server::handleMessage(const QByteArray &data)
 {
-    Result<Message, EnjsonError> messageParsingResult = Message::fromJson(data);
+    Result<Message, EnjsonError> messageParsingResult = Message::decode(data);
     if (messageParsingResult.hasError()) {
         qWarning().noquote() << "Error parsing message:" << messageParsingResult.takeError().toString();
         return QByteArray();
@@ -135,13 +273,278 @@ QByteArray Server::handleMessage(const QByteArray &data)
 
     Message message = messageParsingResult.takeValue();
 
+    // answer in the same encoding that the request came in
+    const WireFormat format = Message::detectWireFormat(data);
+    return processMessageEncoded(message, format).data;
+}
+
+bool Server::isReadOnly(Type type)
+{
+    switch (type) {
+    case Type::LibraryRequest:
+    case Type::ConditionalLibraryRequest:
+    case Type::ChangeListRequest:
+    case Type::SyncRequest:
+    case Type::DownloadQuery:
+        return true;
+    default:
+        return false;
+    }
+}
+
+void Server::handleMessageAsync(const PendingRequest &request, const QByteArray &data)
+{
+    Result<Message, EnjsonError> messageParsingResult = Message::decode(data);
+    if (messageParsingResult.hasError()) {
+        TcpServer::handleMessageAsync(request, data);
+        return;
+    }
+
+    const QSharedPointer<Message> message(new Message(messageParsingResult.takeValue()));
+    const WireFormat format = Message::detectWireFormat(data);
+
+    // long polls are parked until there is something to tell
+    if (message->getType() == Type::SubscribeRequest) {
+        if (!subscribe(request, *message, format))
+            respond(request, Message(subscriptionUpdate(message->as<SubscribeRequest>()->revision)).encode(format), typeString(Type::SubscribeResponse));
+        return;
+    }
+
+    // mutating requests are serialized on the main thread
+    if (m_settings.dbserverWorkerThreads() == 0 || !isReadOnly(message->getType())) {
+        const EncodedResponse response = processMessageEncoded(*message, format);
+        respond(request, response.data, typeString(response.type));
+        return;
+    }
+
+    const Type type = message->getType();
+    QueueDepth &depth = m_queueDepth[type];
+    depth.current += 1;
+    depth.peak = qMax(depth.peak, depth.current);
+
+    // sockets live on the main thread, so the response is sent from there, but
+    // deflating large responses like the library is done right here
+    m_workerPool.start(new WorkerTask([=]() {
+        const EncodedResponse encoded = processMessageEncoded(*message, format);
+        const Response response = compressResponse(request.acceptsDeflate, encoded.data, typeString(encoded.type));
+        QMetaObject::invokeMethod(this, [=]() {
+            m_queueDepth[type].current -= 1;
+            respond(request, response);
+        }, Qt::QueuedConnection);
+    }));
+}
+
+void Server::reportQueueDepth()
+{
+    QStringList depths;
+    for (auto it = m_queueDepth.begin(); it != m_queueDepth.end(); ++it) {
+        if (it->peak > 1)
+            depths << QString("%1 %2 (peak %3)").arg(typeString(it.key())).arg(it->current).arg(it->peak);
+        it->peak = it->current;
+    }
+
+    // nothing worth mentioning while every request is answered before the next one comes in
+    if (!depths.isEmpty())
+        qDebug().noquote() << "Worker queue depth:" << depths.join(", ");
+}
+
+const QByteArray &Server::EncodedLibrary::encoded(WireFormat format) const
+{
+    // set once and never changed after, so the reference stays valid without the lock
+    QMutexLocker locker(&m_mutex);
+    QByteArray &encoded = (format == WireFormat::Cbor) ? m_cbor : m_json;
+    if (encoded.isEmpty())
+        encoded = Message(response).encode(format);
+    return encoded;
+}
+
+QSharedPointer<const Server::EncodedLibrary> Server::encodedLibrary()
+{
+    QMutexLocker buildLocker(&m_libraryCacheBuildMutex);
+
+    QReadLocker stateLocker(&m_stateLock);
+    const quint32 revision = m_library.revision();
+    {
+        QMutexLocker cacheLocker(&m_libraryCacheMutex);
+        if (m_libraryCache && m_libraryCache->revision == revision)
+            return m_libraryCache;
+    }
+
+    EncodedLibrary *encoded = new EncodedLibrary();
+    encoded->revision = revision;
+
+    SerializedLibrary serialized = m_library.serializeToJson();
+    stateLocker.unlock();
+
+    encoded->response.libraryJson = serialized.libraryJson;
+    encoded->response.version = serialized.version;
+
+    const QSharedPointer<const EncodedLibrary> ret(encoded);
+    QMutexLocker cacheLocker(&m_libraryCacheMutex);
+    m_libraryCache = ret;
+    return ret;
+}
+
+void Server::scheduleLibraryCacheUpdate()
+{
+    // without worker threads, the cache is only updated once someone asks for the library
+    if (m_settings.dbserverWorkerThreads() == 0)
+        return;
+
+    // a single update will pick up all writes that happened until it runs
+    if (!m_libraryCacheUpdateScheduled.testAndSetOrdered(0, 1))
+        return;
+
+    m_workerPool.start(new WorkerTask([=]() {
+        m_libraryCacheUpdateScheduled.storeRelease(0);
+        encodedLibrary();
+    }));
+}
+
+Server::EncodedResponse Server::processMessageEncoded(const Message &message, WireFormat format)
+{
+    switch (message.getType()) {
+    case Type::LibraryRequest: {
+        return { encodedLibrary()->encoded(format), Type::LibraryResponse };
+    }
+    case Type::ConditionalLibraryRequest: {
+        const ConditionalLibraryRequest *request = message.as<ConditionalLibraryRequest>();
+        {
+            QReadLocker locker(&m_stateLock);
+            if (*request->libraryId == QString::fromUtf8(m_library.id().toString()) && request->revision == m_library.revision()) {
+                LibraryNotModified response;
+                response.revision = request->revision;
+                return { Message(response).encode(format), Type::LibraryNotModified };
+            }
+        }
+        return { encodedLibrary()->encoded(format), Type::LibraryResponse };
+    }
+    case Type::SyncRequest: {
+        const SyncRequest *request = message.as<SyncRequest>();
+
+        QReadLocker locker(&m_stateLock);
+        const quint32 revision = m_library.revision();
+        const int itemCount = m_library.itemCount();
+        const QVector<CommittedLibraryChange> changes = m_library.committedChangesSince(request->revision + 1);
+        locker.unlock();
+
+        // the history may have been cut off, or the client may be ahead of a restored library,
+        // in which case only a snapshot will do
+        const bool upToDate = (request->revision == revision);
+        const bool complete = upToDate || (request->revision < revision && !changes.isEmpty() && changes.first().committedRevision == request->revision + 1);
+
+        if (complete && changes.size() < 2) {
+            ChangeListResponse response;
+            response.changes = changes;
+            return { Message(response).encode(format), Type::ChangeListResponse };
+        }
+
+        // replaying a change on the client costs about as much as parsing one item of a snapshot
+        if (complete) {
+            const QVector<CommittedLibraryChange> compacted = Library::compactChanges(changes);
+            if (compacted.size() <= itemCount) {
+                qDebug() << "Compacted" << changes.size() << "changes since revision" << *request->revision << "to" << compacted.size();
+
+                CompactedChangeListResponse response;
+                response.fromRevision = request->revision;
+                response.toRevision = changes.last().committedRevision;
+                response.changes = compacted;
+                return { Message(response).encode(format), Type::CompactedChangeListResponse };
+            }
+        }
+
+        qDebug() << "Answering SyncRequest for revision" << *request->revision << "with a snapshot,"
+                 << changes.size() << "changes vs." << itemCount << "items";
+        return { encodedLibrary()->encoded(format), Type::LibraryResponse };
+    }
+    default: {
+        const Message response = processMessage(message);
+        return { response.encode(format), response.getType() };
+    }
+    }
+}
+
+bool Server::subscribe(const PendingRequest &request, const Message &message, WireFormat format)
+{
+    const SubscribeRequest *subscribeRequest = message.as<SubscribeRequest>();
+    if (subscribeRequest->revision != m_library.revision() || subscribeRequest->downloadsVersion != m_downloadsVersion)
+        return false;
+
+    const quint32 timeoutSecs = qBound<quint32>(1, subscribeRequest->timeoutSecs, MAX_SUBSCRIPTION_SECS);
+    const qint64 deadline = QDateTime::currentMSecsSinceEpoch() + timeoutSecs * 1000;
+    m_subscriptions << Subscription{ request, format, subscribeRequest->revision, subscribeRequest->downloadsVersion, deadline };
+    return true;
+}
+
+SubscribeResponse Server::subscriptionUpdate(quint32 revision) const
+{
+    // called on the main thread, which is the only one to modify the state
+    SubscribeResponse response;
+    response.revision = m_library.revision();
+    response.downloadsVersion = m_downloadsVersion;
+    response.fullSyncRequired = false;
+
+    if (revision < m_library.revision()) {
+        const QVector<CommittedLibraryChange> changes = m_library.committedChangesSince(revision + 1);
+        const bool complete = !changes.isEmpty() && (changes.first().committedRevision == revision + 1);
+        if (complete && changes.size() <= MAX_SUBSCRIPTION_CHANGES)
+            response.changes = changes;
+        else
+            response.fullSyncRequired = true;
+    }
+    // the library was restored from an older state, what the client has is of no use
+    else if (revision > m_library.revision()) {
+        response.fullSyncRequired = true;
+    }
+
+    response.activeRequests = m_downloads.activeDownloads();
+    response.downloadStatus = m_downloads.status();
+
+    return response;
+}
+
+void Server::notifySubscribers(bool force)
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    for (auto it = m_subscriptions.begin(); it != m_subscriptions.end(); /*empty*/) {
+        const bool outdated = (it->revision != m_library.revision()) || (it->downloadsVersion != m_downloadsVersion);
+        const bool expired = (now >= it->deadline) || it->request.socket.isNull();
+
+        if (!force && !outdated && !expired) {
+            ++it;
+            continue;
+        }
+
+        // also answers requests of clients that are gone, which releases their resources
+        respond(it->request, Message(subscriptionUpdate(it->revision)).encode(it->format), typeString(Type::SubscribeResponse));
+        it = m_subscriptions.erase(it);
+    }
+}
+
+void Server::onSubscriptionTimer()
+{
+    // progress of running downloads is pushed at most once per tick
+    const quint32 progressUpdates = m_downloads.progressUpdates();
+    if (progressUpdates != m_downloadProgressUpdates) {
+        QWriteLocker locker(&m_stateLock);
+        m_downloadProgressUpdates = progressUpdates;
+        m_downloadsVersion += 1;
+    }
+
+    notifySubscribers();
+}
+
+Message Server::processMessage(const Message &message)
+{
     switch (message.getType()) {
     case Type::Ping: {
-        return messageToJson(Pong());
+        return Pong();
     }
     case Type::ChangesRequest: {
         const ChangesRequest *changesRequest = message.as<ChangesRequest>();
         QVector<CommittedLibraryChange> appliedChanges;
+        QWriteLocker locker(&m_stateLock);
 
         // apply changes
         for (const LibraryChangeRequest &change : *changesRequest->changes) {
@@ -156,89 +559,142 @@ QByteArray Server::handleMessage(const QByteArray &data)
 
         qDebug() << "Applied" << appliedChanges.size() << "changes to Library";
 
-        // append library log
-        QFile logFile(m_settings.libraryLogFile());
-        const qint64 sz = logFile.exists() ? logFile.size() : 0;
-        if (logFile.open(QIODevice::Append)) {
-            bool first = (sz <= 0);
-            for (const auto &ch : qAsConst(appliedChanges)) {
-                if (!first)
-                    logFile.write(",\n");
-                first = false;
-
-                logFile.write(jsonSerializeObject(enjson(ch).toObject()).trimmed());
-            }
-        }
-
+        appendToLog(appliedChanges);
         saveLibrary();
+        scheduleLibraryCacheUpdate();
+        notifySubscribers();
 
         // send back all successful changes
         ChangesResponse response;
         response.changes = appliedChanges;
-        return messageToJson(response);
+        return response;
     }
     case Type::UploadSongRequestInternal: {
         const UploadSongRequestInternal *uploadSongRequest = message.as<UploadSongRequestInternal>();
         if (!QFileInfo(uploadSongRequest->filePath).isReadable())
-            return messageToJson(Error("Internal error"));
-
-        const ArtistId artist = getOrCreateArtist(uploadSongRequest->artistName);
-        const AlbumId album = getOrCreateAlbum(artist, uploadSongRequest->albumName);
-        const SongId songId = m_library.commit(LibraryChangeRequest::CreateSongAdd(album, 0, ""))
-                        .mapMember<SongId>(&CommittedLibraryChange::createdId)
-                        .takeValue();
+            return Error("Internal error");
 
-        m_library.commit(LibraryChangeRequest::CreateSongSetFileEnding(songId, 0, uploadSongRequest->fileEnding));
-        m_library.commit(LibraryChangeRequest::CreateSongSetName(songId, 0, uploadSongRequest->title));
-        m_library.commit(LibraryChangeRequest::CreateSongSetLength(songId, uploadSongRequest->duration));
-        m_library.commit(LibraryChangeRequest::CreateSongSetPosition(songId, uploadSongRequest->position));
+        // the CGI has hashed the file already, reading it again here would stall everybody else
+        const QByteArray sha256 = QByteArray::fromHex(uploadSongRequest->sha256->toLatin1());
+        if (sha256.size() != 32) {
+            qWarning() << "Upload without a valid SHA-256:" << *uploadSongRequest->sha256;
+            return Error("Internal error");
+        }
 
-        // assign handle and move to destination
-        QFile(uploadSongRequest->filePath).rename(createSongHandleFile(songId));
+        IngestBatch batch;
+        batch.artistName = uploadSongRequest->artistName;
+        batch.albumName = uploadSongRequest->albumName;
+        batch.songs << IngestBatch::Song{
+            uploadSongRequest->title,
+            uploadSongRequest->position,
+            uploadSongRequest->duration,
+            uploadSongRequest->fileEnding,
+            uploadSongRequest->filePath,
+            sha256,
+        };
+
+        const QVector<SongId> songIds = ingest(batch);
+        notifySubscribers();
 
         UploadSongResponse response;
-        response.songId = songId;
-        return messageToJson(response);
-    }
-    case Type::LibraryRequest: {
-        LibraryResponse response;
-        SerializedLibrary serialized = m_library.serializeToJson();
-        response.libraryJson = serialized.libraryJson;
-        response.version = serialized.version;
-        return messageToJson(response);
+        response.songId = songIds.first();
+        return response;
     }
     case Type::IdRequest: {
         IdResponse response;
         response.id = QString::fromUtf8(m_library.id().toString());
-        return messageToJson(response);
+        return response;
     }
     case Type::ChangeListRequest: {
         const ChangeListRequest *changeListRequest = message.as<ChangeListRequest>();
         const quint32 rev = changeListRequest->revision;
+        QReadLocker locker(&m_stateLock);
         const QVector<CommittedLibraryChange> changes = m_library.committedChangesSince(rev);
         ChangeListResponse response;
         response.changes = changes;
-        return messageToJson(response);
+        return response;
     }
     case Type::DownloadRequest: {
+        // sent by older CGIs, which don't tell who is asking
         const DownloadRequest *downloadRequest = message.as<DownloadRequest>();
-        const quint32 id = startDownload(*downloadRequest);
         DownloadResponse response;
-        response.downloadId = id;
-        return messageToJson(response);
+        response.downloadId = enqueueDownload(*downloadRequest, QString(), 0);
+        return response;
+    }
+    case Type::DownloadRequestInternal: {
+        const DownloadRequestInternal *downloadRequest = message.as<DownloadRequestInternal>();
+        DownloadResponse response;
+        response.downloadId = enqueueDownload(downloadRequest->request, downloadRequest->client, downloadRequest->priority);
+        return response;
+    }
+    // sent by older CGIs, which don't tell who is asking, so only downloads that nobody owns qualify
+    case Type::DownloadCancelRequest:
+    case Type::DownloadPriorityRequest:
+    case Type::DownloadCancelRequestInternal:
+    case Type::DownloadPriorityRequestInternal: {
+        {
+            QWriteLocker locker(&m_stateLock);
+            DownloadCancelRequest cancelRequest;
+            DownloadPriorityRequest priorityRequest;
+            QString client;
+            if (const DownloadCancelRequestInternal *internalRequest = message.as<DownloadCancelRequestInternal>()) {
+                cancelRequest = internalRequest->request;
+                client = internalRequest->client;
+            } else if (const DownloadPriorityRequestInternal *internalRequest = message.as<DownloadPriorityRequestInternal>()) {
+                priorityRequest = internalRequest->request;
+                client = internalRequest->client;
+            } else if (message.as<DownloadCancelRequest>()) {
+                cancelRequest = *message.as<DownloadCancelRequest>();
+            } else {
+                priorityRequest = *message.as<DownloadPriorityRequest>();
+            }
+
+            const bool cancel = (message.getType() == Type::DownloadCancelRequest || message.getType() == Type::DownloadCancelRequestInternal);
+            const quint32 id = cancel ? *cancelRequest.downloadId : *priorityRequest.downloadId;
+            const DownloadScheduler::Job *job = m_downloads.find(id);
+            if (job && job->client != client) {
+                qWarning() << client << "may not change download" << id << "of" << job->client;
+                return Error("Not your download");
+            }
+
+            if (cancel) {
+                if (m_downloads.cancel(id))
+                    qDebug() << "Cancelled download" << id;
+            } else {
+                m_downloads.setPriority(id, priorityRequest.priority);
+            }
+            m_downloadsVersion += 1;
+        }
+        notifySubscribers();
+
+        QReadLocker locker(&m_stateLock);
+        return downloadQueryResponse();
     }
     case Type::DownloadQuery: {
-        DownloadQueryResponse response;
-        for (auto it = m_downloads.begin(); it != m_downloads.end(); ++it)
-            response.activeRequests->append(DownloadQueryResponse::ActiveDownload{ it.key(), it.value().request });
-        return messageToJson(response);
+        QReadLocker locker(&m_stateLock);
+        return downloadQueryResponse();
+    }
+    case Type::SubscribeRequest: {
+        // without a connection to hold on to, answer with the current state right away
+        return subscriptionUpdate(message.as<SubscribeRequest>()->revision);
     }
     default: {
-        return messageToJson(Error());
+        return Error();
     }
     }
 }
 
+/** gzip runs in the background, so that big libraries don't hold up requests */
+static void compressBackup(const QString &path)
+{
+    ProcessRunner::Options options;
+    options.lane = ProcessRunner::Lane::Background;
+    ProcessRunner::start("gzip", { path }, options, [=](const Result<ProcessRunner::Output, QString> &result) {
+        if (result.hasError())
+            qWarning().noquote() << "Failed to compress" << path << "-" << result.getError();
+    });
+}
+
 void Server::saveLibrary() const
 {
     const auto save = [&](const QString &path) {
@@ -259,14 +715,14 @@ void Server::saveLibrary() const
     const QString backupPath = m_settings.libraryBackupDir() + "." + dateString + ".json";
     if (!QFile::exists(backupPath) && !QFile::exists(backupPath + ".gz")) {
         save(backupPath);
-        QProcess::execute("gzip", { backupPath });
+        compressBackup(backupPath);
     }
 
     // backup log
     const QString logBackupPath = m_settings.libraryBackupDir() + "." + dateString + ".log.json";
     if (!QFile::exists(backupPath) && !QFile::exists(backupPath + ".gz")) {
         QFile(m_settings.libraryLogFile()).copy(logBackupPath);
-        QProcess::execute("gzip", { logBackupPath });
+        compressBackup(logBackupPath);
     }
 }
 
@@ -296,76 +752,169 @@ AlbumId Server::getOrCreateAlbum(ArtistId artist, const QString &name)
             .takeValue();
 }
 
-quint32 Server::startDownload(const MoosickMessage::DownloadRequest &request)
+quint32 Server::enqueueDownload(const DownloadRequest &request, const QString &client, qint32 priority)
 {
-    const quint32 id = m_nextDownloadId++;
-
-    qDebug() << "Starting download" << id << ":" << (int) *request.requestType << *request.url << *request.albumName << *request.artistId << *request.artistName;
+    quint32 id = 0;
+    {
+        QWriteLocker locker(&m_stateLock);
+        id = m_downloads.enqueue(request, client, priority);
+        m_downloadsVersion += 1;
+    }
 
-    DownloaderThread *thread = new DownloaderThread(request, this);
-    m_downloads[id] = RunningDownload { request, thread };
-    connect(thread, &DownloaderThread::finished, this, [=]() {
-        onDownloaderThreadFinished(thread);
-    });
+    qDebug() << "Queued download" << id << "for" << client << "with priority" << priority << ":"
+             << (int) *request.requestType << *request.url << *request.albumName << *request.artistId << *request.artistName;
 
-    thread->start();
+    startDownloads();
+    notifySubscribers();
 
     return id;
 }
 
-void Server::onDownloaderThreadFinished(DownloaderThread *thread)
+void Server::startDownloads()
 {
-    quint32 id = 0;
-    for (auto it = m_downloads.begin(); it != m_downloads.end(); ++it) {
-        if (it->thread == thread) {
-            id = it.key();
-            m_downloads.erase(it);
-            break;
-        }
+    QVector<DownloadScheduler::Job> jobs;
+    {
+        QWriteLocker locker(&m_stateLock);
+        jobs = m_downloads.takeStartable();
+        if (!jobs.isEmpty())
+            m_downloadsVersion += 1;
     }
 
-    if (thread->m_result.hasError()) {
-        qWarning() << "Failed to download:" << thread->m_result.getError();
+    const QString toolDir = m_settings.toolsDir();
+
+    for (const DownloadScheduler::Job &job : qAsConst(jobs)) {
+        qDebug() << "Starting download" << job.id;
+
+        const QString workDir = downloadWorkDir(job.id);
+        m_downloadPool.start(new WorkerTask([=]() {
+            // tracks are hashed one after another beside the download, rather than holding up
+            // its transfers, or the main thread, which holds the write lock while ingesting
+            QThreadPool hashPool;
+            hashPool.setMaxThreadCount(1);
+
+            const TrackCallback onTrack = [=, &hashPool](int track, const DownloadedTrack &file) {
+                hashPool.start(new WorkerTask([=]() {
+                    DownloadedTrack hashed = file;
+                    hashed.sha256 = MediaIndex::hashFile(file.fullPath);
+                    if (m_readyTracks.push(ReadyTrack{ job.id, track, hashed }))
+                        QMetaObject::invokeMethod(this, [=]() { ingestReadyTracks(); }, Qt::QueuedConnection);
+                }));
+            };
+
+            const Option<QString> error = download(job.request, toolDir, workDir, *job.cancelled, *job.progress, job.handedOver, onTrack);
+
+            // what's left is hashing and adding the last tracks to the library
+            if (!error)
+                job.progress->setPhase(DownloadPhase::Committing);
+            hashPool.waitForDone();
+            QMetaObject::invokeMethod(this, [=]() { onDownloadFinished(job.id, error); }, Qt::QueuedConnection);
+        }));
     }
-    else {
-        finishDownload(id, thread->m_result.takeValue());
-    }
-
-    thread->wait();
-    delete thread;
 }
 
-void Server::finishDownload(quint32 id, const DownloadResult &result)
+void Server::onDownloadFinished(quint32 id, const Option<QString> &error)
 {
-    // 1. Get or create artist
-    ArtistId artistId = result.artistId;
-    if (!artistId.isValid() || !artistId.exists(m_library))
-        artistId = getOrCreateArtist(result.artistName);
+    // tracks the download handed over before it finished may still be waiting
+    ingestReadyTracks();
+
+    const DownloadScheduler::Job *job = m_downloads.find(id);
+    const int tracks = job ? job->handedOver.size() : 0;
 
-    // 2. Create album
-    const AlbumId albumId = getOrCreateAlbum(artistId, result.albumName);
+    if (m_downloads.isCancelled(id))
+        qDebug() << "Cancelled download" << id << "after" << tracks << "songs";
+    else if (error)
+        qWarning() << "Failed to download" << id << "after" << tracks << "songs:" << error.getValue();
+    else
+        qDebug() << "Finished download" << id << ":" << tracks << "songs";
 
-    // 3. Add songs
-    for (const DownloadResult::File &file : result.files)
     {
-        const SongId songId = m_library.commit(LibraryChangeRequest::CreateSongAdd(albumId, 0, file.title))
-                .mapMember<SongId>(&CommittedLibraryChange::createdId)
-                .takeValue();
+        QWriteLocker locker(&m_stateLock);
+        m_downloads.finish(id);
+        m_downloadsVersion += 1;
+    }
+
+    // the download is gone from the queue, so are the files it hasn't handed over
+    QDir(downloadWorkDir(id)).removeRecursively();
+
+    startDownloads();
 
-        m_library.commit(LibraryChangeRequest::CreateSongSetName(songId, 0, file.title));
-        m_library.commit(LibraryChangeRequest::CreateSongSetPosition(songId, file.albumPosition));
-        m_library.commit(LibraryChangeRequest::CreateSongSetLength(songId, file.duration));
-        m_library.commit(LibraryChangeRequest::CreateSongSetFileEnding(songId, 0, file.fileEnding));
+    // the library changes of the download and its disappearance are announced together
+    notifySubscribers();
+}
+
+void Server::ingestReadyTracks()
+{
+    const QVector<ReadyTrack> readyTracks = m_readyTracks.takeAll();
+    if (readyTracks.isEmpty())
+        return;
+
+    // one batch per download, in the order the tracks arrived
+    QMap<quint32, QVector<ReadyTrack>> byDownload;
+    for (const ReadyTrack &readyTrack : readyTracks)
+        byDownload[readyTrack.downloadId] << readyTrack;
+
+    for (auto it = byDownload.cbegin(); it != byDownload.cend(); ++it) {
+        const DownloadScheduler::Job *job = m_downloads.find(it.key());
+        if (!job || m_downloads.isCancelled(it.key())) {
+            for (const ReadyTrack &readyTrack : it.value())
+                QFile::remove(readyTrack.file.fullPath);
+            continue;
+        }
+
+        // later tracks follow the earlier ones, even if their album has been renamed since
+        IngestBatch batch;
+        batch.artistId = job->artistId ? job->artistId : *job->request.artistId;
+        batch.artistName = job->request.artistName;
+        batch.albumId = job->albumId;
+        batch.albumName = job->request.albumName;
+        QVector<int> tracks;
+        for (const ReadyTrack &readyTrack : it.value()) {
+            const DownloadedTrack &file = readyTrack.file;
+            batch.songs << IngestBatch::Song{ file.title, file.albumPosition, file.duration, file.fileEnding, file.fullPath, file.sha256 };
+            tracks << readyTrack.track;
+        }
 
-        // assign handle and move to destination
-        QFile(file.fullPath).rename(createSongHandleFile(songId));
+        ingest(batch);
+
+        // marked once logged, so that a restart in between adds the tracks again rather than losing them
+        QWriteLocker locker(&m_stateLock);
+        m_downloads.markHandedOver(it.key(), tracks, batch.artistId, batch.albumId);
+        m_downloadsVersion += 1;
     }
 
-    // 4. Remove temp dir
-    if (!result.tempDir.isEmpty() && QDir().exists(result.tempDir))
-        QDir().rmdir(result.tempDir);
+    notifySubscribers();
+}
 
-    qDebug() << "Finished download" << id << ":" << artistId.name(m_library) << albumId.name(m_library) << result.files.size() << "songs";
+QString Server::downloadWorkDir(quint32 id) const
+{
+    return m_settings.tempDir() + "/downloads/" + QString::number(id);
 }
 
-#include "server.moc"
+void Server::removeOrphanedDownloads()
+{
+    const QDir downloadsDir(m_settings.tempDir() + "/downloads");
+    for (const QString &name : downloadsDir.entryList(QDir::Dirs | QDir::NoDotAndDotDot)) {
+        bool isId = false;
+        const quint32 id = name.toUInt(&isId);
+        if (isId && m_downloads.contains(id))
+            continue;
+
+        qDebug() << "Removing orphaned download directory" << name;
+        QDir(downloadsDir.filePath(name)).removeRecursively();
+    }
+
+    // earlier versions downloaded into mktemp directories right in tempDir, which nobody else uses
+    const QDir tempDir(m_settings.tempDir());
+    for (const QString &name : tempDir.entryList({ "tmp.*" }, QDir::Dirs | QDir::NoDotAndDotDot)) {
+        qDebug() << "Removing orphaned download directory" << name;
+        QDir(tempDir.filePath(name)).removeRecursively();
+    }
+}
+
+DownloadQueryResponse Server::downloadQueryResponse() const
+{
+    DownloadQueryResponse response;
+    response.activeRequests = m_downloads.activeDownloads();
+    response.status = m_downloads.status();
+    return response;
+}
@@ -1,15 +1,22 @@
 #pragma once
 
 #include <QTcpServer>
+#include <QThreadPool>
+#include <QReadWriteLock>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QAtomicInt>
+#include <QTimer>
+#include <QMap>
 
 #include "tcpclientserver.hpp"
 #include "serversettings.hpp"
 #include "library.hpp"
 #include "library_messages.hpp"
 #include "option.hpp"
-
-class DownloaderThread;
-class DownloadResult;
+#include "mediaindex.hpp"
+#include "downloadscheduler.hpp"
+#include "mpscqueue.hpp"
 
 class Server : public TcpServer
 {
@@ -21,29 +28,173 @@ public:
 
 protected:
     QByteArray handleMessage(const QByteArray &data) override;
+    void handleMessageAsync(const PendingRequest &request, const QByteArray &data) override;
 
 private:
-    quint32 startDownload(const MoosickMessage::DownloadRequest &request);
-    void finishDownload(quint32 id, const DownloadResult &result);
-    void onDownloaderThreadFinished(DownloaderThread *thread);
+    static bool isReadOnly(MoosickMessage::Type type);
+
+    MoosickMessage::Message processMessage(const MoosickMessage::Message &message);
+
+    /** The response type labels the compression metrics, the same as in the front end */
+    struct EncodedResponse
+    {
+        QByteArray data;
+        MoosickMessage::Type type;
+    };
+    EncodedResponse processMessageEncoded(const MoosickMessage::Message &message, MoosickMessage::WireFormat format);
+
+    /**
+     * LibraryResponse for the current library revision. Each wire format is only encoded
+     * once somebody asks for it, as most setups only ever see one of them.
+     */
+    struct EncodedLibrary
+    {
+        quint32 revision;
+        MoosickMessage::LibraryResponse response;
+
+        const QByteArray &encoded(MoosickMessage::WireFormat format) const;
+
+    private:
+        mutable QMutex m_mutex;
+        mutable QByteArray m_json;
+        mutable QByteArray m_cbor;
+    };
+
+    QSharedPointer<const EncodedLibrary> encodedLibrary();
+    void scheduleLibraryCacheUpdate();
+
+    struct Subscription
+    {
+        PendingRequest request;
+        MoosickMessage::WireFormat format;
+        quint32 revision;
+        quint32 downloadsVersion;
+        qint64 deadline;
+    };
+
+    bool subscribe(const PendingRequest &request, const MoosickMessage::Message &message, MoosickMessage::WireFormat format);
+    MoosickMessage::SubscribeResponse subscriptionUpdate(quint32 revision) const;
+
+    /** Answers those subscriptions whose state is outdated, or all of them if force is set */
+    void notifySubscribers(bool force = false);
+    void onSubscriptionTimer();
+
+    /** Logs how many read-only requests of each type were waiting for m_workerPool lately */
+    void reportQueueDepth();
+
+    quint32 enqueueDownload(const MoosickMessage::DownloadRequest &request, const QString &client, qint32 priority);
+    void startDownloads();
+    void onDownloadFinished(quint32 id, const Option<QString> &error);
+
+    /** Adds the tracks that downloads handed over since last time to the library */
+    void ingestReadyTracks();
+    MoosickMessage::DownloadQueryResponse downloadQueryResponse() const;
+
+    /** Where a download keeps its partial files, across restarts */
+    QString downloadWorkDir(quint32 id) const;
+    void removeOrphanedDownloads();
     QString createSongHandleFile(Moosick::SongId songId);
 
+    /**
+     * Songs of one album, from a download or an upload. They are committed under one lock,
+     * so that nobody sees half an album, and are appended to the log in one go.
+     */
+    struct IngestBatch
+    {
+        struct Song
+        {
+            QString title;
+            int position;
+            int duration;
+            QString fileEnding;
+            QString filePath;
+            QByteArray sha256;
+        };
+
+        /** Looked up by artistName if this one doesn't exist */
+        quint32 artistId = 0;
+        QString artistName;
+
+        /** Looked up by albumName if this one doesn't exist */
+        quint32 albumId = 0;
+        QString albumName;
+        QVector<Song> songs;
+    };
+
+    /** Sets the batch's artistId and albumId to where its songs ended up */
+    QVector<Moosick::SongId> ingest(IngestBatch &batch);
+
+    /**
+     * Gives the song a handle, that of identical media if there is some already.
+     * Returns where filePath has to be moved to, or nothing if it is a duplicate.
+     */
+    QString assignMediaFile(Moosick::SongId songId, const QString &filePath, const QByteArray &sha256);
+
+    /** The library file is only saved now and then, the log has every change right away */
+    void appendToLog(const QVector<Moosick::CommittedLibraryChange> &changes);
+
 private:
     void saveLibrary() const;
 
     ServerSettings m_settings;
 
+    /** Set once the library has been loaded, nothing is saved before that */
+    bool m_initialized = false;
+
+    /**
+     * Read-only requests are answered on m_workerPool. Only the main thread modifies
+     * m_library and m_downloads, and does so while holding m_stateLock for writing.
+     * Workers hold it for reading.
+     */
+    QThreadPool m_workerPool;
+    QReadWriteLock m_stateLock;
+
+    /** Requests of a type that have been handed to m_workerPool and not been answered yet */
+    struct QueueDepth
+    {
+        int current = 0;
+        /** Most there were since the last report */
+        int peak = 0;
+    };
+    QMap<MoosickMessage::Type, QueueDepth> m_queueDepth;
+    QTimer m_queueReportTimer;
+
+    /**
+     * Serializing the whole library is expensive, so the encoded LibraryResponse is kept
+     * until the revision changes. m_libraryCacheBuildMutex makes sure that clients asking
+     * for the same revision at once wait for one build instead of each doing their own.
+     */
+    QMutex m_libraryCacheMutex;
+    QMutex m_libraryCacheBuildMutex;
+    QSharedPointer<const EncodedLibrary> m_libraryCache;
+    QAtomicInt m_libraryCacheUpdateScheduled;
+
     Moosick::Library m_library;
+    MediaIndex m_mediaIndex;
 
-    struct RunningDownload {
-        MoosickMessage::DownloadRequest request;
-        DownloaderThread *thread;
+    /** Downloads run on m_downloadPool, in the order and number m_downloads decides */
+    DownloadScheduler m_downloads;
+    QThreadPool m_downloadPool;
+
+    /**
+     * Tracks that running downloads finished, on their way to the main thread. Whoever
+     * pushes onto an empty queue asks the main thread to empty it.
+     */
+    struct ReadyTrack
+    {
+        quint32 downloadId;
+        int track;
+        DownloadedTrack file;
     };
-    QHash<quint32, RunningDownload> m_downloads;
-    quint32 m_nextDownloadId = 1;
+    MpscQueue<ReadyTrack> m_readyTracks;
+
+    /** Increased whenever a download is queued, starts, makes progress, or finishes */
+    quint32 m_downloadsVersion = 1;
+    quint32 m_downloadProgressUpdates = 0;
+
+    QVector<Subscription> m_subscriptions;
+    QTimer m_subscriptionTimer;
 
     Moosick::ArtistId getOrCreateArtist(const QString &name);
     Moosick::AlbumId getOrCreateAlbum(Moosick::ArtistId artist, const QString &name);
-
-    friend class DownloaderThread;
 };
@@ -8,13 +8,19 @@ QT += core network
 SOURCES += \
     main.cpp \
     download.cpp \
+    downloadscheduler.cpp \
+    filetransfer.cpp \
+    mediaindex.cpp \
     server.cpp \
     signalhandler.cpp \
     \
+    ../shared/compression.cpp \
     ../shared/jsonconv.cpp \
     ../shared/library.cpp \
     ../shared/library_serialize.cpp \
+    ../shared/library_compact.cpp \
     ../shared/logger.cpp \
+    ../shared/processrunner.cpp \
     ../shared/serversettings.cpp \
     ../shared/tcpclientserver.cpp \
     \
@@ -35,14 +41,21 @@ SOURCES += \
 HEADERS += \
     server.hpp \
     download.hpp \
+    downloadscheduler.hpp \
+    filetransfer.hpp \
+    mediaindex.hpp \
     signalhandler.hpp \
     \
+    ../shared/compression.hpp \
     ../shared/flatmap.hpp \
     ../shared/jsonconv.hpp \
     ../shared/library.hpp \
     ../shared/library_types.hpp \
     ../shared/library_messages.hpp \
+    ../shared/nameregistry.hpp \
     ../shared/logger.hpp \
+    ../shared/mpscqueue.hpp \
+    ../shared/processrunner.hpp \
     ../shared/serversettings.hpp \
     ../shared/tcpclientserver.hpp \
 
@@ -0,0 +1,105 @@
+#include "compression.hpp"
+
+#include <QElapsedTimer>
+#include <QtEndian>
+#include <QDebug>
+
+namespace Compression {
+
+// a low level is a lot faster, and still gets most of the gain for our JSON/CBOR payloads
+static constexpr int COMPRESSION_LEVEL = 1;
+
+QMutex Metrics::ms_mutex;
+QMap<QString, Metrics::Entry> Metrics::ms_entries;
+
+QByteArray encodingName(Encoding encoding)
+{
+    switch (encoding) {
+    case Encoding::Identity: return "identity";
+    case Encoding::Deflate: return "deflate";
+    }
+    return "identity";
+}
+
+Encoding encodingFromAcceptEncoding(const QByteArray &acceptEncoding)
+{
+    for (const QByteArray &entry : acceptEncoding.split(',')) {
+        const QList<QByteArray> parts = entry.split(';');
+        if (parts.first().trimmed().toLower() != "deflate")
+            continue;
+
+        // a q-value of zero, however it's spelled, means that the client explicitly refuses it
+        bool refused = false;
+        for (int i = 1; i < parts.size(); ++i) {
+            const QList<QByteArray> param = parts[i].split('=');
+            if (param.size() != 2 || param[0].trimmed().toLower() != "q")
+                continue;
+            bool ok = false;
+            const double q = param[1].trimmed().toDouble(&ok);
+            refused = ok && (q <= 0.0);
+        }
+        if (!refused)
+            return Encoding::Deflate;
+    }
+    return Encoding::Identity;
+}
+
+QByteArray deflate(const QByteArray &data, const QString &label)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    // qCompress() prepends the uncompressed size as 4 bytes, what follows is a plain zlib stream
+    QByteArray ret = qCompress(data, COMPRESSION_LEVEL);
+    ret.remove(0, 4);
+
+    Metrics::record(label, data.size(), ret.size(), timer.nsecsElapsed());
+    return ret;
+}
+
+Result<QByteArray, QString> inflate(const QByteArray &data)
+{
+    // qUncompress() wants the size prefix, but only uses it as a hint for its initial buffer
+    QByteArray prefixed(4, 0);
+    qToBigEndian<quint32>(qMin<quint32>(data.size() * 4, 64 * 1024 * 1024), (uchar*) prefixed.data());
+    prefixed += data;
+
+    const QByteArray ret = qUncompress(prefixed);
+    if (ret.isEmpty() && !data.isEmpty())
+        return QString("Failed to inflate compressed data");
+    return ret;
+}
+
+void Metrics::record(const QString &label, qint64 rawBytes, qint64 compressedBytes, qint64 nsecs)
+{
+    QMutexLocker locker(&ms_mutex);
+    Entry &entry = ms_entries[label];
+    entry.count += 1;
+    entry.rawBytes += rawBytes;
+    entry.compressedBytes += compressedBytes;
+    entry.nsecs += nsecs;
+}
+
+QMap<QString, Metrics::Entry> Metrics::entries()
+{
+    QMutexLocker locker(&ms_mutex);
+    return ms_entries;
+}
+
+void Metrics::dump()
+{
+    const QMap<QString, Entry> all = entries();
+    for (auto it = all.begin(); it != all.end(); ++it) {
+        const Entry &entry = it.value();
+        const double ratio = entry.rawBytes ? (double) entry.compressedBytes / entry.rawBytes : 1.0;
+        qInfo().noquote() << QString("Compression: %1: %2 payloads, %3 -> %4 bytes (%5%), %6 ms total")
+                             .arg(it.key())
+                             .arg(entry.count)
+                             .arg(entry.rawBytes)
+                             .arg(entry.compressedBytes)
+                             .arg(ratio * 100.0, 0, 'f', 1)
+                             .arg(entry.nsecs / 1000000.0, 0, 'f', 2);
+    }
+}
+
+} // namespace Compression
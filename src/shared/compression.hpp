@@ -0,0 +1,68 @@
+#pragma once
+
+#include <QByteArray>
+#include <QString>
+#include <QMap>
+#include <QMutex>
+
+#include "result.hpp"
+
+/**
+ * Payload compression, both for HTTP responses (Content-Encoding) and for dbserver frames.
+ *
+ * Only deflate is supported, since that is what qCompress() gives us without pulling in
+ * another library. Messages are always fully in memory on both ends, so we compress in
+ * one go, at a low level that trades some ratio for latency.
+ */
+namespace Compression {
+
+enum class Encoding
+{
+    Identity,
+    Deflate,
+};
+
+/** Payloads smaller than this aren't worth the effort */
+static constexpr int MIN_COMPRESSED_SIZE = 1024;
+
+QByteArray encodingName(Encoding encoding);
+
+/**
+ * Picks the best encoding offered by an HTTP Accept-Encoding header
+ */
+Encoding encodingFromAcceptEncoding(const QByteArray &acceptEncoding);
+
+/**
+ * Returns a zlib stream (RFC 1950), as used by HTTP's "deflate" content coding.
+ * The label is used to keep statistics, e.g. per message type.
+ */
+QByteArray deflate(const QByteArray &data, const QString &label);
+
+Result<QByteArray, QString> inflate(const QByteArray &data);
+
+/**
+ * Ratio and time spent compressing, accumulated per label
+ */
+class Metrics
+{
+public:
+    struct Entry
+    {
+        qint64 count = 0;
+        qint64 rawBytes = 0;
+        qint64 compressedBytes = 0;
+        qint64 nsecs = 0;
+    };
+
+    static void record(const QString &label, qint64 rawBytes, qint64 compressedBytes, qint64 nsecs);
+    static QMap<QString, Entry> entries();
+
+    /** Prints one line per label */
+    static void dump();
+
+private:
+    static QMutex ms_mutex;
+    static QMap<QString, Entry> ms_entries;
+};
+
+} // namespace Compression
@@ -1,9 +1,12 @@
 #include "library.hpp"
 #include "library_messages.hpp"
+#include "nameregistry.hpp"
 
 #include <QDebug>
 #include <QJsonArray>
 #include <QJsonObject>
+#include <QCborStreamWriter>
+#include <QCborStreamReader>
 
 namespace Moosick {
 
@@ -50,6 +53,11 @@ quint32 Library::getOrCreateFileEndingId(const QString &ending)
 }
 
 Result<CommittedLibraryChange, QString> Library::commit(const LibraryChangeRequest &change)
+{
+    return commitInternal(change, 0);
+}
+
+Result<CommittedLibraryChange, QString> Library::commitInternal(const LibraryChangeRequest &change, quint32 createdId)
 {
 #define requireThat(condition, message) \
     do { if (!(condition)) return QString(message); } while (0)
@@ -63,7 +71,8 @@ Result<CommittedLibraryChange, QString> Library::commit(const LibraryChangeReque
     case Moosick::LibraryChangeRequest::SongAdd: {
         fetchItem(m_albums, album, change.targetId);
 
-        auto song = m_songs.create();
+        requireThat(!createdId || !m_songs.contains(createdId), "Song ID already taken");
+        auto song = m_songs.create(createdId);
         song.second->name = change.name;
         song.second->album = change.targetId;
         album->songs << song.first;
@@ -142,7 +151,8 @@ Result<CommittedLibraryChange, QString> Library::commit(const LibraryChangeReque
     case Moosick::LibraryChangeRequest::AlbumAdd: {
         fetchItem(m_artists, artist, change.targetId);
 
-        auto album = m_albums.create();
+        requireThat(!createdId || !m_albums.contains(createdId), "Album ID already taken");
+        auto album = m_albums.create(createdId);
         album.second->artist = change.targetId;
         album.second->name = change.name;
         artist->albums << album.first;
@@ -207,7 +217,8 @@ Result<CommittedLibraryChange, QString> Library::commit(const LibraryChangeReque
         [[fallthrough]];
     }
     case Moosick::LibraryChangeRequest::ArtistAdd: {
-        auto artist = m_artists.create();
+        requireThat(!createdId || !m_artists.contains(createdId), "Artist ID already taken");
+        auto artist = m_artists.create(createdId);
         artist.second->name = change.name;
         commit.createdId = artist.first;
 
@@ -249,7 +260,8 @@ Result<CommittedLibraryChange, QString> Library::commit(const LibraryChangeReque
         auto parentTag = m_tags.findItem(change.targetId);
         requireThat(parentTag || (change.targetId == 0), "Parent tag not found");
 
-        auto tag = m_tags.create();
+        requireThat(!createdId || !m_tags.contains(createdId), "Tag ID already taken");
+        auto tag = m_tags.create(createdId);
         tag.second->name = change.name;
         tag.second->parent = change.targetId;
         if (parentTag)
@@ -348,13 +360,41 @@ void Library::commit(const QVector<CommittedLibraryChange> &changes)
 {
     for (const CommittedLibraryChange &change : changes) {
         if (change.committedRevision == m_revision + 1) {
-            Result<CommittedLibraryChange, QString> committed = commit(change.changeRequest);
+            Result<CommittedLibraryChange, QString> committed = commitInternal(change.changeRequest, change.createdId);
             Q_ASSERT(committed.hasValue());
             Q_ASSERT(committed.getValue().committedRevision == change.committedRevision);
         }
     }
 }
 
+Option<QString> Library::commitCompacted(const QVector<CommittedLibraryChange> &changes, quint32 revision)
+{
+    const int historySize = m_committedChanges.size();
+
+    for (const CommittedLibraryChange &change : changes) {
+        // a compacted list can't tell whether a tag was moved back to where it was
+        if (change.changeRequest.changeType == LibraryChangeRequest::TagSetParent) {
+            const Tag *tag = m_tags.findItem(change.changeRequest.targetId);
+            if (tag && tag->parent == change.changeRequest.detail)
+                continue;
+        }
+
+        Result<CommittedLibraryChange, QString> committed = commitInternal(change.changeRequest, change.createdId);
+        if (committed.hasError())
+            return committed.takeError();
+    }
+
+    // the individual revisions in between are unknown, and so is their history
+    m_committedChanges.resize(historySize);
+    m_revision = revision;
+    return {};
+}
+
+int Library::itemCount() const
+{
+    return m_songs.size() + m_albums.size() + m_artists.size() + m_tags.size();
+}
+
 QVector<CommittedLibraryChange> Library::committedChangesSince(quint32 revision) const
 {
     QVector<CommittedLibraryChange> ret;
@@ -520,12 +560,87 @@ QString TagId::name(const Library &library) const
 
 namespace MoosickMessage {
 
-QByteArray messageToJson(const MessageBase &message)
+static QJsonObject messageToJsonObject(const MessageBase &message)
 {
     QJsonObject obj;
     obj["id"] = message.getMessageTypeString();
     obj["data"] = message.enjson();
-    return jsonSerializeObject(obj);
+    return obj;
+}
+
+QByteArray messageToJson(const MessageBase &message)
+{
+    return jsonSerializeObject(messageToJsonObject(message), QJsonDocument::Compact);
+}
+
+/**
+ * Streams a JSON tree as CBOR, rather than building a QCborValue tree of it first.
+ * Integral numbers are written as integers, like QCborValue::fromJsonValue() does.
+ */
+static void writeCbor(QCborStreamWriter &writer, const QJsonValue &value)
+{
+    switch (value.type()) {
+    case QJsonValue::Null:
+        writer.append(nullptr);
+        break;
+    case QJsonValue::Bool:
+        writer.append(value.toBool());
+        break;
+    case QJsonValue::Double: {
+        const double d = value.toDouble();
+        if (qAbs(d) < 9007199254740992.0 && d == (double) (qint64) d)
+            writer.append((qint64) d);
+        else
+            writer.append(d);
+        break;
+    }
+    case QJsonValue::String:
+        writer.append(value.toString());
+        break;
+    case QJsonValue::Array: {
+        const QJsonArray array = value.toArray();
+        writer.startArray(array.size());
+        for (const QJsonValue &element : array)
+            writeCbor(writer, element);
+        writer.endArray();
+        break;
+    }
+    case QJsonValue::Object: {
+        const QJsonObject object = value.toObject();
+        writer.startMap(object.size());
+        for (auto it = object.begin(); it != object.end(); ++it) {
+            writer.append(it.key());
+            writeCbor(writer, it.value());
+        }
+        writer.endMap();
+        break;
+    }
+    case QJsonValue::Undefined:
+        writer.append(QCborSimpleType::Undefined);
+        break;
+    }
+}
+
+QByteArray messageToCbor(const MessageBase &message)
+{
+    QByteArray data;
+    QCborStreamWriter writer(&data);
+    writer.startMap(2);
+    writer.append(QLatin1String("id"));
+    writer.append(message.getMessageTypeString());
+    writer.append(QLatin1String("data"));
+    writeCbor(writer, message.enjson());
+    writer.endMap();
+    return data;
+}
+
+QByteArray encodeMessage(const MessageBase &message, WireFormat format)
+{
+    switch (format) {
+    case WireFormat::Json: return messageToJson(message);
+    case WireFormat::Cbor: return messageToCbor(message);
+    }
+    return QByteArray();
 }
 
 QByteArray Message::toJson() const
@@ -533,6 +648,35 @@ QByteArray Message::toJson() const
     return m_msg ? messageToJson(*m_msg) : QByteArray();
 }
 
+QByteArray Message::toCbor() const
+{
+    return m_msg ? messageToCbor(*m_msg) : QByteArray();
+}
+
+QByteArray Message::encode(WireFormat format) const
+{
+    return m_msg ? encodeMessage(*m_msg, format) : QByteArray();
+}
+
+QByteArray wireFormatMimeType(WireFormat format)
+{
+    switch (format) {
+    case WireFormat::Json: return "application/json";
+    case WireFormat::Cbor: return "application/cbor";
+    }
+    return QByteArray();
+}
+
+WireFormat wireFormatFromMimeTypes(const QByteArray &acceptHeader)
+{
+    for (const QByteArray &entry : acceptHeader.split(',')) {
+        const QByteArray mimeType = entry.split(';').first().trimmed();
+        if (mimeType == wireFormatMimeType(WireFormat::Cbor))
+            return WireFormat::Cbor;
+    }
+    return WireFormat::Json;
+}
+
 QString typeString(Type messageType)
 {
     switch (messageType) {
@@ -558,18 +702,111 @@ QString typeString(Type messageType)
     case Type::DownloadQueryResponse: return "DownloadQueryResponse";
     case Type::YoutubeUrlQuery: return "YoutubeUrlQuery";
     case Type::YoutubeUrlResponse: return "YoutubeUrlResponse";
+    case Type::ConditionalLibraryRequest: return "ConditionalLibraryRequest";
+    case Type::LibraryNotModified: return "LibraryNotModified";
+    case Type::SyncRequest: return "SyncRequest";
+    case Type::CompactedChangeListResponse: return "CompactedChangeListResponse";
+    case Type::SubscribeRequest: return "SubscribeRequest";
+    case Type::SubscribeResponse: return "SubscribeResponse";
+    case Type::UploadSessionBegin: return "UploadSessionBegin";
+    case Type::UploadChunk: return "UploadChunk";
+    case Type::UploadSessionQuery: return "UploadSessionQuery";
+    case Type::UploadSessionFinish: return "UploadSessionFinish";
+    case Type::UploadSessionResponse: return "UploadSessionResponse";
+    case Type::YoutubePrefetchRequest: return "YoutubePrefetchRequest";
+    case Type::YoutubePrefetchResponse: return "YoutubePrefetchResponse";
+    case Type::DownloadRequestInternal: return "DownloadRequestInternal";
+    case Type::DownloadCancelRequest: return "DownloadCancelRequest";
+    case Type::DownloadPriorityRequest: return "DownloadPriorityRequest";
+    case Type::DownloadCancelRequestInternal: return "DownloadCancelRequestInternal";
+    case Type::DownloadPriorityRequestInternal: return "DownloadPriorityRequestInternal";
     }
     qFatal("No such Message Type");
 }
 
-Result<Message, EnjsonError> Message::fromJson(const QByteArray &message)
+template <class TYPE>
+static Result<Message, EnjsonError> createMessage(const QJsonObject &data)
 {
-    Result<QJsonObject, EnjsonError> json = jsonDeserializeObject(message);
-    if (!json.hasValue())
-        return json.takeError();
+    Result<TYPE, EnjsonError> result = ::dejson<TYPE>(data);
+    if (!result.hasValue())
+        return result.takeError();
+    return Message(new TYPE(result.takeValue()));
+}
+
+struct MessageFactory
+{
+    Type type;
+    Result<Message, EnjsonError> (*factory)(const QJsonObject &data);
+};
+
+using MessageRegistry = NameRegistry<MessageFactory>;
+
+static const MessageRegistry &messageRegistry()
+{
+    #define MESSAGE_ENTRY(TYPE) { #TYPE, { Type::TYPE, &createMessage<TYPE> } }
+
+    static const MessageRegistry s_registry {
+        MESSAGE_ENTRY(Error),
+        MESSAGE_ENTRY(Ping),
+        MESSAGE_ENTRY(Pong),
+
+        MESSAGE_ENTRY(LibraryRequest),
+        MESSAGE_ENTRY(LibraryResponse),
+
+        MESSAGE_ENTRY(MediaUrlRequest),
+        MESSAGE_ENTRY(MediaUrlResponse),
 
+        MESSAGE_ENTRY(IdRequest),
+        MESSAGE_ENTRY(IdResponse),
+
+        MESSAGE_ENTRY(ChangesRequest),
+        MESSAGE_ENTRY(ChangesResponse),
+
+        MESSAGE_ENTRY(UploadSongRequest),
+        MESSAGE_ENTRY(UploadSongRequestInternal),
+        MESSAGE_ENTRY(UploadSongResponse),
+
+        MESSAGE_ENTRY(ChangeListRequest),
+        MESSAGE_ENTRY(ChangeListResponse),
+
+        MESSAGE_ENTRY(DownloadRequest),
+        MESSAGE_ENTRY(DownloadResponse),
+        MESSAGE_ENTRY(DownloadQuery),
+        MESSAGE_ENTRY(DownloadQueryResponse),
+
+        MESSAGE_ENTRY(YoutubeUrlQuery),
+        MESSAGE_ENTRY(YoutubeUrlResponse),
+
+        MESSAGE_ENTRY(ConditionalLibraryRequest),
+        MESSAGE_ENTRY(LibraryNotModified),
+
+        MESSAGE_ENTRY(SyncRequest),
+        MESSAGE_ENTRY(CompactedChangeListResponse),
+
+        MESSAGE_ENTRY(SubscribeRequest),
+        MESSAGE_ENTRY(SubscribeResponse),
+        MESSAGE_ENTRY(UploadSessionBegin),
+        MESSAGE_ENTRY(UploadChunk),
+        MESSAGE_ENTRY(UploadSessionQuery),
+        MESSAGE_ENTRY(UploadSessionFinish),
+        MESSAGE_ENTRY(UploadSessionResponse),
+        MESSAGE_ENTRY(YoutubePrefetchRequest),
+        MESSAGE_ENTRY(YoutubePrefetchResponse),
+        MESSAGE_ENTRY(DownloadRequestInternal),
+        MESSAGE_ENTRY(DownloadCancelRequest),
+        MESSAGE_ENTRY(DownloadPriorityRequest),
+        MESSAGE_ENTRY(DownloadCancelRequestInternal),
+        MESSAGE_ENTRY(DownloadPriorityRequestInternal),
+    };
+
+    #undef MESSAGE_ENTRY
+
+    return s_registry;
+}
+
+static Result<Message, EnjsonError> messageFromJsonObject(const QJsonObject &jsonObj)
+{
     // Read ID
-    const QJsonObject jsonObj = json.takeValue();
     const auto idIt = jsonObj.find("id");
     if (idIt == jsonObj.end())
         return EnjsonError::buildMissingMemberError("id");
@@ -586,46 +823,160 @@ Result<Message, EnjsonError> Message::fromJson(const QByteArray &message)
     const QJsonObject data = dataIt->toObject();
 
     // See if we find a matching message
-    #define CHECK_MESSAGE_TYPE(TYPE) \
-    do { if (id == typeString(TYPE::MESSAGE_TYPE)) { \
-        Result<TYPE, EnjsonError> result = ::dejson<TYPE>(data); \
-        if (!result.hasValue()) \
-            return result.takeError(); \
-        return Message(new TYPE(result.takeValue())); \
-    } } while (0)
+    const MessageRegistry::Entry *entry = messageRegistry().find(id);
+    if (entry)
+        return entry->value.factory(data);
+
+    return EnjsonError::buildCustomError(QString("No such message ID: ") + id);
+}
+
+Result<Message, EnjsonError> Message::fromJson(const QByteArray &message)
+{
+    Result<QJsonObject, EnjsonError> json = jsonDeserializeObject(message);
+    if (!json.hasValue())
+        return json.takeError();
 
-    CHECK_MESSAGE_TYPE(Error);
-    CHECK_MESSAGE_TYPE(Ping);
-    CHECK_MESSAGE_TYPE(Pong);
+    return messageFromJsonObject(json.takeValue());
+}
 
-    CHECK_MESSAGE_TYPE(LibraryRequest);
-    CHECK_MESSAGE_TYPE(LibraryResponse);
+// nesting beyond this is rejected rather than risking the stack
+static constexpr int MAX_CBOR_DEPTH = 512;
 
-    CHECK_MESSAGE_TYPE(MediaUrlRequest);
-    CHECK_MESSAGE_TYPE(MediaUrlResponse);
+static bool readCborString(QCborStreamReader &reader, QString &string)
+{
+    QCborStreamReader::StringResult<QString> chunk = reader.readString();
+    while (chunk.status == QCborStreamReader::Ok) {
+        string += chunk.data;
+        chunk = reader.readString();
+    }
+    return chunk.status == QCborStreamReader::EndOfString;
+}
 
-    CHECK_MESSAGE_TYPE(IdRequest);
-    CHECK_MESSAGE_TYPE(IdResponse);
+/**
+ * Reads one CBOR item straight into the JSON tree that dejson() works on, rather than
+ * building a QCborValue tree first. Byte strings become base64url, like
+ * QCborValue::toJsonValue() does. Returns false on malformed or unsupported data.
+ */
+static bool readCbor(QCborStreamReader &reader, QJsonValue &value, int depth)
+{
+    if (depth > MAX_CBOR_DEPTH)
+        return false;
 
-    CHECK_MESSAGE_TYPE(ChangesRequest);
-    CHECK_MESSAGE_TYPE(ChangesResponse);
+    switch (reader.type()) {
+    case QCborStreamReader::UnsignedInteger:
+        value = (double) reader.toUnsignedInteger();
+        return reader.next();
+    case QCborStreamReader::NegativeInteger:
+        value = -1.0 - (double) (quint64) reader.toNegativeInteger();
+        return reader.next();
+    case QCborStreamReader::ByteArray: {
+        QByteArray bytes;
+        QCborStreamReader::StringResult<QByteArray> chunk = reader.readByteArray();
+        while (chunk.status == QCborStreamReader::Ok) {
+            bytes += chunk.data;
+            chunk = reader.readByteArray();
+        }
+        value = QString::fromLatin1(bytes.toBase64(QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals));
+        return chunk.status == QCborStreamReader::EndOfString;
+    }
+    case QCborStreamReader::String: {
+        QString string;
+        if (!readCborString(reader, string))
+            return false;
+        value = string;
+        return true;
+    }
+    case QCborStreamReader::Array: {
+        QJsonArray array;
+        if (!reader.enterContainer())
+            return false;
+        while (reader.lastError() == QCborError::NoError && reader.hasNext()) {
+            QJsonValue element;
+            if (!readCbor(reader, element, depth + 1))
+                return false;
+            array.append(element);
+        }
+        if (!reader.leaveContainer())
+            return false;
+        value = array;
+        return true;
+    }
+    case QCborStreamReader::Map: {
+        QJsonObject object;
+        if (!reader.enterContainer())
+            return false;
+        while (reader.lastError() == QCborError::NoError && reader.hasNext()) {
+            QString key;
+            QJsonValue element;
+            if (!reader.isString() || !readCborString(reader, key) || !readCbor(reader, element, depth + 1))
+                return false;
+            object.insert(key, element);
+        }
+        if (!reader.leaveContainer())
+            return false;
+        value = object;
+        return true;
+    }
+    case QCborStreamReader::Tag:
+        // tags only say how to interpret the value, which JSON can't express anyway
+        return reader.next() && readCbor(reader, value, depth);
+    case QCborStreamReader::SimpleType:
+        switch (reader.toSimpleType()) {
+        case QCborSimpleType::False: value = false; break;
+        case QCborSimpleType::True: value = true; break;
+        case QCborSimpleType::Null: value = QJsonValue(QJsonValue::Null); break;
+        default: value = QJsonValue(QJsonValue::Undefined); break;
+        }
+        return reader.next();
+    case QCborStreamReader::Float16:
+        value = (double) reader.toFloat16();
+        return reader.next();
+    case QCborStreamReader::Float:
+        value = (double) reader.toFloat();
+        return reader.next();
+    case QCborStreamReader::Double:
+        value = reader.toDouble();
+        return reader.next();
+    default:
+        return false;
+    }
+}
 
-    CHECK_MESSAGE_TYPE(UploadSongRequest);
-    CHECK_MESSAGE_TYPE(UploadSongRequestInternal);
-    CHECK_MESSAGE_TYPE(UploadSongResponse);
+Result<Message, EnjsonError> Message::fromCbor(const QByteArray &message)
+{
+    QCborStreamReader reader(message);
+    if (!reader.isMap())
+        return EnjsonError::buildCustomError("CBOR message is not a map");
 
-    CHECK_MESSAGE_TYPE(ChangeListRequest);
-    CHECK_MESSAGE_TYPE(ChangeListResponse);
+    QJsonValue json;
+    if (!readCbor(reader, json, 0)) {
+        const QCborError error = reader.lastError();
+        return EnjsonError::buildCustomError(QString("Failed to parse CBOR: ")
+                                             + ((error == QCborError::NoError) ? QString("Unsupported data") : error.toString()));
+    }
 
-    CHECK_MESSAGE_TYPE(DownloadRequest);
-    CHECK_MESSAGE_TYPE(DownloadResponse);
-    CHECK_MESSAGE_TYPE(DownloadQuery);
-    CHECK_MESSAGE_TYPE(DownloadQueryResponse);
+    return messageFromJsonObject(json.toObject());
+}
 
-    CHECK_MESSAGE_TYPE(YoutubeUrlQuery);
-    CHECK_MESSAGE_TYPE(YoutubeUrlResponse);
+WireFormat Message::detectWireFormat(const QByteArray &message)
+{
+    // CBOR maps use major type 5 (0xa0 - 0xbf), whereas a JSON document
+    // starts with whitespace or '{', which are all outside of that range
+    if (!message.isEmpty()) {
+        const quint8 first = (quint8) message[0];
+        if ((first & 0xe0) == 0xa0)
+            return WireFormat::Cbor;
+    }
+    return WireFormat::Json;
+}
 
-    return EnjsonError::buildCustomError(QString("No such message ID: ") + id);
+Result<Message, EnjsonError> Message::decode(const QByteArray &message)
+{
+    switch (detectWireFormat(message)) {
+    case WireFormat::Cbor: return fromCbor(message);
+    case WireFormat::Json: return fromJson(message);
+    }
+    return fromJson(message);
 }
 
 }
@@ -3,6 +3,7 @@
 #include "result.hpp"
 #include "jsonconv.hpp"
 #include "library_types.hpp"
+#include "option.hpp"
 
 #include <QHash>
 #include <QDataStream>
@@ -141,15 +142,35 @@ public:
 
     /**
      * Applies those changes that are from the future (i.e. the DB server).
+     * Created items get the IDs that they were assigned on the server.
      */
     void commit(const QVector<CommittedLibraryChange> &changes);
 
+    /**
+     * Applies a list created by compactChanges(), and moves on to the given revision.
+     * Returns an error if the list doesn't apply, in which case the library must be discarded.
+     */
+    Option<QString> commitCompacted(const QVector<CommittedLibraryChange> &changes, quint32 revision);
+
+    /**
+     * Rewrites a range of committed changes into a shorter list with the same outcome:
+     * only the last value of each field is kept, items that were created and removed
+     * again are left out, as are tags that were added and removed again.
+     * All entries carry the revision of the last input change.
+     */
+    static QVector<CommittedLibraryChange> compactChanges(const QVector<CommittedLibraryChange> &changes);
+
     /**
      * Retrieves all changes that have been committed since the given revision.
      * (This must not necessarily contain all changes ever made, and can be empty)
      */
     QVector<CommittedLibraryChange> committedChangesSince(quint32 revision) const;
 
+    /**
+     * Number of songs, albums, artists and tags, i.e. roughly the cost of (de)serializing the library
+     */
+    int itemCount() const;
+
     /**
      * For debugging purposes, dump into human-readable listing
      */
@@ -160,10 +181,13 @@ public:
     /**
      * Tries to read the whole library from JSON data.
      * If committedChanges is not empty, try to read a history of committed changes from this array.
+     * Changes newer than the library itself are applied on top of it.
      */
     EnjsonError deserializeFromJson(const SerializedLibrary &libraryJson, const QJsonArray &committedChanges = QJsonArray());
 
 private:
+    Result<CommittedLibraryChange, QString> commitInternal(const LibraryChangeRequest &change, quint32 createdId);
+
     void deserializeFromJsonInternal(const QJsonObject &libraryJson, const QJsonArray &committedChanges, Result<int, EnjsonError> &result);
 
     struct Song
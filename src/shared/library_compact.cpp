@@ -0,0 +1,298 @@
+#include "library.hpp"
+
+#include <QHash>
+#include <QMap>
+#include <QSet>
+
+#include <algorithm>
+#include <functional>
+
+namespace Moosick {
+
+using ChangeType = LibraryChangeRequest::Type;
+
+enum class ItemKind : quint64
+{
+    Song,
+    Album,
+    Artist,
+    Tag,
+};
+
+static quint64 itemKey(ItemKind kind, quint32 id)
+{
+    return ((quint64) kind << 32) | id;
+}
+
+namespace {
+
+/**
+ * Everything that happened to one item within the compacted range
+ */
+struct ItemHistory
+{
+    ItemKind kind = ItemKind::Song;
+    quint32 id = 0;
+
+    int createIndex = -1;
+    int removeIndex = -1;
+    LibraryChangeRequest create;
+
+    // last write per field, keyed by the change type that sets it
+    QMap<ChangeType, QPair<int, LibraryChangeRequest>> fields;
+
+    struct TagMembership
+    {
+        bool before;
+        bool after;
+        int lastIndex;
+        LibraryChangeRequest lastChange;
+    };
+    QMap<quint32, TagMembership> tags;
+
+    bool isCreated() const { return createIndex >= 0; }
+    bool isRemoved() const { return removeIndex >= 0; }
+
+    /** Created and removed again, nobody will ever know */
+    bool isTransient() const { return isCreated() && isRemoved(); }
+
+    /** Takes the last value of a field, so that it doesn't get emitted separately */
+    bool takeField(ChangeType type, LibraryChangeRequest &change)
+    {
+        const auto it = fields.find(type);
+        if (it == fields.end())
+            return false;
+        change = it->second;
+        fields.erase(it);
+        return true;
+    }
+};
+
+} // namespace
+
+static bool classify(ChangeType type, ItemKind &kind)
+{
+    switch (type) {
+    case ChangeType::SongAdd:
+    case ChangeType::SongRemove:
+    case ChangeType::SongSetName:
+    case ChangeType::SongSetPosition:
+    case ChangeType::SongSetLength:
+    case ChangeType::SongSetFileEnding:
+    case ChangeType::SongSetHandle:
+    case ChangeType::SongSetAlbum:
+    case ChangeType::SongAddTag:
+    case ChangeType::SongRemoveTag:
+        kind = ItemKind::Song;
+        return true;
+    case ChangeType::AlbumAdd:
+    case ChangeType::AlbumRemove:
+    case ChangeType::AlbumSetName:
+    case ChangeType::AlbumSetArtist:
+    case ChangeType::AlbumAddTag:
+    case ChangeType::AlbumRemoveTag:
+        kind = ItemKind::Album;
+        return true;
+    case ChangeType::ArtistAdd:
+    case ChangeType::ArtistAddOrGet:
+    case ChangeType::ArtistRemove:
+    case ChangeType::ArtistSetName:
+    case ChangeType::ArtistAddTag:
+    case ChangeType::ArtistRemoveTag:
+        kind = ItemKind::Artist;
+        return true;
+    case ChangeType::TagAdd:
+    case ChangeType::TagRemove:
+    case ChangeType::TagSetName:
+    case ChangeType::TagSetParent:
+        kind = ItemKind::Tag;
+        return true;
+    case ChangeType::Invalid:
+        break;
+    }
+    return false;
+}
+
+QVector<CommittedLibraryChange> Library::compactChanges(const QVector<CommittedLibraryChange> &changes)
+{
+    if (changes.isEmpty())
+        return {};
+
+    const quint32 revision = changes.last().committedRevision;
+
+    QHash<quint64, ItemHistory> items;
+    const auto history = [&](ItemKind kind, quint32 id) -> ItemHistory& {
+        ItemHistory &item = items[itemKey(kind, id)];
+        item.kind = kind;
+        item.id = id;
+        return item;
+    };
+
+    // 1. collect what happened to each item
+    for (int i = 0; i < changes.size(); ++i) {
+        const LibraryChangeRequest &change = changes[i].changeRequest;
+
+        ItemKind kind;
+        if (!classify(change.changeType, kind))
+            continue;
+
+        switch (change.changeType) {
+        case ChangeType::SongAdd:
+        case ChangeType::AlbumAdd:
+        case ChangeType::ArtistAdd:
+        case ChangeType::ArtistAddOrGet:
+        case ChangeType::TagAdd: {
+            ItemHistory &item = history(kind, changes[i].createdId);
+            item.createIndex = i;
+            item.create = change;
+            break;
+        }
+        case ChangeType::SongRemove:
+        case ChangeType::AlbumRemove:
+        case ChangeType::ArtistRemove:
+        case ChangeType::TagRemove: {
+            history(kind, change.targetId).removeIndex = i;
+            break;
+        }
+        case ChangeType::SongAddTag:
+        case ChangeType::SongRemoveTag:
+        case ChangeType::AlbumAddTag:
+        case ChangeType::AlbumRemoveTag:
+        case ChangeType::ArtistAddTag:
+        case ChangeType::ArtistRemoveTag: {
+            const bool add = (change.changeType == ChangeType::SongAddTag)
+                    || (change.changeType == ChangeType::AlbumAddTag)
+                    || (change.changeType == ChangeType::ArtistAddTag);
+
+            ItemHistory &item = history(kind, change.targetId);
+            auto it = item.tags.find(change.detail);
+            if (it == item.tags.end())
+                it = item.tags.insert(change.detail, ItemHistory::TagMembership{ !add, add, i, change });
+            it->after = add;
+            it->lastIndex = i;
+            it->lastChange = change;
+            break;
+        }
+        default: {
+            history(kind, change.targetId).fields[change.changeType] = qMakePair(i, change);
+            break;
+        }
+        }
+    }
+
+    const auto isTransient = [&](ItemKind kind, quint32 id) {
+        const auto it = items.find(itemKey(kind, id));
+        return (it != items.end()) && it->isTransient();
+    };
+
+    QVector<CommittedLibraryChange> ret;
+    const auto emitChange = [&](const LibraryChangeRequest &change, quint32 createdId) {
+        ret << CommittedLibraryChange{ change, revision, createdId };
+    };
+
+    // 2. create new items, directly with their final name and parent
+    QVector<ItemHistory*> created;
+    for (ItemHistory &item : items) {
+        if (item.isCreated() && !item.isRemoved())
+            created << &item;
+    }
+    std::sort(created.begin(), created.end(), [](const ItemHistory *a, const ItemHistory *b) {
+        if (a->kind != b->kind)
+            return a->kind > b->kind; // tags, artists, albums, songs
+        return a->createIndex < b->createIndex;
+    });
+
+    QSet<quint32> createdTags;
+    std::function<void(ItemHistory&)> emitCreate = [&](ItemHistory &item) {
+        LibraryChangeRequest create = item.create;
+        LibraryChangeRequest field;
+
+        switch (item.kind) {
+        case ItemKind::Song:
+            if (item.takeField(ChangeType::SongSetName, field))
+                create.name = field.name;
+            if (item.takeField(ChangeType::SongSetAlbum, field))
+                create.targetId = field.detail;
+            break;
+        case ItemKind::Album:
+            if (item.takeField(ChangeType::AlbumSetName, field))
+                create.name = field.name;
+            if (item.takeField(ChangeType::AlbumSetArtist, field))
+                create.targetId = field.detail;
+            break;
+        case ItemKind::Artist:
+            create.changeType = ChangeType::ArtistAdd;
+            if (item.takeField(ChangeType::ArtistSetName, field))
+                create.name = field.name;
+            break;
+        case ItemKind::Tag: {
+            if (createdTags.contains(item.id))
+                return;
+            createdTags << item.id;
+
+            if (item.takeField(ChangeType::TagSetName, field))
+                create.name = field.name;
+            if (item.takeField(ChangeType::TagSetParent, field))
+                create.targetId = field.detail;
+
+            // new parents need to exist before their children
+            const auto parentIt = items.find(itemKey(ItemKind::Tag, create.targetId));
+            if (create.targetId && parentIt != items.end() && parentIt->isCreated() && !parentIt->isRemoved())
+                emitCreate(*parentIt);
+            break;
+        }
+        }
+
+        emitChange(create, item.id);
+    };
+    for (ItemHistory *item : qAsConst(created))
+        emitCreate(*item);
+
+    // 3. last write of every remaining field, and tag membership that actually changed,
+    //    in the order in which they were made
+    QVector<QPair<int, LibraryChangeRequest>> updates;
+    for (const ItemHistory &item : qAsConst(items)) {
+        if (item.isRemoved())
+            continue;
+
+        for (const auto &field : item.fields)
+            updates << field;
+
+        for (auto it = item.tags.begin(); it != item.tags.end(); ++it) {
+            if (it->before != it->after && !isTransient(ItemKind::Tag, it.key()))
+                updates << qMakePair(it->lastIndex, it->lastChange);
+        }
+    }
+
+    // tags need to come off of items before those are removed
+    QVector<ItemHistory*> removed;
+    for (ItemHistory &item : items) {
+        if (!item.isRemoved() || item.isCreated())
+            continue;
+
+        removed << &item;
+        for (auto it = item.tags.begin(); it != item.tags.end(); ++it) {
+            if (it->before && !isTransient(ItemKind::Tag, it.key()))
+                updates << qMakePair(it->lastIndex, it->lastChange);
+        }
+    }
+
+    std::sort(updates.begin(), updates.end(), [](const QPair<int, LibraryChangeRequest> &a, const QPair<int, LibraryChangeRequest> &b) {
+        return a.first < b.first;
+    });
+    for (const auto &update : qAsConst(updates))
+        emitChange(update.second, 0);
+
+    // 4. remove items that existed before, contents before their containers
+    std::sort(removed.begin(), removed.end(), [](const ItemHistory *a, const ItemHistory *b) {
+        if (a->kind != b->kind)
+            return a->kind < b->kind; // songs, albums, artists, tags
+        return a->removeIndex < b->removeIndex;
+    });
+    for (const ItemHistory *item : qAsConst(removed))
+        emitChange(changes[item->removeIndex].changeRequest, 0);
+
+    return ret;
+}
+
+} // namespace Moosick
@@ -45,10 +45,55 @@ enum class Type : quint32
     /** Request youtube video details to be queried by youtube-dl */
     YoutubeUrlQuery,
     YoutubeUrlResponse,
+
+    /** Retrieve the library, unless the client's copy is still up to date */
+    ConditionalLibraryRequest,
+    LibraryNotModified,
+
+    /** Bring a library at revision N up to date, answered with either a change list or a LibraryResponse */
+    SyncRequest,
+    CompactedChangeListResponse,
+
+    /** Wait until the library or the set of running downloads changes, return what changed */
+    SubscribeRequest,
+    SubscribeResponse,
+
+    /** Resumable uploads: begin a session, send chunks in any order, then finish it */
+    UploadSessionBegin,
+    UploadChunk,
+    UploadSessionQuery,
+    UploadSessionFinish,
+    UploadSessionResponse,
+
+    /** Resolve audio URLs of videos in the background, before anyone asks for them */
+    YoutubePrefetchRequest,
+    YoutubePrefetchResponse,
+
+    /** Scheduling of downloads: DownloadRequest as forwarded by the CGI, cancelling, reordering */
+    DownloadRequestInternal,
+    DownloadCancelRequest,
+    DownloadPriorityRequest,
+
+    /** Cancelling and reordering as forwarded by the CGI, which tells whose request it is */
+    DownloadCancelRequestInternal,
+    DownloadPriorityRequestInternal,
 };
 
 QString typeString(Type messageType);
 
+/**
+ * Encodings that a message can be transported with.
+ * JSON is always understood, CBOR is the compact binary alternative.
+ */
+enum class WireFormat
+{
+    Json,
+    Cbor,
+};
+
+QByteArray wireFormatMimeType(WireFormat format);
+WireFormat wireFormatFromMimeTypes(const QByteArray &acceptHeader);
+
 enum class DownloadRequestType
 {
     BandcampAlbum,
@@ -56,10 +101,21 @@ enum class DownloadRequestType
     YoutubePlaylist,
 };
 
+/** What a download is busy with */
+enum class DownloadPhase
+{
+    Queued,
+    Resolving,
+    Downloading,
+    Splitting,
+    Committing,
+};
+
 } // namespace MoosickMessage
 
 // needs to be declared outside of namespace
 ENJSON_DECLARE_ALIAS(MoosickMessage::DownloadRequestType, quint32)
+ENJSON_DECLARE_ALIAS(MoosickMessage::DownloadPhase, quint32)
 
 namespace MoosickMessage {
 
@@ -108,6 +164,19 @@ struct LibraryResponse : public MessageBase
     ENJSON_MEMBER(QJsonObject, libraryJson);
 };
 
+struct ConditionalLibraryRequest : public MessageBase
+{
+    DEFINE_MESSAGE_TYPE(ConditionalLibraryRequest)
+    ENJSON_MEMBER(QString, libraryId);
+    ENJSON_MEMBER(quint32, revision);
+};
+
+struct LibraryNotModified : public MessageBase
+{
+    DEFINE_MESSAGE_TYPE(LibraryNotModified)
+    ENJSON_MEMBER(quint32, revision);
+};
+
 struct MediaUrlRequest : public MessageBase
 {
     DEFINE_MESSAGE_TYPE(MediaUrlRequest)
@@ -166,6 +235,9 @@ struct UploadSongRequestInternal : public MessageBase
     ENJSON_MEMBER(int, duration);
     ENJSON_MEMBER(QString, filePath);
     ENJSON_MEMBER(QString, fileEnding);
+
+    /** Hex, computed by the CGI while receiving the file, so that dbserver doesn't have to read it again */
+    ENJSON_MEMBER(QString, sha256);
 };
 
 struct UploadSongResponse : public MessageBase
@@ -174,12 +246,75 @@ struct UploadSongResponse : public MessageBase
     ENJSON_MEMBER(quint32, songId);
 };
 
+struct UploadSessionBegin : public MessageBase
+{
+    DEFINE_MESSAGE_TYPE(UploadSessionBegin)
+    ENJSON_MEMBER(QString, artistName);
+    ENJSON_MEMBER(QString, albumName);
+    ENJSON_MEMBER(QString, title);
+    ENJSON_MEMBER(int, position);
+    ENJSON_MEMBER(int, duration);
+    ENJSON_MEMBER(qint64, fileSize);
+    ENJSON_MEMBER(QString, fileEnding);
+};
+
+/** Sent via message64= query, with the chunk data as POST data */
+struct UploadChunk : public MessageBase
+{
+    DEFINE_MESSAGE_TYPE(UploadChunk)
+    ENJSON_MEMBER(QString, sessionId);
+    ENJSON_MEMBER(qint64, offset);
+};
+
+struct UploadSessionQuery : public MessageBase
+{
+    DEFINE_MESSAGE_TYPE(UploadSessionQuery)
+    ENJSON_MEMBER(QString, sessionId);
+};
+
+/** Answered with an UploadSongResponse once the file is complete and matches the hex encoded SHA-256 */
+struct UploadSessionFinish : public MessageBase
+{
+    DEFINE_MESSAGE_TYPE(UploadSessionFinish)
+    ENJSON_MEMBER(QString, sessionId);
+    ENJSON_MEMBER(QString, sha256);
+};
+
+struct UploadSessionResponse : public MessageBase
+{
+    DEFINE_MESSAGE_TYPE(UploadSessionResponse)
+    ENJSON_MEMBER(QString, sessionId);
+    ENJSON_MEMBER(qint64, fileSize);
+
+    /** Offset and length of the data that has arrived so far, sorted and merged */
+    using Range = QPair<qint64, qint64>;
+    ENJSON_MEMBER(QVector<Range>, receivedRanges);
+};
+
 struct ChangeListRequest : public MessageBase
 {
     DEFINE_MESSAGE_TYPE(ChangeListRequest)
     ENJSON_MEMBER(quint32, revision);
 };
 
+struct SyncRequest : public MessageBase
+{
+    DEFINE_MESSAGE_TYPE(SyncRequest)
+    ENJSON_MEMBER(quint32, revision);
+};
+
+/**
+ * Result of Library::compactChanges(), to be applied with Library::commitCompacted().
+ * Brings a library from fromRevision straight to toRevision.
+ */
+struct CompactedChangeListResponse : public MessageBase
+{
+    DEFINE_MESSAGE_TYPE(CompactedChangeListResponse)
+    ENJSON_MEMBER(quint32, fromRevision);
+    ENJSON_MEMBER(quint32, toRevision);
+    ENJSON_MEMBER(QVector<Moosick::CommittedLibraryChange>, changes);
+};
+
 struct ChangeListResponse : public MessageBase
 {
     DEFINE_MESSAGE_TYPE(ChangeListResponse)
@@ -208,11 +343,100 @@ struct DownloadQuery : public MessageBase
     DEFINE_MESSAGE_TYPE(DownloadQuery)
 };
 
+/** DownloadRequest, along with who sent it, as the CGI forwards it to dbserver */
+struct DownloadRequestInternal : public MessageBase
+{
+    DEFINE_MESSAGE_TYPE(DownloadRequestInternal)
+    ENJSON_MEMBER(DownloadRequest, request);
+    ENJSON_MEMBER(QString, client);
+    ENJSON_MEMBER(qint32, priority);
+};
+
+/** Answered with a DownloadQueryResponse */
+struct DownloadCancelRequest : public MessageBase
+{
+    DEFINE_MESSAGE_TYPE(DownloadCancelRequest)
+    ENJSON_MEMBER(quint32, downloadId);
+};
+
+/** Downloads with higher priority start first. Answered with a DownloadQueryResponse */
+struct DownloadPriorityRequest : public MessageBase
+{
+    DEFINE_MESSAGE_TYPE(DownloadPriorityRequest)
+    ENJSON_MEMBER(quint32, downloadId);
+    ENJSON_MEMBER(qint32, priority);
+};
+
+/** Only the client that requested a download may cancel it */
+struct DownloadCancelRequestInternal : public MessageBase
+{
+    DEFINE_MESSAGE_TYPE(DownloadCancelRequestInternal)
+    ENJSON_MEMBER(DownloadCancelRequest, request);
+    ENJSON_MEMBER(QString, client);
+};
+
+/** Only the client that requested a download may change its priority */
+struct DownloadPriorityRequestInternal : public MessageBase
+{
+    DEFINE_MESSAGE_TYPE(DownloadPriorityRequestInternal)
+    ENJSON_MEMBER(DownloadPriorityRequest, request);
+    ENJSON_MEMBER(QString, client);
+};
+
+struct DownloadStatus
+{
+    ENJSON_OBJECT(DownloadStatus)
+    ENJSON_MEMBER(quint32, downloadId);
+    ENJSON_MEMBER(bool, running);
+
+    /** 1 for the download that starts next, 0 for running ones */
+    ENJSON_MEMBER(quint32, queuePosition);
+    ENJSON_MEMBER(qint32, priority);
+
+    ENJSON_MEMBER(DownloadPhase, phase);
+    ENJSON_MEMBER(quint32, tracksTotal);
+    ENJSON_MEMBER(quint32, tracksDone);
+    ENJSON_MEMBER(qint64, bytesReceived);
+
+    /** Estimated from the tracks done so far, -1 if there is no estimate yet */
+    ENJSON_MEMBER(qint32, etaSecs);
+
+    /** Seconds since the download last made progress, to tell stuck downloads */
+    ENJSON_MEMBER(quint32, idleSecs);
+};
+
 struct DownloadQueryResponse : public MessageBase
 {
     DEFINE_MESSAGE_TYPE(DownloadQueryResponse)
     using ActiveDownload = QPair<quint32, DownloadRequest>;
     ENJSON_MEMBER(QVector<ActiveDownload>, activeRequests);
+    ENJSON_MEMBER(QVector<DownloadStatus>, status);
+};
+
+/**
+ * Long poll: the server holds on to the request until its state differs from the
+ * given one, or until timeoutSecs have passed, whichever comes first.
+ */
+struct SubscribeRequest : public MessageBase
+{
+    DEFINE_MESSAGE_TYPE(SubscribeRequest)
+    ENJSON_MEMBER(quint32, revision);
+    ENJSON_MEMBER(quint32, downloadsVersion);
+    ENJSON_MEMBER(quint32, timeoutSecs);
+};
+
+struct SubscribeResponse : public MessageBase
+{
+    DEFINE_MESSAGE_TYPE(SubscribeResponse)
+    ENJSON_MEMBER(quint32, revision);
+    ENJSON_MEMBER(quint32, downloadsVersion);
+
+    /** Changes since the requested revision, unless there are too many to make sense */
+    ENJSON_MEMBER(QVector<Moosick::CommittedLibraryChange>, changes);
+    ENJSON_MEMBER(bool, fullSyncRequired);
+
+    ENJSON_MEMBER(QVector<DownloadQueryResponse::ActiveDownload>, activeRequests);
+    ENJSON_MEMBER(QVector<DownloadStatus>, downloadStatus);
 };
 
 struct YoutubeUrlQuery : public MessageBase
@@ -230,6 +454,20 @@ struct YoutubeUrlResponse : public MessageBase
     ENJSON_MEMBER(QString, url)
 };
 
+struct YoutubePrefetchRequest : public MessageBase
+{
+    DEFINE_MESSAGE_TYPE(YoutubePrefetchRequest)
+    ENJSON_MEMBER(QVector<QString>, videoIds)
+};
+
+struct YoutubePrefetchResponse : public MessageBase
+{
+    YoutubePrefetchResponse() = default;
+    YoutubePrefetchResponse(int q) { queued = q; }
+    DEFINE_MESSAGE_TYPE(YoutubePrefetchResponse)
+    ENJSON_MEMBER(int, queued)
+};
+
 #undef DEFINE_MESSAGE_TYPE
 
 class Message
@@ -263,23 +501,36 @@ public:
     const MessageBase *operator->() const { return m_msg.data(); }
 
     QByteArray toJson()  const;
+    QByteArray toCbor() const;
+    QByteArray encode(WireFormat format) const;
+
     static Result<Message, EnjsonError> fromJson(const QByteArray &message);
+    static Result<Message, EnjsonError> fromCbor(const QByteArray &message);
+
+    /**
+     * Looks at the first byte to tell JSON and CBOR apart, and decodes accordingly
+     */
+    static Result<Message, EnjsonError> decode(const QByteArray &message);
+    static WireFormat detectWireFormat(const QByteArray &message);
 
     template <class T>
     static Result<T, EnjsonError> fromJsonAs(const QByteArray &message);
+    template <class T>
+    static Result<T, EnjsonError> decodeAs(const QByteArray &message);
 
 private:
     QScopedPointer<MessageBase> m_msg;
 };
 
 QByteArray messageToJson(const MessageBase &message);
+QByteArray messageToCbor(const MessageBase &message);
+QByteArray encodeMessage(const MessageBase &message, WireFormat format);
 
 template <class T>
-Result<T, EnjsonError> Message::fromJsonAs(const QByteArray &message)
+Result<T, EnjsonError> messageAs(Result<Message, EnjsonError> &&error)
 {
     Result<T, EnjsonError> ret;
 
-    Result<Message, EnjsonError> error = Message::fromJson(message);
     if (error.hasError()) {
         ret.setError(error.takeError());
     }
@@ -296,4 +547,16 @@ Result<T, EnjsonError> Message::fromJsonAs(const QByteArray &message)
     return ret;
 }
 
+template <class T>
+Result<T, EnjsonError> Message::fromJsonAs(const QByteArray &message)
+{
+    return messageAs<T>(Message::fromJson(message));
+}
+
+template <class T>
+Result<T, EnjsonError> Message::decodeAs(const QByteArray &message)
+{
+    return messageAs<T>(Message::decode(message));
+}
+
 } //namespace MoosickMessage
@@ -1,5 +1,6 @@
 #include "library.hpp"
 #include "jsonconv.hpp"
+#include "nameregistry.hpp"
 
 #include <QDebug>
 #include <QRandomGenerator>
@@ -45,35 +46,42 @@ QString LibraryChangeRequest::typeToStr(LibraryChangeRequest::Type tp)
 
 bool LibraryChangeRequest::typeFromStr(const QString &str, LibraryChangeRequest::Type &tp)
 {
-#define HANDLE_CASE(TYPE) if (str == #TYPE) { tp = TYPE; return true; }
-    HANDLE_CASE(SongAdd)
-    HANDLE_CASE(SongRemove)
-    HANDLE_CASE(SongSetName)
-    HANDLE_CASE(SongSetPosition)
-    HANDLE_CASE(SongSetLength)
-    HANDLE_CASE(SongSetFileEnding)
-    HANDLE_CASE(SongSetHandle)
-    HANDLE_CASE(SongSetAlbum)
-    HANDLE_CASE(SongAddTag)
-    HANDLE_CASE(SongRemoveTag)
-    HANDLE_CASE(AlbumAdd)
-    HANDLE_CASE(AlbumRemove)
-    HANDLE_CASE(AlbumSetName)
-    HANDLE_CASE(AlbumSetArtist)
-    HANDLE_CASE(AlbumAddTag)
-    HANDLE_CASE(AlbumRemoveTag)
-    HANDLE_CASE(ArtistAdd)
-    HANDLE_CASE(ArtistAddOrGet)
-    HANDLE_CASE(ArtistRemove)
-    HANDLE_CASE(ArtistSetName)
-    HANDLE_CASE(ArtistAddTag)
-    HANDLE_CASE(ArtistRemoveTag)
-    HANDLE_CASE(TagAdd)
-    HANDLE_CASE(TagRemove)
-    HANDLE_CASE(TagSetName)
-    HANDLE_CASE(TagSetParent)
+#define HANDLE_CASE(TYPE) { #TYPE, TYPE },
+    static const NameRegistry<Type> s_registry {
+        HANDLE_CASE(SongAdd)
+        HANDLE_CASE(SongRemove)
+        HANDLE_CASE(SongSetName)
+        HANDLE_CASE(SongSetPosition)
+        HANDLE_CASE(SongSetLength)
+        HANDLE_CASE(SongSetFileEnding)
+        HANDLE_CASE(SongSetHandle)
+        HANDLE_CASE(SongSetAlbum)
+        HANDLE_CASE(SongAddTag)
+        HANDLE_CASE(SongRemoveTag)
+        HANDLE_CASE(AlbumAdd)
+        HANDLE_CASE(AlbumRemove)
+        HANDLE_CASE(AlbumSetName)
+        HANDLE_CASE(AlbumSetArtist)
+        HANDLE_CASE(AlbumAddTag)
+        HANDLE_CASE(AlbumRemoveTag)
+        HANDLE_CASE(ArtistAdd)
+        HANDLE_CASE(ArtistAddOrGet)
+        HANDLE_CASE(ArtistRemove)
+        HANDLE_CASE(ArtistSetName)
+        HANDLE_CASE(ArtistAddTag)
+        HANDLE_CASE(ArtistRemoveTag)
+        HANDLE_CASE(TagAdd)
+        HANDLE_CASE(TagRemove)
+        HANDLE_CASE(TagSetName)
+        HANDLE_CASE(TagSetParent)
+    };
 #undef HANDLE_CASE
-    return false;
+
+    const NameRegistry<Type>::Entry *entry = s_registry.find(str);
+    if (!entry)
+        return false;
+    tp = entry->value;
+    return true;
 }
 
 QJsonValue enjson(const Moosick::LibraryChangeRequest &change)
@@ -340,7 +348,16 @@ void Library::deserializeFromJsonInternal(const QJsonObject &libraryJson, const
     m_albums = albums;
     m_songs = songs;
     m_fileEndings = fileEndings;
-    m_committedChanges = changes.takeValue();
+
+    // the log may be ahead of the library, if the library wasn't saved after the last changes
+    QVector<CommittedLibraryChange> pendingChanges;
+    m_committedChanges.clear();
+    for (const CommittedLibraryChange &change : changes.getValue()) {
+        if (change.committedRevision <= revision)
+            m_committedChanges << change;
+        else
+            pendingChanges << change;
+    }
 
     #define TAG_PUSH_ID(TAG, MEMBER, ID) do { \
         Library::Tag *tag = tags.findItem(TAG); \
@@ -377,6 +394,19 @@ void Library::deserializeFromJsonInternal(const QJsonObject &libraryJson, const
     #undef TAG_PUSH_IDS
     #undef TAG_PUSH_ID
 
+    for (const CommittedLibraryChange &change : qAsConst(pendingChanges)) {
+        if (change.committedRevision != m_revision + 1) {
+            result = EnjsonError::buildCustomError(QString("Log skips from revision %1 to %2").arg(m_revision).arg(change.committedRevision));
+            return;
+        }
+
+        Result<CommittedLibraryChange, QString> committed = commitInternal(change.changeRequest, change.createdId);
+        if (committed.hasError()) {
+            result = EnjsonError::buildCustomError(QString("Can't replay revision %1: %2").arg(change.committedRevision).arg(committed.getError()));
+            return;
+        }
+    }
+
     result = 0;
 }
 
@@ -162,11 +162,19 @@ public:
         return (it != this->end()) ? (&it.value()) : nullptr;
     }
 
-    QPair<IntType, T*> create()
+    /**
+     * Creates an item with the next free ID, or with the given one, e.g. when
+     * replaying changes whose IDs have been assigned elsewhere already.
+     */
+    QPair<IntType, T*> create(IntType id = 0)
     {
-        const auto it = this->insert(m_nextId, T());
-        m_nextId += 1;
-        return qMakePair(m_nextId - 1, &it.value());
+        if (id == 0)
+            id = m_nextId;
+        Q_ASSERT(!this->contains(id));
+
+        const auto it = this->insert(id, T());
+        m_nextId = qMax(m_nextId, id + 1);
+        return qMakePair(id, &it.value());
     }
 
     template <class IntLike>
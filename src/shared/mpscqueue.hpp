@@ -0,0 +1,62 @@
+#pragma once
+
+#include <QAtomicPointer>
+#include <QVector>
+
+#include <algorithm>
+
+/**
+ * Unbounded queue for any number of producers and a single consumer, without locks.
+ *
+ * Producers push onto a linked stack with compare-and-swap. The consumer takes the whole
+ * stack in one atomic exchange and reverses it, so items come out in the order they were
+ * pushed. Since nodes are never taken one by one, there is no ABA problem to worry about.
+ */
+template <class T>
+class MpscQueue
+{
+public:
+    MpscQueue() = default;
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    ~MpscQueue()
+    {
+        takeAll();
+    }
+
+    /** Returns whether the queue was empty, in which case the consumer may need a nudge */
+    bool push(const T &value)
+    {
+        Node *node = new Node{ value, nullptr };
+        Node *head = m_head.loadAcquire();
+        do {
+            node->next = head;
+        } while (!m_head.testAndSetOrdered(head, node, head));
+        return node->next == nullptr;
+    }
+
+    /** Consumer only */
+    QVector<T> takeAll()
+    {
+        QVector<T> ret;
+        Node *node = m_head.fetchAndStoreOrdered(nullptr);
+        while (node) {
+            Node *next = node->next;
+            ret << std::move(node->value);
+            delete node;
+            node = next;
+        }
+        std::reverse(ret.begin(), ret.end());
+        return ret;
+    }
+
+private:
+    struct Node
+    {
+        T value;
+        Node *next;
+    };
+
+    QAtomicPointer<Node> m_head;
+};
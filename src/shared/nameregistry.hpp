@@ -0,0 +1,112 @@
+#pragma once
+
+#include <QString>
+#include <QVector>
+
+#include <initializer_list>
+
+/**
+ * Maps a fixed set of names to values, e.g. type names read from JSON to enum values.
+ *
+ * The set of entries is known up front, so on construction we search for a hash seed
+ * under which no two names share a slot. Lookups then hash the name once and do a
+ * single string comparison, instead of comparing against every known name in turn.
+ */
+template <class Value>
+class NameRegistry
+{
+public:
+    struct Entry
+    {
+        const char *name;
+        Value value;
+    };
+
+    NameRegistry(std::initializer_list<Entry> entries);
+
+    const Entry *find(const QString &name) const;
+
+    int size() const { return m_entries.size(); }
+
+private:
+    static quint32 hash(const QChar *chars, int length, quint32 seed);
+    static quint32 hash(const char *chars, quint32 seed);
+
+    bool tryBuild(quint32 seed);
+
+    QVector<Entry> m_entries;
+    QVector<int> m_slots;
+    quint32 m_mask = 0;
+    quint32 m_seed = 0;
+};
+
+template <class Value>
+NameRegistry<Value>::NameRegistry(std::initializer_list<Entry> entries)
+    : m_entries(entries)
+{
+    // use a table with at least twice as many slots as entries, this keeps the seed search short
+    quint32 slotCount = 1;
+    while (slotCount < 2 * (quint32) m_entries.size())
+        slotCount *= 2;
+    m_mask = slotCount - 1;
+
+    quint32 seed = 0x811c9dc5;
+    int attempts = 0;
+    while (!tryBuild(seed)) {
+        seed = seed * 0x01000193 + 1;
+
+        // if there is no perfect seed for this table size in sight, try a bigger one
+        if (++attempts == 100000) {
+            attempts = 0;
+            slotCount *= 2;
+            m_mask = slotCount - 1;
+        }
+    }
+}
+
+template <class Value>
+bool NameRegistry<Value>::tryBuild(quint32 seed)
+{
+    m_slots.fill(-1, m_mask + 1);
+    for (int i = 0; i < m_entries.size(); ++i) {
+        int &slot = m_slots[hash(m_entries[i].name, seed) & m_mask];
+        if (slot >= 0)
+            return false;
+        slot = i;
+    }
+    m_seed = seed;
+    return true;
+}
+
+template <class Value>
+const typename NameRegistry<Value>::Entry *NameRegistry<Value>::find(const QString &name) const
+{
+    const int slot = m_slots[hash(name.constData(), name.size(), m_seed) & m_mask];
+    if (slot < 0)
+        return nullptr;
+
+    const Entry &entry = m_entries[slot];
+    return (name == QLatin1String(entry.name)) ? &entry : nullptr;
+}
+
+template <class Value>
+quint32 NameRegistry<Value>::hash(const QChar *chars, int length, quint32 seed)
+{
+    quint32 h = seed;
+    for (int i = 0; i < length; ++i) {
+        h ^= chars[i].unicode();
+        h *= 0x01000193;
+    }
+    return h ^ (h >> 15);
+}
+
+template <class Value>
+quint32 NameRegistry<Value>::hash(const char *chars, quint32 seed)
+{
+    quint32 h = seed;
+    for (; *chars; ++chars) {
+        h ^= (quint8) *chars;
+        h *= 0x01000193;
+    }
+    return h ^ (h >> 15);
+}
@@ -0,0 +1,253 @@
+#include "processrunner.hpp"
+
+#include <QProcess>
+#include <QTimer>
+#include <QFileInfo>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QThread>
+#include <QMutex>
+#include <QQueue>
+#include <QDebug>
+
+using namespace ProcessRunner;
+
+// how often running and waiting processes are checked for timeouts and cancellation
+static constexpr int POLL_INTERVAL_MSECS = 250;
+static constexpr int MAX_STDERR_SIZE = 4 * 1024;
+
+namespace {
+
+class Limiter;
+
+struct Job
+{
+    QString program;
+    QStringList args;
+    Options options;
+    Callback callback;
+
+    /** Lives in the thread that called start(), and so do all the signals of the job */
+    QProcess *process = nullptr;
+    QTimer *pollTimer = nullptr;
+
+    /** The limiter of the job's lane */
+    Limiter *limiter = nullptr;
+
+    /** Starts once it's the job's turn */
+    QElapsedTimer runTime;
+    bool hasSlot = false;
+
+    /** Why the process was killed */
+    QString failure;
+
+    QByteArray partialLine;
+    Output output;
+};
+
+/**
+ * Hands out the slots for running processes. Whoever frees a slot passes it on to the
+ * next waiting job, whose process is then started in its own thread.
+ */
+class Limiter
+{
+public:
+    Limiter(int maxRunning) : m_maxRunning(maxRunning) {}
+
+    void acquire(Job *job);
+    void release();
+
+    /** Returns false if the job isn't waiting (anymore) */
+    bool remove(Job *job);
+
+private:
+    QMutex m_mutex;
+    const int m_maxRunning;
+    int m_running = 0;
+    QQueue<Job*> m_waiting;
+};
+
+} // namespace
+
+static Limiter *limiter(Lane lane)
+{
+    static Limiter s_interactive(qMax(2, QThread::idealThreadCount()));
+    static Limiter s_background(qMax(2, QThread::idealThreadCount()));
+    return (lane == Lane::Background) ? &s_background : &s_interactive;
+}
+
+static void launch(Job *job);
+
+void Limiter::acquire(Job *job)
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_running >= m_maxRunning) {
+        m_waiting.enqueue(job);
+        return;
+    }
+
+    m_running += 1;
+    job->hasSlot = true;
+    locker.unlock();
+    launch(job);
+}
+
+void Limiter::release()
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_waiting.isEmpty()) {
+        m_running -= 1;
+        return;
+    }
+
+    Job *next = m_waiting.dequeue();
+    next->hasSlot = true;
+    locker.unlock();
+    QMetaObject::invokeMethod(next->process, [next]() { launch(next); }, Qt::QueuedConnection);
+}
+
+bool Limiter::remove(Job *job)
+{
+    QMutexLocker locker(&m_mutex);
+    return m_waiting.removeOne(job);
+}
+
+static void finish(Job *job, const Result<Output, QString> &result)
+{
+    job->pollTimer->stop();
+    job->process->disconnect();
+    job->process->deleteLater();
+    if (job->hasSlot)
+        job->limiter->release();
+
+    const Callback callback = job->callback;
+    delete job;
+    callback(result);
+}
+
+static void readOutput(Job *job)
+{
+    const QByteArray data = job->process->readAllStandardOutput();
+    if (!job->options.onLine) {
+        job->output.out += data;
+        return;
+    }
+
+    job->partialLine += data;
+    int end;
+    while ((end = job->partialLine.indexOf('\n')) >= 0) {
+        QByteArray line = job->partialLine.left(end);
+        job->partialLine.remove(0, end + 1);
+        if (line.endsWith('\r'))
+            line.chop(1);
+        job->options.onLine(line);
+    }
+}
+
+static void readError(Job *job)
+{
+    job->output.err += job->process->readAllStandardError();
+    if (job->output.err.size() > MAX_STDERR_SIZE)
+        job->output.err.remove(0, job->output.err.size() - MAX_STDERR_SIZE);
+}
+
+static void onFinished(Job *job, int exitCode, QProcess::ExitStatus exitStatus)
+{
+    readOutput(job);
+    readError(job);
+    if (job->options.onLine && !job->partialLine.isEmpty())
+        job->options.onLine(job->partialLine);
+
+    if (!job->failure.isEmpty())
+        return finish(job, job->failure);
+
+    const QString program = QFileInfo(job->program).fileName();
+    const QString err = QString::fromUtf8(job->output.err).trimmed();
+    if (exitStatus != QProcess::NormalExit)
+        return finish(job, program + " crashed: " + err);
+    if (exitCode != 0)
+        return finish(job, program + " exited with code " + QString::number(exitCode) + ": " + err);
+
+    job->output.exitCode = exitCode;
+    finish(job, job->output);
+}
+
+static void launch(Job *job)
+{
+    if (job->options.cancelled && job->options.cancelled->loadAcquire())
+        return finish(job, QString("Cancelled"));
+
+    QProcess *process = job->process;
+    QObject::connect(process, &QProcess::readyReadStandardOutput, [job]() { readOutput(job); });
+    QObject::connect(process, &QProcess::readyReadStandardError, [job]() { readError(job); });
+    QObject::connect(process, QOverload<int, QProcess::ExitStatus>::of(&QProcess::finished), [job](int exitCode, QProcess::ExitStatus exitStatus) {
+        onFinished(job, exitCode, exitStatus);
+    });
+    QObject::connect(process, &QProcess::errorOccurred, [job](QProcess::ProcessError error) {
+        if (error == QProcess::FailedToStart)
+            finish(job, job->program + " failed to start");
+    });
+
+    job->runTime.start();
+    process->start(job->program, job->args);
+    process->closeWriteChannel();
+}
+
+static void poll(Job *job)
+{
+    const bool cancelled = job->options.cancelled && job->options.cancelled->loadAcquire();
+
+    // still waiting for a slot, or about to be launched by whoever freed one
+    if (!job->runTime.isValid()) {
+        if (cancelled && job->limiter->remove(job))
+            finish(job, QString("Cancelled"));
+        return;
+    }
+
+    if (!job->failure.isEmpty())
+        return;
+
+    if (cancelled)
+        job->failure = "Cancelled";
+    else if (job->options.timeoutMsecs > 0 && job->runTime.hasExpired(job->options.timeoutMsecs))
+        job->failure = QFileInfo(job->program).fileName() + " timed out";
+
+    if (!job->failure.isEmpty()) {
+        qWarning() << "Killing" << job->program << job->args << "-" << job->failure;
+        job->process->kill();
+    }
+}
+
+void ProcessRunner::start(const QString &program, const QStringList &args, const Options &options, const Callback &callback)
+{
+    Job *job = new Job();
+    job->program = program;
+    job->args = args;
+    job->options = options;
+    job->callback = callback;
+    job->limiter = limiter(options.lane);
+    job->process = new QProcess();
+
+    job->pollTimer = new QTimer(job->process);
+    job->pollTimer->setInterval(POLL_INTERVAL_MSECS);
+    QObject::connect(job->pollTimer, &QTimer::timeout, [job]() { poll(job); });
+    job->pollTimer->start();
+
+    job->limiter->acquire(job);
+}
+
+Result<Output, QString> ProcessRunner::run(const QString &program, const QStringList &args, const Options &options)
+{
+    Result<Output, QString> ret;
+    QEventLoop loop;
+    start(program, args, options, [&](const Result<Output, QString> &result) {
+        ret = result;
+        loop.quit();
+    });
+
+    // the callback may have been called right away, e.g. when cancelled already
+    if (ret.isNull())
+        loop.exec();
+
+    return ret;
+}
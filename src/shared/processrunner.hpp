@@ -0,0 +1,70 @@
+#pragma once
+
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QAtomicInt>
+
+#include <functional>
+
+#include "result.hpp"
+
+/**
+ * Runs external tools like youtube-dl and ffmpeg without blocking the event loop.
+ *
+ * Only a few processes run at once across all threads, the others wait for their turn.
+ * Quick lookups that somebody waits for and long running jobs like downloads are limited
+ * separately, so that a few downloads can't hold up everything else. Processes are killed when they take too long or when the caller cancels them. Stdout
+ * can be handed over line by line while the process runs, e.g. for parsing progress,
+ * in which case it isn't collected.
+ */
+namespace ProcessRunner {
+
+struct Output
+{
+    int exitCode = 0;
+
+    /** Empty when lines are handed to onLine instead */
+    QByteArray out;
+
+    /** Only the last few KiB, which is what ends up in logs anyway */
+    QByteArray err;
+};
+
+/** Which limit a process counts against */
+enum class Lane
+{
+    /** Somebody is waiting for the result, e.g. for playing something */
+    Interactive,
+    /** Downloads, backups and the like, which may take hours */
+    Background,
+};
+
+using LineCallback = std::function<void(const QByteArray &line)>;
+using Callback = std::function<void(const Result<Output, QString> &result)>;
+
+struct Options
+{
+    int timeoutMsecs = 120000;
+    Lane lane = Lane::Interactive;
+
+    /** Kills the process once set, or drops it while it still waits for its turn */
+    const QAtomicInt *cancelled = nullptr;
+
+    /** Gets every line of stdout without its line ending, as soon as it is complete */
+    LineCallback onLine;
+};
+
+/**
+ * Starts the process as soon as it's its turn. The callback is called from the event
+ * loop of the calling thread, with an error when the process failed to start, crashed,
+ * timed out, was cancelled or exited with a non-zero code.
+ */
+void start(const QString &program, const QStringList &args, const Options &options, const Callback &callback);
+
+/**
+ * Like start(), but waits for the result in a local event loop, for worker threads
+ */
+Result<Output, QString> run(const QString &program, const QStringList &args, const Options &options = Options());
+
+} // namespace ProcessRunner
@@ -1,6 +1,7 @@
 #include "serversettings.hpp"
 
 #include <QDebug>
+#include <QThread>
 
 template <class T, class SettingsClass>
 T convert(const SettingsClass &v, bool &valid) { Q_UNUSED(valid); return v; }
@@ -40,6 +41,17 @@ static T getOrCreate(QSettings &settings, bool &valid, const char *name)
     return convert<T, SettingsClass>(ret, valid);
 }
 
+/**
+ * For settings that have been added later on, and which existing settings files don't contain
+ */
+template <class T>
+static T getOptional(QSettings &settings, const char *name, const T &defaultValue)
+{
+    if (!settings.contains(name))
+        return defaultValue;
+    return settings.value(name).value<T>();
+}
+
 ServerSettings::ServerSettings()
 {
     const QString serverSettingsFileEnv = qgetenv("SERVER_SETTINGS_FILE");
@@ -69,6 +81,32 @@ ServerSettings::ServerSettings()
     m_cgiLogLevel = getOrCreate<QtMsgType, QString>(*settings, m_valid, "CGI_LOG_LEVEL");
     m_dbserverLogLevel = getOrCreate<QtMsgType, QString>(*settings, m_valid, "DBSERVER_LOG_LEVEL");
 
+    m_maxUploadSize = getOptional<qint64>(*settings, "MAX_UPLOAD_SIZE_MB", 1024) << 20;
+
+    m_httpListenAddress = getOptional<QString>(*settings, "HTTP_LISTEN_ADDRESS", "127.0.0.1");
+
+    m_dbserverWorkerThreads = getOptional<int>(*settings, "DBSERVER_WORKER_THREADS", QThread::idealThreadCount());
+    if (m_dbserverWorkerThreads < 0) {
+        qWarning() << "ServerSettings: DBSERVER_WORKER_THREADS must not be negative";
+        m_valid = false;
+    }
+
+    m_transcodeCacheDir = getOptional<QString>(*settings, "TRANSCODE_CACHE_DIR", m_tempDir + "/transcoded");
+    m_transcodeCacheSize = getOptional<qint64>(*settings, "TRANSCODE_CACHE_SIZE_MB", 2048) << 20;
+    m_transcodeJobs = getOptional<int>(*settings, "TRANSCODE_JOBS", 2);
+    if (m_transcodeJobs < 1) {
+        qWarning() << "ServerSettings: TRANSCODE_JOBS must be at least 1";
+        m_valid = false;
+    }
+
+    m_downloadWorkers = getOptional<int>(*settings, "DOWNLOAD_WORKERS", 3);
+    m_bandcampDownloadJobs = getOptional<int>(*settings, "DOWNLOAD_BANDCAMP_JOBS", 2);
+    m_youtubeDownloadJobs = getOptional<int>(*settings, "DOWNLOAD_YOUTUBE_JOBS", 2);
+    if (m_downloadWorkers < 1 || m_bandcampDownloadJobs < 1 || m_youtubeDownloadJobs < 1) {
+        qWarning() << "ServerSettings: DOWNLOAD_WORKERS, DOWNLOAD_BANDCAMP_JOBS and DOWNLOAD_YOUTUBE_JOBS must be at least 1";
+        m_valid = false;
+    }
+
     delete settings;
 }
 
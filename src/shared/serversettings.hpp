@@ -25,6 +25,9 @@ public:
     QString tempDir() const { return m_tempDir; }
     QString toolsDir() const { return m_toolsDir; }
 
+    /** Largest file that an upload session accepts, as its data file is allocated up front */
+    qint64 maxUploadSize() const { return m_maxUploadSize; }
+
     QString libraryFile() const { return m_libraryFile; }
     QString libraryLogFile() const { return m_libraryLogFile; }
     QString libraryBackupDir() const { return m_libraryBackupDir; }
@@ -38,6 +41,34 @@ public:
     QtMsgType cgiLogLevel() const { return m_cgiLogLevel; }
     QtMsgType dbserverLogLevel() const { return m_dbserverLogLevel; }
 
+    /**
+     * Address the resident HTTP server (--listen) binds to. Requests aren't authenticated,
+     * so by default only a reverse proxy on the same machine can reach it.
+     */
+    QString httpListenAddress() const { return m_httpListenAddress; }
+
+    /**
+     * Number of threads dbserver uses to answer read-only requests.
+     * 0 means that all requests are handled on the main thread.
+     */
+    int dbserverWorkerThreads() const { return m_dbserverWorkerThreads; }
+
+    /**
+     * Where transcoded variants of media files are kept, how much space they
+     * may take up in total, and how many ffmpeg processes may run at once.
+     */
+    QString transcodeCacheDir() const { return m_transcodeCacheDir; }
+    qint64 transcodeCacheSize() const { return m_transcodeCacheSize; }
+    int transcodeJobs() const { return m_transcodeJobs; }
+
+    /**
+     * How many downloads run at once in total, and how many of them may
+     * be talking to the same site.
+     */
+    int downloadWorkers() const { return m_downloadWorkers; }
+    int bandcampDownloadJobs() const { return m_bandcampDownloadJobs; }
+    int youtubeDownloadJobs() const { return m_youtubeDownloadJobs; }
+
 private:
     bool m_valid;
 
@@ -46,6 +77,7 @@ private:
 
     QString m_tempDir;
     QString m_toolsDir;
+    qint64 m_maxUploadSize;
 
     QString m_libraryFile;
     QString m_libraryLogFile;
@@ -59,4 +91,16 @@ private:
 
     QtMsgType m_cgiLogLevel;
     QtMsgType m_dbserverLogLevel;
+
+    QString m_httpListenAddress;
+
+    int m_dbserverWorkerThreads;
+
+    QString m_transcodeCacheDir;
+    qint64 m_transcodeCacheSize;
+    int m_transcodeJobs;
+
+    int m_downloadWorkers;
+    int m_bandcampDownloadJobs;
+    int m_youtubeDownloadJobs;
 };
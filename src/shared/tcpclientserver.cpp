@@ -1,4 +1,5 @@
 #include "tcpclientserver.hpp"
+#include "compression.hpp"
 
 #include <QTcpSocket>
 #include <QJsonDocument>
@@ -6,28 +7,42 @@
 #include <QDate>
 #include <QElapsedTimer>
 #include <QProcess>
+#include <QtEndian>
+#include <QAtomicInteger>
 
-static bool sendData(QTcpSocket &socket, const QByteArray &data)
+static constexpr int FRAME_HEADER_SIZE = 8;
+
+// the upper two bits of the request ID are flags
+static constexpr quint32 FRAME_FLAG_DEFLATED = 0x80000000;
+static constexpr quint32 FRAME_FLAG_ACCEPTS_DEFLATE = 0x40000000;
+static constexpr quint32 FRAME_REQUEST_ID_MASK = 0x3fffffff;
+
+static constexpr qint64 READ_CHUNK_SIZE = 64 * 1024;
+
+static bool sendData(QTcpSocket &socket, quint32 requestId, const QByteArray &data)
 {
-    QDataStream out(&socket);
-    out << (qint32) data.size();
+    // header and payload are handed to the socket separately, without
+    // assembling them into one buffer first
+    uchar header[FRAME_HEADER_SIZE];
+    qToBigEndian<qint32>(data.size(), header);
+    qToBigEndian<quint32>(requestId, header + 4);
 
-    int written = 0;
-    while (written < data.size()) {
-        int sent = out.writeRawData(data.constData() + written, data.size() - written);
-        if (sent < 0)
-            return false;
-        written += sent;
-    }
+    if (socket.write((const char*) header, FRAME_HEADER_SIZE) != FRAME_HEADER_SIZE)
+        return false;
+    if (socket.write(data) != data.size())
+        return false;
 
     socket.flush();
 
     return true;
 }
 
-TcpServer::TcpServer(qint32 maxMessageSize)
+TcpServer::TcpServer(qint32 maxMessageSize, qint64 maxBufferedPerConnection, qint64 maxBufferedTotal, int maxRequestsInFlight)
     : QObject()
     , m_maxMessageSize(maxMessageSize)
+    , m_maxBufferedPerConnection(maxBufferedPerConnection)
+    , m_maxBufferedTotal(maxBufferedTotal)
+    , m_maxRequestsInFlight(maxRequestsInFlight)
 {
     QObject::connect(&m_tcpServer, &QTcpServer::newConnection, this, &TcpServer::onNewConnection);
 }
@@ -59,96 +74,263 @@ void TcpServer::onNewConnection()
 
 void TcpServer::handleConnection(QTcpSocket *socket)
 {
+    // keep Qt from buffering more than a chunk on its own, so that not reading
+    // from the socket actually pushes back on the client
+    socket->setReadBufferSize(READ_CHUNK_SIZE);
+    m_connections.insert(socket, Connection());
+
     connect(socket, &QTcpSocket::readyRead, this, [=]() {
         TcpServer::onNewDataReady(socket);
     });
+    connect(socket, &QTcpSocket::disconnected, this, [=]() {
+        TcpServer::onDisconnected(socket);
+    });
 
     if (socket->bytesAvailable())
         onNewDataReady(socket);
 }
 
-void TcpServer::onNewDataReady(QTcpSocket *socket)
+void TcpServer::onDisconnected(QTcpSocket *socket)
 {
-    auto msg = m_incomingMessages.find(socket);
-    const bool hasMessage = (msg != m_incomingMessages.end());
+    const auto conn = m_connections.find(socket);
+    if (conn == m_connections.end())
+        return;
+
+    // payloads of requests in flight stay accounted for until they get responded to,
+    // only the reservation of the frame that was still arriving is given back
+    if (conn->hasMessage)
+        m_bufferedTotal -= conn->size;
+    m_connections.erase(conn);
+
+    socket->deleteLater();
+    resumePausedConnections();
+}
 
-    // first receive message header
-    if (!hasMessage) {
-        // return early if not enough data is available
-        if (!socket->isValid() || !socket->isReadable()) {
-            qWarning() << "TcpServer: socket not valid while preparing to read";
+void TcpServer::onNewDataReady(QTcpSocket *socket)
+{
+    // drain every complete frame that is already buffered, not just the first one
+    while (true) {
+        auto conn = m_connections.find(socket);
+        if (conn == m_connections.end())
             return;
+
+        // first receive message header
+        if (!conn->hasMessage) {
+            // return early if not enough data is available
+            if (!socket->isValid() || !socket->isReadable()) {
+                qWarning() << "TcpServer: socket not valid while preparing to read";
+                return;
+            }
+
+            if (conn->requestsInFlight >= m_maxRequestsInFlight) {
+                conn->paused = true;
+                return;
+            }
+
+            if (socket->bytesAvailable() < FRAME_HEADER_SIZE)
+                return;
+
+            // only peek at the header, a frame is only taken on once its whole size
+            // fits into the budgets, so partially received frames can't starve others
+            uchar header[FRAME_HEADER_SIZE];
+            if (socket->peek((char*) header, FRAME_HEADER_SIZE) != FRAME_HEADER_SIZE)
+                return;
+            const qint32 size = qFromBigEndian<qint32>(header);
+            const quint32 requestId = qFromBigEndian<quint32>(header + 4);
+
+            // honor maximum message size, and reject frames that could never fit
+            if (size < 0 || size > m_maxMessageSize || size > m_maxBufferedPerConnection || size > m_maxBufferedTotal) {
+                qWarning() << "TcpServer: message size exceeds maximum:" << size;
+                socket->close();
+                return;
+            }
+
+            if (size > m_maxBufferedPerConnection - conn->bufferedBytes || size > m_maxBufferedTotal - m_bufferedTotal) {
+                conn->paused = true;
+                return;
+            }
+
+            socket->read(FRAME_HEADER_SIZE);
+            conn->bufferedBytes += size;
+            m_bufferedTotal += size;
+
+            conn->hasMessage = true;
+            conn->size = size;
+            conn->requestId = requestId & FRAME_REQUEST_ID_MASK;
+            conn->acceptsDeflate = (requestId & FRAME_FLAG_ACCEPTS_DEFLATE);
+            conn->data.clear();
         }
 
-        if (socket->bytesAvailable() < 4)
-            return;
+        // download as much data as is available, growing the buffer only as the data
+        // actually arrives, the budget for all of it has been reserved already
+        const qint64 bytesLeft = conn->size - conn->data.size();
+        const qint64 toRead = qMin(bytesLeft, socket->bytesAvailable());
 
-        qint32 size;
-        QDataStream in(socket);
-        in >> size;
+        if (toRead > 0)
+            conn->data += socket->read(toRead);
 
-        // honor maximum message size
-        if (size > m_maxMessageSize) {
-            qWarning() << "TcpServer: message size exceeds maximum:" << size;
-            socket->close();
-            socket->deleteLater();
+        if (conn->data.size() < conn->size)
             return;
-        }
 
-        msg = m_incomingMessages.insert(socket, IncomingMessage{ size, 0, QByteArray(size, 0) });
+        const PendingRequest request{ socket, conn->requestId, conn->size, conn->acceptsDeflate };
+        const QByteArray data = conn->data;
+        conn->hasMessage = false;
+        conn->data.clear();
+        conn->requestsInFlight += 1;
+
+        handleMessageAsync(request, data);
     }
+}
 
-    // download data
-    const qint32 bytesLeft = msg->size - msg->alreadyAvailable;
-    const qint32 bytesRead = socket->read(msg->data.data() + msg->alreadyAvailable, bytesLeft);
-    msg->alreadyAvailable += bytesRead;
+void TcpServer::handleMessageAsync(const PendingRequest &request, const QByteArray &data)
+{
+    respond(request, handleMessage(data));
+}
 
-    if (msg->alreadyAvailable < msg->size)
+TcpServer::Response TcpServer::compressResponse(bool acceptsDeflate, const QByteArray &data, const QString &label)
+{
+    Response response;
+    response.data = data;
+    if (acceptsDeflate && data.size() >= Compression::MIN_COMPRESSED_SIZE) {
+        const QByteArray deflated = Compression::deflate(data, label.isEmpty() ? QString("unknown") : label);
+        if (deflated.size() < data.size()) {
+            response.data = deflated;
+            response.deflated = true;
+        }
+    }
+    return response;
+}
+
+void TcpServer::respond(const PendingRequest &request, const QByteArray &data, const QString &label)
+{
+    // not worth deflating for a client that is gone already
+    if (!request.socket || request.socket->state() != QAbstractSocket::ConnectedState)
+        respond(request, Response{ data, false });
+    else
+        respond(request, compressResponse(request.acceptsDeflate, data, label));
+}
+
+void TcpServer::respond(const PendingRequest &request, const Response &response)
+{
+    releaseBuffer(request.socket, request.size, true);
+
+    if (!request.socket || request.socket->state() != QAbstractSocket::ConnectedState) {
+        qWarning() << "TcpServer: client disconnected before response to request" << request.requestId;
         return;
+    }
 
-    Q_ASSERT(msg->alreadyAvailable == msg->size);
+    Q_ASSERT(response.data.size() <= m_maxMessageSize);
 
-    const QByteArray response = handleMessage(msg->data);
-    Q_ASSERT(response.size() <= m_maxMessageSize);
-    if (!sendData(*socket, response)) {
+    const quint32 requestId = request.requestId | (response.deflated ? FRAME_FLAG_DEFLATED : 0);
+    if (!sendData(*request.socket, requestId, response.data)) {
         qWarning() << "Error while sending response over TCP";
     }
 
-    // clean up
-    m_incomingMessages.erase(msg);
+    resumePausedConnections();
+}
+
+void TcpServer::releaseBuffer(QTcpSocket *socket, qint64 bytes, bool requestDone)
+{
+    m_bufferedTotal -= bytes;
+
+    const auto conn = m_connections.find(socket);
+    if (conn != m_connections.end()) {
+        conn->bufferedBytes -= bytes;
+        if (requestDone)
+            conn->requestsInFlight -= 1;
+    }
+}
+
+void TcpServer::resumePausedConnections()
+{
+    // responding may happen while we are still draining a socket, in which case
+    // the loop in onNewDataReady() picks up the remaining data anyway
+    const QList<QTcpSocket*> sockets = m_connections.keys();
+    for (QTcpSocket *socket : sockets) {
+        const auto conn = m_connections.find(socket);
+        if (conn != m_connections.end() && conn->paused) {
+            conn->paused = false;
+            QMetaObject::invokeMethod(this, [=]() { onNewDataReady(socket); }, Qt::QueuedConnection);
+        }
+    }
 }
 
 Result<QByteArray, QString> TcpClient::sendMessage(QTcpSocket &socket, const QByteArray &data, int timeout)
 {
+    QVector<Result<QByteArray, QString>> results = sendMessages(socket, { data }, timeout);
+    return results.first();
+}
+
+QVector<Result<QByteArray, QString>> TcpClient::sendMessages(QTcpSocket &socket, const QVector<QByteArray> &messages, int timeout)
+{
+    // clients on several threads may be sending at once
+    static QAtomicInteger<quint32> s_nextRequestId(1);
+
+    QVector<Result<QByteArray, QString>> results(messages.size());
+
+    const auto failAll = [&](const QString &error) {
+        for (Result<QByteArray, QString> &result : results) {
+            if (result.isNull())
+                result = error;
+        }
+        return results;
+    };
+
     if (!socket.waitForConnected(timeout)) {
-        return QString("TcpClient: Unable to connect to ") + socket.peerName() + ", port=" + QString::number(socket.peerPort());
+        return failAll(QString("TcpClient: Unable to connect to ") + socket.peerName() + ", port=" + QString::number(socket.peerPort()));
     }
 
-    // build message
-    if (!sendData(socket, data))
-        return QString("Error while sending message");
+    // send all messages before waiting for any response
+    QHash<quint32, int> pendingRequests;
+    for (int i = 0; i < messages.size(); ++i) {
+        const quint32 requestId = s_nextRequestId.fetchAndAddRelaxed(1) & FRAME_REQUEST_ID_MASK;
+        if (!sendData(socket, requestId | FRAME_FLAG_ACCEPTS_DEFLATE, messages[i]))
+            results[i] = QString("Error while sending message");
+        else
+            pendingRequests[requestId] = i;
+    }
 
     QElapsedTimer timer;
     timer.start();
 
-    socket.waitForReadyRead(timeout);
-    if (socket.bytesAvailable() < 4)
-        return QString("Timeout while waiting for message header (waited %1 msec)").arg(timeout);
+    const auto waitForBytes = [&](qint64 bytes) {
+        while (socket.bytesAvailable() < bytes) {
+            const int msLeft = timeout - timer.elapsed();
+            if (msLeft <= 0 || !socket.waitForReadyRead(msLeft))
+                return socket.bytesAvailable() >= bytes;
+        }
+        return true;
+    };
 
-    qint32 sz;
-    QDataStream in(&socket);
-    in >> sz;
+    // collect responses in whatever order they arrive
+    while (!pendingRequests.isEmpty()) {
+        if (!waitForBytes(FRAME_HEADER_SIZE))
+            return failAll(QString("Timeout while waiting for message header (waited %1 msec)").arg(timeout));
 
-    while (socket.bytesAvailable() < sz) {
-        const int msLeft = timeout - timer.elapsed();
-        if (msLeft <= 0)
-            return QString("Timeout while waiting for message");
-        socket.waitForReadyRead(msLeft);
-    }
+        qint32 sz;
+        quint32 requestIdAndFlags;
+        QDataStream in(&socket);
+        in >> sz >> requestIdAndFlags;
+        const quint32 requestId = requestIdAndFlags & FRAME_REQUEST_ID_MASK;
 
-    const QByteArray bytes = socket.read(sz);
-    if (bytes.size() != sz)
-        return QString("Message size doesn't match");
+        if (!waitForBytes(sz))
+            return failAll(QString("Timeout while waiting for message"));
+
+        const QByteArray bytes = socket.read(sz);
+
+        // responses to requests we don't know about are left-overs from earlier timeouts
+        const auto it = pendingRequests.find(requestId);
+        if (it == pendingRequests.end())
+            continue;
+
+        if (bytes.size() != sz)
+            results[it.value()] = QString("Message size doesn't match");
+        else if (requestIdAndFlags & FRAME_FLAG_DEFLATED)
+            results[it.value()] = Compression::inflate(bytes);
+        else
+            results[it.value()] = bytes;
+        pendingRequests.erase(it);
+    }
 
-    return bytes;
+    return results;
 }
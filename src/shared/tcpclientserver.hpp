@@ -1,42 +1,117 @@
 #pragma once
 
 #include <QTcpServer>
+#include <QPointer>
 
 #include "result.hpp"
 
+/**
+ * Every message goes over the wire as a frame: a qint32 payload size, a quint32 request ID
+ * and the payload itself. The response to a request carries the same request ID, which allows
+ * clients to have multiple requests in flight, and servers to answer them in any order.
+ *
+ * The upper two bits of the request ID are flags: clients set one to announce that they
+ * can inflate responses, and servers set the other on responses whose payload is deflated.
+ */
 class TcpServer : public QObject
 {
     Q_OBJECT
 
 public:
-    TcpServer(qint32 maxMessageSize = 64 * 1024 * 1024);
+    /**
+     * Incoming payloads are buffered as they arrive, within two memory budgets: one per
+     * connection, and one shared by all connections. The whole size of a frame is reserved
+     * against both once its header is read, and stays reserved until its response has been sent.
+     * If a budget is exhausted, or a client has too many unanswered requests, we stop
+     * reading from its socket until the handler has caught up.
+     */
+    TcpServer(qint32 maxMessageSize = 64 * 1024 * 1024,
+              qint64 maxBufferedPerConnection = 64 * 1024 * 1024,
+              qint64 maxBufferedTotal = 256 * 1024 * 1024,
+              int maxRequestsInFlight = 16);
     ~TcpServer() override;
 
     bool listen(quint16 port);
 
 protected:
+    /**
+     * Identifies a request whose response is still to be sent
+     */
+    struct PendingRequest
+    {
+        QPointer<QTcpSocket> socket;
+        quint32 requestId;
+        qint32 size;
+        bool acceptsDeflate;
+    };
+
+    /**
+     * Payload of a response frame, deflated if that's what the flag says
+     */
+    struct Response
+    {
+        QByteArray data;
+        bool deflated = false;
+    };
+
+    /**
+     * Deflates large payloads if the client supports it, label is used for the compression
+     * statistics. Can be called from any thread, so that workers take the cost, not the
+     * thread that serves all the sockets.
+     */
+    static Response compressResponse(bool acceptsDeflate, const QByteArray &data, const QString &label);
+
     /**
      * The data returned will be sent back to the client
      */
     virtual QByteArray handleMessage(const QByteArray &data) = 0;
 
+    /**
+     * Called for every incoming message. Implementations that can't answer right away
+     * may override this and call respond() at a later point.
+     * By default, this responds with the result of handleMessage(data).
+     */
+    virtual void handleMessageAsync(const PendingRequest &request, const QByteArray &data);
+
+    /**
+     * Sends the response for the given request, unless the client has disconnected since.
+     * Must be called exactly once per request, as this also releases its buffer budget.
+     * Large responses are deflated on the spot, see compressResponse().
+     */
+    void respond(const PendingRequest &request, const QByteArray &data, const QString &label = QString());
+    void respond(const PendingRequest &request, const Response &response);
+
 private slots:
     void onNewConnection();
 
 private:
     void handleConnection(QTcpSocket *socket);
+    void onDisconnected(QTcpSocket *socket);
     void onNewDataReady(QTcpSocket *socket);
+    void releaseBuffer(QTcpSocket *socket, qint64 bytes, bool requestDone);
+    void resumePausedConnections();
 
-    struct IncomingMessage
+    struct Connection
     {
-        qint32 size;
-        qint32 alreadyAvailable;
+        bool hasMessage = false;
+        qint32 size = 0;
+        quint32 requestId = 0;
+        bool acceptsDeflate = false;
         QByteArray data;
+
+        qint64 bufferedBytes = 0;
+        int requestsInFlight = 0;
+        bool paused = false;
     };
 
     QTcpServer m_tcpServer;
     qint32 m_maxMessageSize;
-    QHash<QTcpSocket*, IncomingMessage> m_incomingMessages;
+    qint64 m_maxBufferedPerConnection;
+    qint64 m_maxBufferedTotal;
+    int m_maxRequestsInFlight;
+
+    qint64 m_bufferedTotal = 0;
+    QHash<QTcpSocket*, Connection> m_connections;
 };
 
 class TcpClient
@@ -46,4 +121,10 @@ public:
      * Sends the given message and waits for a response for a maximum of timeout seconds.
      */
     static Result<QByteArray, QString> sendMessage(QTcpSocket &socket, const QByteArray &data, int timeout);
+
+    /**
+     * Sends all messages at once, and waits for all responses for a maximum of timeout seconds.
+     * The server may answer in any order, the results are returned in the order of the requests.
+     */
+    static QVector<Result<QByteArray, QString>> sendMessages(QTcpSocket &socket, const QVector<QByteArray> &messages, int timeout);
 };
@@ -0,0 +1,35 @@
+TARGET = downloadtest
+CONFIG += c++11 console
+TEMPLATE = app
+
+QT -= gui
+QT += core network
+
+SOURCES += \
+    main.cpp \
+    \
+    ../../server_library/filetransfer.cpp \
+    \
+    ../../shared/jsonconv.cpp \
+    ../../shared/library.cpp \
+    ../../shared/library_serialize.cpp \
+    ../../shared/library_compact.cpp \
+
+HEADERS += \
+    ../../server_library/download.hpp \
+    ../../server_library/filetransfer.hpp \
+    \
+    ../../shared/flatmap.hpp \
+    ../../shared/jsonconv.hpp \
+    ../../shared/library.hpp \
+    ../../shared/library_types.hpp \
+    ../../shared/library_messages.hpp \
+    ../../shared/nameregistry.hpp \
+    ../../shared/result.hpp \
+    ../../shared/option.hpp \
+
+INCLUDEPATH += \
+    ../../server_library/ \
+    ../../shared/ \
+
+DESTDIR = ../../bin/
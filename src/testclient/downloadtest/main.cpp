@@ -0,0 +1,224 @@
+#include <QCoreApplication>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTemporaryDir>
+#include <QNetworkAccessManager>
+#include <QRegularExpression>
+#include <QTimer>
+#include <QFile>
+#include <QDir>
+#include <QHash>
+#include <QSet>
+#include <QTextStream>
+#include <QDebug>
+
+#include "filetransfer.hpp"
+
+/**
+ * Runs the track downloads of an album against a local stand-in for Bandcamp's
+ * file servers, which serves generated mp3 files slowly enough for the transfers
+ * to overlap, drops some of them halfway and honors Range requests.
+ */
+
+static constexpr int TRACKS = 6;
+static constexpr int TRACK_SIZE = 256 * 1024;
+static constexpr int CHUNK_SIZE = 16 * 1024;
+static constexpr int CHUNK_INTERVAL_MSECS = 5;
+
+/** An ID3 tag followed by frames of noise, which is all a download cares about */
+static QByteArray fixtureMp3(int track)
+{
+    QByteArray data("ID3\x03\x00\x00\x00\x00\x00\x00", 10);
+    quint32 state = 0x9e3779b9u * (track + 1);
+    while (data.size() < TRACK_SIZE) {
+        data.append("\xff\xfb\x90\x64", 4);
+        for (int i = 0; i < 413 && data.size() < TRACK_SIZE; ++i) {
+            state = state * 1664525u + 1013904223u;
+            data.append((char) (state >> 24));
+        }
+    }
+    return data;
+}
+
+class StandIn : public QTcpServer
+{
+public:
+    QHash<QString, QByteArray> files;
+    /** Paths whose first response is cut off halfway */
+    QSet<QString> dropOnce;
+
+    QSet<QString> rangeRequests;
+    int requests = 0;
+    int maxParallel = 0;
+
+    StandIn()
+    {
+        connect(this, &QTcpServer::newConnection, this, [this]() {
+            while (QTcpSocket *socket = nextPendingConnection())
+                connect(socket, &QTcpSocket::readyRead, socket, [this, socket]() { onReadyRead(socket); });
+        });
+    }
+
+    QUrl url(const QString &path) const
+    {
+        return QUrl(QString("http://127.0.0.1:%1%2").arg(serverPort()).arg(path));
+    }
+
+private:
+    void onReadyRead(QTcpSocket *socket)
+    {
+        QByteArray request = socket->property("request").toByteArray() + socket->readAll();
+        socket->setProperty("request", request);
+        if (!request.contains("\r\n\r\n") || socket->property("answered").toBool())
+            return;
+        socket->setProperty("answered", true);
+        requests += 1;
+
+        const QString path = QString::fromUtf8(request.split(' ').value(1));
+        const auto file = files.constFind(path);
+        if (file == files.cend()) {
+            socket->write("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+            socket->disconnectFromHost();
+            return;
+        }
+
+        const QRegularExpressionMatch range = QRegularExpression("\r\nRange: bytes=(\\d+)-", QRegularExpression::CaseInsensitiveOption).match(request);
+        const qint64 offset = range.hasMatch() ? range.captured(1).toLongLong() : 0;
+        if (range.hasMatch())
+            rangeRequests.insert(path);
+        if (offset >= file->size()) {
+            socket->write("HTTP/1.1 416 Range Not Satisfiable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+            socket->disconnectFromHost();
+            return;
+        }
+
+        const QByteArray body = file->mid(offset);
+        QByteArray header = range.hasMatch() ? "HTTP/1.1 206 Partial Content\r\n" : "HTTP/1.1 200 OK\r\n";
+        header += "Content-Type: audio/mpeg\r\nContent-Length: " + QByteArray::number(body.size()) + "\r\n";
+        if (range.hasMatch())
+            header += "Content-Range: bytes " + QByteArray::number(offset) + "-" + QByteArray::number(file->size() - 1) + "/" + QByteArray::number(file->size()) + "\r\n";
+        header += "Connection: close\r\n\r\n";
+        socket->write(header);
+
+        const qint64 end = dropOnce.remove(path) ? body.size() / 2 : body.size();
+        serve(socket, body, end);
+    }
+
+    /** Trickles body[0, end) out, and hangs up once done */
+    void serve(QTcpSocket *socket, const QByteArray &body, qint64 end)
+    {
+        m_parallel += 1;
+        maxParallel = qMax(maxParallel, m_parallel);
+
+        QTimer *timer = new QTimer(socket);
+        connect(timer, &QObject::destroyed, this, [this]() { m_parallel -= 1; });
+        connect(timer, &QTimer::timeout, socket, [=]() {
+            qint64 sent = timer->property("sent").toLongLong();
+            const qint64 size = qMin<qint64>(CHUNK_SIZE, end - sent);
+            socket->write(body.constData() + sent, size);
+            sent += size;
+            timer->setProperty("sent", sent);
+            if (sent < end)
+                return;
+            // cut off responses still promised the whole body, which the client has to notice
+            timer->deleteLater();
+            socket->disconnectFromHost();
+        });
+        connect(socket, &QTcpSocket::disconnected, socket, &QObject::deleteLater);
+        timer->start(CHUNK_INTERVAL_MSECS);
+    }
+
+    int m_parallel = 0;
+};
+
+static int s_failures = 0;
+
+static void check(bool condition, const QString &what)
+{
+    QTextStream(stdout) << (condition ? "PASS " : "FAIL ") << what << "\n";
+    if (!condition)
+        s_failures += 1;
+}
+
+static bool sameContents(const QString &filePath, const QByteArray &expected)
+{
+    QFile file(filePath);
+    return file.open(QIODevice::ReadOnly) && file.readAll() == expected;
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+
+    StandIn standIn;
+    if (!standIn.listen(QHostAddress::LocalHost)) {
+        qWarning() << "Can't listen:" << standIn.errorString();
+        return 1;
+    }
+
+    QTemporaryDir workDir;
+    if (!workDir.isValid()) {
+        qWarning() << "Can't create a temporary directory";
+        return 1;
+    }
+
+    QVector<FileTransfer> transfers;
+    for (int i = 0; i < TRACKS; ++i) {
+        const QString path = "/stream/" + QString::number(i) + ".mp3";
+        standIn.files.insert(path, fixtureMp3(i));
+        transfers << FileTransfer{ standIn.url(path), workDir.filePath(QString::number(i) + ".mp3"), 0 };
+    }
+    const QSet<QString> dropped = { "/stream/1.mp3", "/stream/4.mp3" };
+    standIn.dropOnce = dropped;
+
+    // one track that the last attempt left complete, one it left half done
+    const QByteArray track0 = standIn.files.value("/stream/0.mp3");
+    QFile done(transfers[0].filePath);
+    check(done.open(QIODevice::WriteOnly) && done.write(track0) == track0.size(), "Writing a finished track");
+    done.close();
+    const QByteArray track5 = standIn.files.value("/stream/5.mp3");
+    QFile part(transfers[5].filePath + ".part");
+    check(part.open(QIODevice::WriteOnly) && part.write(track5.left(TRACK_SIZE / 3)) == TRACK_SIZE / 3, "Writing a partial track");
+    part.close();
+
+    QNetworkAccessManager network;
+    QAtomicInt cancelled;
+    DownloadProgress progress;
+    QVector<int> doneOrder;
+
+    Option<QString> error = downloadFiles(network, transfers, cancelled, progress, [&](int index) { doneOrder << index; });
+
+    check(!error, "Downloading the album" + (error ? ": " + error.getValue() : QString()));
+    QSet<int> doneTracks;
+    for (int index : qAsConst(doneOrder))
+        doneTracks.insert(index);
+    check(doneOrder.size() == TRACKS && doneTracks.size() == TRACKS, "Every track is reported once");
+    bool intact = true;
+    for (int i = 0; i < TRACKS; ++i)
+        intact = intact && sameContents(transfers[i].filePath, standIn.files.value("/stream/" + QString::number(i) + ".mp3"));
+    check(intact, "Every track arrives intact");
+    check(QDir(workDir.path()).entryList({ "*.part" }, QDir::Files).isEmpty(), "No partial files are left behind");
+    check(standIn.requests == TRACKS - 1 + dropped.size(), "Finished tracks aren't fetched again");
+    check(standIn.rangeRequests == (dropped + QSet<QString>{ "/stream/5.mp3" }), "Dropped and partial tracks are continued with a range");
+    check(standIn.maxParallel > 1 && standIn.maxParallel <= PARALLEL_TRACK_DOWNLOADS,
+          QString("Tracks are fetched in parallel, %1 at most").arg(standIn.maxParallel));
+    check(progress.tracksDone() == TRACKS, "Progress counts every track");
+    check(progress.bytesReceived() == (TRACKS - 1) * TRACK_SIZE - TRACK_SIZE / 3, "Progress counts only the bytes received");
+
+    // a track that isn't there fails the download once it ran out of attempts
+    QVector<FileTransfer> missing = { FileTransfer{ standIn.url("/stream/missing.mp3"), workDir.filePath("missing.mp3"), 0 } };
+    DownloadProgress missingProgress;
+    error = downloadFiles(network, missing, cancelled, missingProgress, [](int) {});
+    check(error && missing[0].attempts == MAX_TRACK_ATTEMPTS, "Missing tracks fail after every attempt");
+
+    // cancelling stops transfers that are under way, this one would take seconds
+    standIn.files.insert("/stream/long.mp3", QByteArray(64 * TRACK_SIZE, '\0'));
+    QVector<FileTransfer> cancelledTransfers = { FileTransfer{ standIn.url("/stream/long.mp3"), workDir.filePath("long.mp3"), 0 } };
+    DownloadProgress cancelledProgress;
+    QTimer::singleShot(20, [&]() { cancelled.storeRelease(1); });
+    error = downloadFiles(network, cancelledTransfers, cancelled, cancelledProgress, [](int) {});
+    check(error && error.getValue() == "Cancelled" && !QFile::exists(cancelledTransfers[0].filePath), "Cancelled downloads stop");
+
+    QTextStream(stdout) << (s_failures == 0 ? "All checks passed\n" : QString::number(s_failures) + " checks failed\n");
+    return s_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,160 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QTextStream>
+
+#include "library.hpp"
+#include "library_messages.hpp"
+#include "jsonconv.hpp"
+
+using namespace MoosickMessage;
+using Moosick::LibraryChangeRequest;
+
+/**
+ * Replays the type names of a library log through the name registries, and through
+ * the comparison chains they replaced, to see what the lookups cost at startup.
+ */
+
+/** What LibraryChangeRequest::typeFromStr() used to do */
+static bool typeFromStrLinear(const QString &str, LibraryChangeRequest::Type &tp)
+{
+#define HANDLE_CASE(TYPE) if (str == #TYPE) { tp = LibraryChangeRequest::TYPE; return true; }
+    HANDLE_CASE(SongAdd)
+    HANDLE_CASE(SongRemove)
+    HANDLE_CASE(SongSetName)
+    HANDLE_CASE(SongSetPosition)
+    HANDLE_CASE(SongSetLength)
+    HANDLE_CASE(SongSetFileEnding)
+    HANDLE_CASE(SongSetHandle)
+    HANDLE_CASE(SongSetAlbum)
+    HANDLE_CASE(SongAddTag)
+    HANDLE_CASE(SongRemoveTag)
+    HANDLE_CASE(AlbumAdd)
+    HANDLE_CASE(AlbumRemove)
+    HANDLE_CASE(AlbumSetName)
+    HANDLE_CASE(AlbumSetArtist)
+    HANDLE_CASE(AlbumAddTag)
+    HANDLE_CASE(AlbumRemoveTag)
+    HANDLE_CASE(ArtistAdd)
+    HANDLE_CASE(ArtistAddOrGet)
+    HANDLE_CASE(ArtistRemove)
+    HANDLE_CASE(ArtistSetName)
+    HANDLE_CASE(ArtistAddTag)
+    HANDLE_CASE(ArtistRemoveTag)
+    HANDLE_CASE(TagAdd)
+    HANDLE_CASE(TagRemove)
+    HANDLE_CASE(TagSetName)
+    HANDLE_CASE(TagSetParent)
+#undef HANDLE_CASE
+    return false;
+}
+
+/** What Message::fromJson() used to do before decoding the message itself */
+static bool messageTypeLinear(const QString &id, Type &type)
+{
+    for (quint32 i = 0; i <= (quint32) Type::DownloadPriorityRequestInternal; ++i) {
+        if (id == typeString((Type) i)) {
+            type = (Type) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/** Runs lookup over all items, iterations times, and returns nanoseconds per lookup */
+template <class Items, class Lookup>
+static double measure(const Items &items, int iterations, const Lookup &lookup)
+{
+    int found = 0;
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < iterations; ++i) {
+        for (const auto &item : items)
+            found += lookup(item) ? 1 : 0;
+    }
+    const qint64 nsecs = timer.nsecsElapsed();
+
+    if (found != iterations * items.size())
+        qWarning() << "Only found" << found << "of" << iterations * items.size() << "items";
+    return (double) nsecs / qMax(1, iterations * items.size());
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    parser.addPositionalArgument("log", "Library log file, as written by dbserver");
+    const QCommandLineOption iterationsOption("iterations", "How often to replay the log", "count", "20");
+    parser.addOption(iterationsOption);
+    parser.process(app);
+
+    if (parser.positionalArguments().size() != 1)
+        parser.showHelp(1);
+
+    QFile logFile(parser.positionalArguments().first());
+    if (!logFile.open(QIODevice::ReadOnly)) {
+        qWarning() << "Can't open" << logFile.fileName();
+        return 1;
+    }
+
+    // the log is a list of objects without the enclosing brackets, see Server::appendToLog()
+    Result<QJsonArray, EnjsonError> log = jsonDeserializeArray("[\n" + logFile.readAll() + "\n]\n");
+    if (!log.hasValue()) {
+        qWarning().noquote() << "Failed to parse log:" << log.takeError().toString();
+        return 1;
+    }
+
+    QStringList changeTypes;
+    for (const QJsonValue &entry : log.getValue())
+        changeTypes << entry.toObject().value("type").toString();
+
+    // names as they arrive from clients, in the proportions of a library sync
+    QStringList messageTypes;
+    for (int i = 0; i < changeTypes.size(); ++i)
+        messageTypes << typeString((Type) (i % ((quint32) Type::DownloadPriorityRequestInternal + 1)));
+
+    const int iterations = parser.value(iterationsOption).toInt();
+    QTextStream out(stdout);
+    out << "Replaying " << changeTypes.size() << " log entries " << iterations << " times\n";
+
+    LibraryChangeRequest::Type changeType;
+    const double changeLinear = measure(changeTypes, iterations, [&](const QString &name) { return typeFromStrLinear(name, changeType); });
+    const double changeRegistry = measure(changeTypes, iterations, [&](const QString &name) { return LibraryChangeRequest::typeFromStr(name, changeType); });
+    out << "Change types:  comparisons " << changeLinear << " ns, registry " << changeRegistry << " ns per lookup\n";
+
+    // the message registry is internal to Message, so it is measured along with decoding
+    // messages that have nothing else to decode
+    Type messageType;
+    const double messageLinear = measure(messageTypes, iterations, [&](const QString &name) { return messageTypeLinear(name, messageType); });
+    const QVector<QByteArray> messages = {
+        Message(Ping()).toJson(),
+        Message(LibraryRequest()).toJson(),
+        Message(MediaUrlRequest()).toJson(),
+        Message(IdRequest()).toJson(),
+        Message(DownloadQuery()).toJson(),
+    };
+    QVector<QByteArray> messageData;
+    for (int i = 0; i < changeTypes.size(); ++i)
+        messageData << messages[i % messages.size()];
+    const double messageDecode = measure(messageData, iterations, [&](const QByteArray &data) {
+        return Message::decode(data).hasValue();
+    });
+    out << "Message types: comparisons " << messageLinear << " ns per lookup, registry and decoding " << messageDecode << " ns per message\n";
+
+    // the whole thing, which is what dbserver and the app do with the log at startup
+    QElapsedTimer timer;
+    timer.start();
+    int changes = 0;
+    for (int i = 0; i < iterations; ++i) {
+        for (const QJsonValue &entry : log.getValue())
+            changes += dejson<Moosick::CommittedLibraryChange>(entry).hasValue() ? 1 : 0;
+    }
+    out << "Decoding:      " << (double) timer.nsecsElapsed() / qMax(1, changes) << " ns per log entry\n";
+
+    return 0;
+}
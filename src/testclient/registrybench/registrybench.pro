@@ -0,0 +1,29 @@
+TARGET = registrybench
+CONFIG += c++11 console
+TEMPLATE = app
+
+QT -= gui
+QT += core
+
+SOURCES += \
+    main.cpp \
+    \
+    ../../shared/jsonconv.cpp \
+    ../../shared/library.cpp \
+    ../../shared/library_serialize.cpp \
+    ../../shared/library_compact.cpp \
+
+HEADERS += \
+    ../../shared/flatmap.hpp \
+    ../../shared/jsonconv.hpp \
+    ../../shared/library.hpp \
+    ../../shared/library_types.hpp \
+    ../../shared/library_messages.hpp \
+    ../../shared/nameregistry.hpp \
+    ../../shared/result.hpp \
+    ../../shared/option.hpp \
+
+INCLUDEPATH += \
+    ../../shared/ \
+
+DESTDIR = ../../bin/
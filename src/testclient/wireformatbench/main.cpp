@@ -0,0 +1,86 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QCborValue>
+#include <QCborMap>
+#include <QTextStream>
+#include <QDebug>
+
+#include "library.hpp"
+#include "library_messages.hpp"
+#include "jsonconv.hpp"
+
+using namespace MoosickMessage;
+
+/**
+ * Encodes and decodes the LibraryResponse of a library file in each wire format, and
+ * CBOR also the way it used to be done, through a QCborValue copy of the JSON tree.
+ */
+
+/** Runs work iterations times, and returns microseconds per run */
+template <class Work>
+static double measure(int iterations, const Work &work)
+{
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < iterations; ++i)
+        work();
+    return (double) timer.nsecsElapsed() / 1000 / qMax(1, iterations);
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    parser.addPositionalArgument("library", "Library file, as written by dbserver");
+    const QCommandLineOption iterationsOption("iterations", "How often to encode and decode", "count", "20");
+    parser.addOption(iterationsOption);
+    parser.process(app);
+
+    if (parser.positionalArguments().size() != 1)
+        parser.showHelp(1);
+
+    QFile libraryFile(parser.positionalArguments().first());
+    if (!libraryFile.open(QIODevice::ReadOnly)) {
+        qWarning() << "Can't open" << libraryFile.fileName();
+        return 1;
+    }
+
+    Result<Moosick::SerializedLibrary, EnjsonError> library = dejsonFromString<Moosick::SerializedLibrary>(libraryFile.readAll());
+    if (!library.hasValue()) {
+        qWarning().noquote() << "Failed to parse library:" << library.takeError().toString();
+        return 1;
+    }
+
+    LibraryResponse response;
+    response.version = library->version;
+    response.libraryJson = library->libraryJson;
+    const Message message(response);
+
+    const int iterations = parser.value(iterationsOption).toInt();
+    const QByteArray json = message.toJson();
+    const QByteArray cbor = message.toCbor();
+
+    const auto cborViaTree = [&]() {
+        QJsonObject obj;
+        obj["id"] = typeString(Type::LibraryResponse);
+        obj["data"] = message.as<LibraryResponse>()->enjson();
+        return QCborMap::fromJsonObject(obj).toCborValue().toCbor();
+    };
+    if (QCborValue::fromCbor(cborViaTree()) != QCborValue::fromCbor(cbor))
+        qWarning() << "Streamed CBOR differs from the converted tree";
+
+    QTextStream out(stdout);
+    out << "LibraryResponse: " << json.size() << " bytes of JSON, " << cbor.size() << " bytes of CBOR\n";
+    out << "Encoding: JSON " << measure(iterations, [&]() { message.toJson(); }) << " us, "
+        << "CBOR via QCborValue " << measure(iterations, cborViaTree) << " us, "
+        << "CBOR streamed " << measure(iterations, [&]() { message.toCbor(); }) << " us\n";
+    out << "Decoding: JSON " << measure(iterations, [&]() { Message::fromJson(json); }) << " us, "
+        << "CBOR via QCborValue " << measure(iterations, [&]() { QCborValue::fromCbor(cbor).toMap().toJsonObject(); }) << " us (without the message itself), "
+        << "CBOR streamed " << measure(iterations, [&]() { Message::fromCbor(cbor); }) << " us\n";
+
+    return 0;
+}
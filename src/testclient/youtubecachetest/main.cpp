@@ -0,0 +1,137 @@
+#include <QCoreApplication>
+#include <QTemporaryDir>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QThread>
+#include <QFile>
+#include <QTextStream>
+#include <QDebug>
+
+#include "youtubecache.hpp"
+
+using namespace MoosickMessage;
+
+/**
+ * Looks up videos through a stand-in for youtube-dl, which counts how often it runs and
+ * hands out URLs that expire after a configurable time, to check what the cache saves us.
+ */
+
+static const char *s_stubScript =
+        "#!/bin/sh\n"
+        "dir=$(dirname \"$0\")\n"
+        "echo run >> \"$dir/runs\"\n"
+        "sleep 1\n"
+        "expire=$(( $(date +%s) + $(cat \"$dir/ttl\") ))\n"
+        "printf '{\"title\":\"Stub\",\"duration\":60,\"formats\":[{\"format\":\"251 - audio only\",\"filesize\":1000,"
+        "\"url\":\"https://example.com/audio?expire=%s\"}]}\\n' \"$expire\"\n";
+
+// URLs are given up on half an hour before they expire
+static constexpr int EXPIRY_MARGIN_SECS = 30 * 60;
+
+static int s_failures = 0;
+
+static void check(bool condition, const QString &what)
+{
+    QTextStream(stdout) << (condition ? "PASS " : "FAIL ") << what << "\n";
+    if (!condition)
+        s_failures += 1;
+}
+
+class Stub
+{
+public:
+    Stub(const QString &dir) : m_dir(dir) {}
+
+    bool install() const
+    {
+        QFile script(m_dir + "/youtube-dl");
+        return script.open(QIODevice::WriteOnly) && script.write(s_stubScript) > 0
+                && script.setPermissions(QFile::ReadOwner | QFile::WriteOwner | QFile::ExeOwner);
+    }
+
+    /** How long the URLs handed out from now on stay valid */
+    void setTtl(int secs) const
+    {
+        QFile ttl(m_dir + "/ttl");
+        if (ttl.open(QIODevice::WriteOnly))
+            ttl.write(QByteArray::number(secs));
+    }
+
+    int runs() const
+    {
+        QFile runs(m_dir + "/runs");
+        return runs.open(QIODevice::ReadOnly) ? runs.readAll().count('\n') : 0;
+    }
+
+private:
+    QString m_dir;
+};
+
+class LookupTask : public QRunnable
+{
+public:
+    LookupTask(const QString &toolsDir, const QString &cacheDir, const QString &videoId, QAtomicInt &found)
+        : m_toolsDir(toolsDir), m_cacheDir(cacheDir), m_videoId(videoId), m_found(found) {}
+
+    void run() override
+    {
+        // a cache of its own, like every request gets
+        if (YoutubeUrlCache(m_toolsDir, m_cacheDir).lookup(m_videoId).getType() == Type::YoutubeUrlResponse)
+            m_found.fetchAndAddOrdered(1);
+    }
+
+private:
+    QString m_toolsDir;
+    QString m_cacheDir;
+    QString m_videoId;
+    QAtomicInt &m_found;
+};
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+
+    QTemporaryDir toolsDir;
+    QTemporaryDir cacheDir;
+    if (!toolsDir.isValid() || !cacheDir.isValid()) {
+        qWarning() << "Can't create a temporary directory";
+        return 1;
+    }
+
+    const Stub stub(toolsDir.path());
+    if (!stub.install()) {
+        qWarning() << "Can't install the youtube-dl stub";
+        return 1;
+    }
+    stub.setTtl(EXPIRY_MARGIN_SECS + 3600);
+
+    YoutubeUrlCache cache(toolsDir.path(), cacheDir.path());
+
+    const Message first = cache.lookup("aaaaaaaaaaa");
+    const YoutubeUrlResponse *response = first.as<YoutubeUrlResponse>();
+    check(response && response->url->startsWith("https://example.com/audio"), "Looking up a video");
+    check(stub.runs() == 1, "youtube-dl runs for the first lookup");
+
+    check(cache.lookup("aaaaaaaaaaa").getType() == Type::YoutubeUrlResponse && stub.runs() == 1, "Cached videos are looked up without youtube-dl");
+    check(cache.prefetch({ "aaaaaaaaaaa", "../nothing" }) == 0, "Cached and invalid videos aren't prefetched");
+
+    // expires two seconds after it was looked up
+    stub.setTtl(EXPIRY_MARGIN_SECS + 2);
+    cache.lookup("bbbbbbbbbbb");
+    cache.lookup("bbbbbbbbbbb");
+    check(stub.runs() == 2, "Videos are cached until shortly before they expire");
+    QThread::sleep(3);
+    check(cache.lookup("bbbbbbbbbbb").getType() == Type::YoutubeUrlResponse && stub.runs() == 3, "Expired videos are looked up again");
+
+    stub.setTtl(EXPIRY_MARGIN_SECS + 3600);
+    QThreadPool pool;
+    pool.setMaxThreadCount(4);
+    QAtomicInt found;
+    for (int i = 0; i < 4; ++i)
+        pool.start(new LookupTask(toolsDir.path(), cacheDir.path(), "ccccccccccc", found));
+    pool.waitForDone();
+    check(found.loadAcquire() == 4 && stub.runs() == 4, "Concurrent lookups of a video share one youtube-dl run");
+
+    QTextStream(stdout) << (s_failures == 0 ? "All checks passed\n" : QString::number(s_failures) + " checks failed\n");
+    return s_failures == 0 ? 0 : 1;
+}
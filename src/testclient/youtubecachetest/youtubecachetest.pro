@@ -0,0 +1,36 @@
+TARGET = youtubecachetest
+CONFIG += c++11 console
+TEMPLATE = app
+
+QT -= gui
+QT += core
+
+SOURCES += \
+    main.cpp \
+    \
+    ../../server_cgi/youtubecache.cpp \
+    \
+    ../../shared/jsonconv.cpp \
+    ../../shared/library.cpp \
+    ../../shared/library_serialize.cpp \
+    ../../shared/library_compact.cpp \
+    ../../shared/processrunner.cpp \
+
+HEADERS += \
+    ../../server_cgi/youtubecache.hpp \
+    \
+    ../../shared/flatmap.hpp \
+    ../../shared/jsonconv.hpp \
+    ../../shared/library.hpp \
+    ../../shared/library_types.hpp \
+    ../../shared/library_messages.hpp \
+    ../../shared/nameregistry.hpp \
+    ../../shared/processrunner.hpp \
+    ../../shared/result.hpp \
+    ../../shared/option.hpp \
+
+INCLUDEPATH += \
+    ../../server_cgi/ \
+    ../../shared/ \
+
+DESTDIR = ../../bin/
@@ -0,0 +1,268 @@
+#include "chunkedupload.hpp"
+
+#include <QCoreApplication>
+#include <QFileInfo>
+#include <QCryptographicHash>
+#include <QTimer>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QPointer>
+#include <QDebug>
+
+#include <functional>
+
+using namespace MoosickMessage;
+
+static constexpr qint64 CHUNK_SIZE = 4 << 20;
+static constexpr int MAX_PARALLEL_CHUNKS = 3;
+static constexpr int MAX_RETRIES = 5;
+
+class HashTask : public QRunnable
+{
+public:
+    HashTask(const std::function<void()> &function) : m_function(function) {}
+
+    void run() override { m_function(); }
+
+private:
+    std::function<void()> m_function;
+};
+
+ChunkedUpload::ChunkedUpload(Connection *connection, const FileEntry &fileEntry, QObject *parent)
+    : QObject(parent)
+    , m_connection(connection)
+    , m_fileEntry(fileEntry)
+    , m_file(fileEntry.path)
+{
+    connect(m_connection, &Connection::networkReplyFinished, this, &ChunkedUpload::onNetworkReplyFinished);
+}
+
+ChunkedUpload::~ChunkedUpload()
+{
+    // aborting finishes the replies, which we don't want to hear about anymore
+    disconnect(m_connection, nullptr, this, nullptr);
+
+    if (m_controlReply)
+        m_chunkReplies << m_controlReply;
+    for (QNetworkReply *reply : qAsConst(m_chunkReplies)) {
+        reply->abort();
+        reply->deleteLater();
+    }
+}
+
+void ChunkedUpload::start()
+{
+    if (!m_file.open(QIODevice::ReadOnly)) {
+        fail("Can't open " + m_fileEntry.path);
+        return;
+    }
+
+    // reading the whole file takes a while, which the GUI shouldn't notice
+    const QString path = m_fileEntry.path;
+    const QPointer<ChunkedUpload> self(this);
+    QThreadPool::globalInstance()->start(new HashTask([=]() {
+        QFile file(path);
+        QCryptographicHash hash(QCryptographicHash::Sha256);
+        const bool ok = file.open(QIODevice::ReadOnly) && hash.addData(&file);
+        const QByteArray sha256 = ok ? hash.result() : QByteArray();
+        QMetaObject::invokeMethod(qApp, [=]() {
+            if (self)
+                self->onHashed(sha256);
+        }, Qt::QueuedConnection);
+    }));
+}
+
+void ChunkedUpload::onHashed(const QByteArray &sha256)
+{
+    if (sha256.isEmpty()) {
+        fail("Can't read " + m_fileEntry.path);
+        return;
+    }
+    m_sha256 = sha256;
+
+    // continue where a previous attempt left off, if the server still has the session
+    m_sessionId = m_settings.value(settingsKey()).toString();
+    if (m_sessionId.isEmpty())
+        begin();
+    else
+        query();
+}
+
+UploadSessionBegin ChunkedUpload::beginRequest() const
+{
+    UploadSessionBegin request;
+    request.title = m_fileEntry.title;
+    request.duration = m_fileEntry.duration;
+    request.position = m_fileEntry.position;
+    request.albumName = m_fileEntry.album;
+    request.artistName = m_fileEntry.artist;
+    request.fileEnding = QFileInfo(m_fileEntry.path).suffix();
+    request.fileSize = m_file.size();
+    return request;
+}
+
+QString ChunkedUpload::settingsKey() const
+{
+    // a session carries the metadata it was begun with, so edited tags need a new one
+    const QByteArray metadata = QCryptographicHash::hash(Message(beginRequest()).toJson(), QCryptographicHash::Sha1);
+    return "uploadSessions/" + QString::fromLatin1(m_sha256.toHex()) + "-" + QString::fromLatin1(metadata.toHex());
+}
+
+void ChunkedUpload::send(const Message &message)
+{
+    Q_ASSERT(!m_controlReply);
+    m_controlReply = m_connection->post(message.toJson());
+}
+
+void ChunkedUpload::begin()
+{
+    m_sessionId.clear();
+    send(beginRequest());
+}
+
+void ChunkedUpload::query()
+{
+    UploadSessionQuery request;
+    request.sessionId = m_sessionId;
+    send(request);
+}
+
+void ChunkedUpload::sendChunks()
+{
+    while (m_chunkReplies.size() < MAX_PARALLEL_CHUNKS && !m_missingChunks.isEmpty()) {
+        const Range chunk = m_missingChunks.takeFirst();
+
+        QByteArray data;
+        if (m_file.seek(chunk.first))
+            data = m_file.read(chunk.second);
+        if (data.size() != chunk.second) {
+            fail("Can't read " + m_fileEntry.path);
+            return;
+        }
+
+        UploadChunk request;
+        request.sessionId = m_sessionId;
+        request.offset = chunk.first;
+
+        const QByteArray msgJson = Message(request).toJson();
+        const QByteArray msg64 = msgJson.toBase64(QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals);
+        m_chunkReplies << m_connection->post(data, "message64=" + msg64);
+    }
+
+    if (!m_chunkReplies.isEmpty())
+        return;
+
+    // all chunks are through, either ask what's missing or finish up
+    if (m_chunkFailed) {
+        m_chunkFailed = false;
+        retry("Failed to send chunks");
+        return;
+    }
+
+    UploadSessionFinish request;
+    request.sessionId = m_sessionId;
+    request.sha256 = QString::fromLatin1(m_sha256.toHex());
+    send(request);
+}
+
+void ChunkedUpload::retry(const QString &error)
+{
+    if (++m_retries > MAX_RETRIES) {
+        fail(error);
+        return;
+    }
+
+    qWarning().noquote() << error << "- retrying" << m_fileEntry.displayPath;
+    QTimer::singleShot(2000 * m_retries, this, [=]() {
+        if (m_sessionId.isEmpty())
+            begin();
+        else
+            query();
+    });
+}
+
+void ChunkedUpload::fail(const QString &error)
+{
+    emit failed(error);
+}
+
+void ChunkedUpload::onNetworkReplyFinished(QNetworkReply *reply)
+{
+    if (reply == m_controlReply) {
+        m_controlReply = nullptr;
+        reply->deleteLater();
+        onControlReply(reply);
+    }
+    else if (m_chunkReplies.remove(reply)) {
+        reply->deleteLater();
+        onChunkReply(reply);
+    }
+}
+
+void ChunkedUpload::onControlReply(QNetworkReply *reply)
+{
+    Result<Message, QString> result = m_connection->tryParseReply(reply);
+    if (result.hasError()) {
+        retry(result.getError());
+        return;
+    }
+
+    if (const UploadSessionResponse *response = result->as<UploadSessionResponse>()) {
+        onSessionResponse(response);
+    }
+    else if (const UploadSongResponse *response = result->as<UploadSongResponse>()) {
+        m_settings.remove(settingsKey());
+        emit succeeded(response->songId);
+    }
+    else if (const Error *error = result->as<Error>()) {
+        // the session may have been cleaned up in the meantime, start over once
+        if (!m_sessionId.isEmpty() && *error->errorMessage == "No such upload session") {
+            m_settings.remove(settingsKey());
+            begin();
+            return;
+        }
+        if (*error->errorMessage == "Upload is incomplete") {
+            retry(error->errorMessage);
+            return;
+        }
+        fail(error->errorMessage);
+    }
+    else {
+        fail(QString("Unexpected response: ") + result->getTypeString());
+    }
+}
+
+void ChunkedUpload::onSessionResponse(const UploadSessionResponse *response)
+{
+    m_sessionId = response->sessionId;
+    m_settings.setValue(settingsKey(), m_sessionId);
+
+    // send whatever lies between the ranges that arrived already
+    m_missingChunks.clear();
+    qint64 offset = 0;
+    const auto addMissing = [&](qint64 end) {
+        while (offset < end) {
+            const qint64 size = qMin(CHUNK_SIZE, end - offset);
+            m_missingChunks << Range(offset, size);
+            offset += size;
+        }
+    };
+    for (const Range &range : *response->receivedRanges) {
+        addMissing(range.first);
+        offset = qMax(offset, range.first + range.second);
+    }
+    addMissing(response->fileSize);
+
+    sendChunks();
+}
+
+void ChunkedUpload::onChunkReply(QNetworkReply *reply)
+{
+    Result<Message, QString> result = m_connection->tryParseReply(reply);
+    if (result.hasError() || !result->as<UploadSessionResponse>()) {
+        qWarning().noquote() << "Chunk failed:" << (result.hasError() ? result.getError() : result->getTypeString());
+        m_chunkFailed = true;
+    }
+
+    sendChunks();
+}
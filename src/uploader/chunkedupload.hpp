@@ -0,0 +1,66 @@
+#pragma once
+
+#include <QObject>
+#include <QFile>
+#include <QSet>
+#include <QSettings>
+
+#include "fileview.hpp"
+#include "connection.hpp"
+
+/**
+ * Uploads one file through an upload session, sending several chunks at a time.
+ *
+ * Chunks that fail are sent again after asking the server what it already has,
+ * and the session ID is remembered per file content and metadata, so that an upload
+ * that was interrupted picks up where it left off, even after a restart.
+ */
+class ChunkedUpload : public QObject
+{
+    Q_OBJECT
+
+public:
+    ChunkedUpload(Connection *connection, const FileEntry &fileEntry, QObject *parent = nullptr);
+    ~ChunkedUpload() override;
+
+    void start();
+
+signals:
+    void succeeded(quint32 songId);
+    void failed(const QString &error);
+
+private slots:
+    void onNetworkReplyFinished(QNetworkReply *reply);
+
+private:
+    using Range = MoosickMessage::UploadSessionResponse::Range;
+
+    void onHashed(const QByteArray &sha256);
+
+    void send(const MoosickMessage::Message &message);
+    void sendChunks();
+    void begin();
+    void query();
+    void retry(const QString &error);
+    void fail(const QString &error);
+
+    void onSessionResponse(const MoosickMessage::UploadSessionResponse *response);
+    void onControlReply(QNetworkReply *reply);
+    void onChunkReply(QNetworkReply *reply);
+
+    MoosickMessage::UploadSessionBegin beginRequest() const;
+    QString settingsKey() const;
+
+    Connection *m_connection;
+    FileEntry m_fileEntry;
+    QFile m_file;
+    QByteArray m_sha256;
+    QString m_sessionId;
+    QSettings m_settings;
+
+    QVector<Range> m_missingChunks;
+    QSet<QNetworkReply*> m_chunkReplies;
+    QNetworkReply *m_controlReply = nullptr;
+    bool m_chunkFailed = false;
+    int m_retries = 0;
+};
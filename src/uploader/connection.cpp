@@ -52,6 +52,7 @@ QNetworkReply *Connection::post(const QByteArray &postData, const QByteArray &qu
 
     QNetworkRequest request(url);
     request.setHeader(QNetworkRequest::ContentTypeHeader, "text/plain");
+    request.setRawHeader("Accept", wireFormatMimeType(WireFormat::Cbor) + ", " + wireFormatMimeType(WireFormat::Json));
 
     return m_network->post(request, postData);
 }
@@ -61,7 +62,7 @@ Result<Message, QString> Connection::tryParseReply(QNetworkReply *reply)
     if (reply->error() != QNetworkReply::NoError)
         return reply->errorString();
 
-    auto response = MoosickMessage::Message::fromJson(reply->readAll());
+    auto response = MoosickMessage::Message::decode(reply->readAll());
     if (response.hasError())
         return response.getError().toString();
 
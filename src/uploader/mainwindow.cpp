@@ -35,8 +35,6 @@ MainWindow::MainWindow(Connection *connection, QWidget *parent)
     , m_connection(connection)
     , m_fileView(new FileView())
 {
-    connect(m_connection, &Connection::networkReplyFinished, this, &MainWindow::onNetworkReplyFinished);
-
     QWidget *centralWidget = new QWidget();
     setCentralWidget(centralWidget);
 
@@ -199,23 +197,23 @@ void MainWindow::startNextUpload()
         return;
     }
 
-    QFile file(fileEntry.path);
-    if (!file.open(QIODevice::ReadOnly))
-        startNextUpload();
-
-    MoosickMessage::UploadSongRequest request;
-    request.title = fileEntry.title;
-    request.duration = fileEntry.duration;
-    request.position = fileEntry.position;
-    request.albumName = fileEntry.album;
-    request.artistName = fileEntry.artist;
-    request.fileEnding = QFileInfo(fileEntry.path).suffix();
-    request.fileSize = QFileInfo(fileEntry.path).size();
-
-    const QByteArray msgJson = MoosickMessage::Message(request).toJson();
-    const QByteArray msg64 = msgJson.toBase64(QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals);
+    m_currentUpload = new ChunkedUpload(m_connection, fileEntry, this);
+    connect(m_currentUpload, &ChunkedUpload::succeeded, this, [=](quint32 songId) {
+        qWarning() << "Created SongID:" << songId;
+        finishUpload();
+    });
+    connect(m_currentUpload, &ChunkedUpload::failed, this, [=](const QString &error) {
+        qWarning().noquote() << "Failed to upload" << fileEntry.displayPath << ":" << error;
+        finishUpload();
+    });
+    m_currentUpload->start();
+}
 
-    m_currentUpload = m_connection->post(file.readAll(), "message64=" + msg64);
+void MainWindow::finishUpload()
+{
+    m_currentUpload->deleteLater();
+    m_currentUpload = nullptr;
+    startNextUpload();
 }
 
 void MainWindow::cancelUploads()
@@ -224,34 +222,6 @@ void MainWindow::cancelUploads()
     m_uploadProgress.reset();
 }
 
-void MainWindow::onNetworkReplyFinished(QNetworkReply *reply)
-{
-    reply->deleteLater();
-
-    qWarning() << "Received response" << reply << m_currentUpload;
-
-    if (m_currentUpload == reply) {
-        m_currentUpload = nullptr;
-
-        auto result = m_connection->tryParseReply(reply);
-        if (result.hasError()) {
-            qWarning() << result.getError();
-            startNextUpload();
-            return;
-        }
-
-        if (result->getType() == MoosickMessage::Type::Error) {
-            qWarning() << result->as<MoosickMessage::Error>()->errorMessage;
-            startNextUpload();
-            return;
-        }
-
-        const MoosickMessage::UploadSongResponse *response = result->as<MoosickMessage::UploadSongResponse>();
-        qWarning() << "Created SongID:" << response->songId;
-        startNextUpload();
-    }
-}
-
 void MainWindow::onUploadClicked()
 {
     if (m_currentUpload)
@@ -5,6 +5,7 @@
 
 #include "fileview.hpp"
 #include "connection.hpp"
+#include "chunkedupload.hpp"
 
 class MainWindow : public QMainWindow
 {
@@ -18,7 +19,6 @@ private slots:
     void onAddFileClicked();
     void onAddDirClicked();
     void onUploadClicked();
-    void onNetworkReplyFinished(QNetworkReply *reply);
 
 private:
     Connection *m_connection;
@@ -28,10 +28,11 @@ private:
 
     void addFilesToTableView(const QString &baseDir, const QStringList &files);
 
-    QNetworkReply *m_currentUpload = nullptr;
+    ChunkedUpload *m_currentUpload = nullptr;
     QVector<FileEntry> m_filesToUpload;
     QScopedPointer<QProgressDialog> m_uploadProgress;
 
     void startNextUpload();
+    void finishUpload();
     void cancelUploads();
 };
@@ -8,16 +8,19 @@ SOURCES += \
     main.cpp \
     mainwindow.cpp \
     connection.cpp \
+    chunkedupload.cpp \
     connectiondialog.cpp \
     fileview.cpp \
     \
     ../shared/jsonconv.cpp \
     ../shared/library.cpp \
     ../shared/library_serialize.cpp \
+    ../shared/library_compact.cpp \
 
 HEADERS += \
     mainwindow.hpp \
     connection.hpp \
+    chunkedupload.hpp \
     connectiondialog.hpp \
     fileview.hpp \
     \
@@ -26,6 +29,7 @@ HEADERS += \
     ../shared/library.hpp \
     ../shared/library_types.hpp \
     ../shared/library_messages.hpp \
+    ../shared/nameregistry.hpp \
     ../shared/result.hpp \
     ../shared/option.hpp \
 